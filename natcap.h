@@ -97,6 +97,15 @@ struct natcap_TCPOPT_peer {
 	u8 timeval[0];
 };
 
+/* one ICMP echo coalesced in the payload of a batched peer ping/pong */
+struct natcap_peer_ping_rec {
+	u16 len;
+	u16 icmp_id;
+	u16 icmp_sequence;
+	u16 icmp_payload_len;
+	u8 timeval[16];
+};
+
 #define NATCAP_TCPOPT_SYN (1<<7)
 #define NATCAP_TCPOPT_TARGET (1<<6)
 #define NATCAP_TCPOPT_SPROXY (1<<5)
@@ -123,6 +132,8 @@ struct natcap_TCPOPT {
 		} user;
 		struct {
 #define NATCAP_TCPOPT_TYPE_PEER 6
+/* a peer ping/pong whose payload is a list of natcap_peer_ping_rec */
+#define NATCAP_TCPOPT_TYPE_PEER_BATCH 7
 			struct natcap_TCPOPT_peer data;
 		} peer;
 	};
@@ -168,6 +179,8 @@ struct natcap_session {
 #define NS_NATCAP_ENC_BIT 15
 #define NS_NATCAP_ENC (1 << NS_NATCAP_ENC_BIT)
 
+#define NS_PEER_SNI_ROUTE_BIT 10
+#define NS_PEER_SNI_ROUTE (1 << NS_PEER_SNI_ROUTE_BIT)
 #define NS_PEER_SSYN_BIT 11
 #define NS_PEER_SSYN (1 << NS_PEER_SSYN_BIT)
 #define NS_PEER_KNOCK_BIT 12
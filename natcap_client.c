@@ -44,6 +44,8 @@
 #include "natcap_client.h"
 #include "natcap_knock.h"
 #include "natcap_peer.h"
+#include "natcap_dns.h"
+#include "natcap_fastpath.h"
 
 unsigned int server_persist_lock = 0;
 unsigned int server_persist_timeout = 0;
@@ -693,7 +695,9 @@ static unsigned int natcap_client_dnat_hook(void *priv,
 			set_bit(IPS_NATCAP_BYPASS_BIT, &ct->status);
 			set_bit(IPS_NATCAP_ACK_BIT, &ct->status);
 			return NF_ACCEPT;
-		} else if (cnipwhitelist_mode || IP_SET_test_dst_ip(state, in, out, skb, "gfwlist") > 0) {
+		} else if (cnipwhitelist_mode ||
+				IP_SET_test_dst_ip(state, in, out, skb, "gfwlist") > 0 ||
+				natcap_dns_route_lookup(iph->daddr) > 0) {
 			if (natcap_client_redirect_port != 0 && hooknum == NF_INET_PRE_ROUTING) {
 				__be32 newdst = 0;
 				struct in_device *indev;
@@ -865,6 +869,7 @@ natcap_dual_out:
 		} else if (cnipwhitelist_mode ||
 				IP_SET_test_dst_ip(state, in, out, skb, "udproxylist") > 0 ||
 				IP_SET_test_dst_ip(state, in, out, skb, "gfwlist") > 0 ||
+				natcap_dns_route_lookup(iph->daddr) > 0 ||
 				UDPH(l4)->dest == __constant_htons(443) ||
 				UDPH(l4)->dest == __constant_htons(80)) {
 			natcap_server_info_select(iph->daddr, ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.all, &server);
@@ -1995,25 +2000,18 @@ static unsigned int natcap_client_post_master_out_hook(void *priv,
 		UDPH(l4)->dest = ns->n.target_port;
 		iph->daddr = ns->n.target_ip;
 
-		if (cone_nat_array &&
-				ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.all != __constant_htons(53) &&
+		if (ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.all != __constant_htons(53) &&
 				ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u.all != __constant_htons(53) &&
 				IP_SET_test_src_ip(state, in, out, skb, "natcap_wan_ip") > 0) {
-			struct cone_nat_session cns;
-
-			memcpy(&cns, &cone_nat_array[ntohs(UDPH(l4)->source)], sizeof(cns));
-			if (ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip != cns.ip ||
-					ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port != cns.port) {
+			struct cone_nat_session cns, old;
 
+			cns.ip = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip;
+			cns.port = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port;
+			if (natcap_cone_nat_update(iph->saddr, IPPROTO_UDP, UDPH(l4)->source, &cns, &old) == 1) {
 				NATCAP_INFO("(CPMO)" DEBUG_UDP_FMT ": update mapping from %pI4:%u to %pI4:%u @port=%u\n", DEBUG_UDP_ARG(iph,l4),
+						&old.ip, ntohs(old.port),
 						&cns.ip, ntohs(cns.port),
-						&ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip,
-						ntohs(ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port),
 						ntohs(UDPH(l4)->source));
-
-				cns.ip = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip;
-				cns.port = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port;
-				memcpy(&cone_nat_array[ntohs(UDPH(l4)->source)], &cns, sizeof(cns));
 			}
 		}
 	}
@@ -2466,42 +2464,6 @@ eat:
 	return NF_STOLEN;
 }
 
-static inline int get_rdata(const unsigned char *src_ptr, int src_len, int src_pos, unsigned char *dst_ptr, int dst_size)
-{
-	int ptr_count = 0;
-	int ptr_limit = src_len / 2;
-	int pos = src_pos;
-	int dst_len = 0;
-	unsigned int v;
-	while (dst_len < dst_size && pos < src_len && (v = get_byte1(src_ptr + pos)) != 0) {
-		if (v > 0x3F) {
-			if (pos + 1 >= src_len) {
-				return -1;
-			}
-			if (++ptr_count >= ptr_limit) {
-				return -2;
-			}
-			pos = ntohs(get_byte2(src_ptr + pos)) & 0x3FFF;
-			continue;
-		} else {
-			if (pos + v >= src_len) {
-				return -3;
-			}
-			if (dst_len + v >= dst_size) {
-				return -4;
-			}
-			memcpy(dst_ptr, src_ptr + pos + 1, v);
-			dst_ptr += v;
-			*dst_ptr = '.';
-			dst_ptr += 1;
-			dst_len += v + 1;
-			pos += v + 1;
-		}
-	}
-
-	return dst_len;
-}
-
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
 static unsigned int natcap_client_pre_master_in_hook(unsigned int hooknum,
 		struct sk_buff *skb,
@@ -2798,143 +2760,62 @@ static unsigned int natcap_client_pre_master_in_hook(void *priv,
 		}
 
 		do {
-			int i, pos;
-			unsigned int v;
-			unsigned short flags;
-			unsigned short qd_count;
-			unsigned short an_count;
-			unsigned short ns_count;
-			unsigned short ar_count;
-
-			unsigned char *p = (unsigned char *)UDPH(l4) + sizeof(struct udphdr);
-			int len = skb->len - iph->ihl * 4 - sizeof(struct udphdr);
-
-			id = ntohs(get_byte2(p + 0));
-			flags = ntohs(get_byte2(p + 2));
-			qd_count = ntohs(get_byte2(p + 4));
-			an_count = ntohs(get_byte2(p + 6));
-			ns_count = ntohs(get_byte2(p + 8));
-			ar_count = ntohs(get_byte2(p + 10));
+			int i;
+			struct natcap_dns_parser dp;
+			struct natcap_dns_question q;
+			struct natcap_dns_rr rr;
+			struct natcap_dns_scratch *scratch;
+
+			if (natcap_dns_parser_init(&dp, skb, iph->ihl * 4 + sizeof(struct udphdr)) != 0) {
+				break;
+			}
+			id = dp.id;
 			NATCAP_DEBUG("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x, flags=0x%04x, qd=%u, an=%u, ns=%u, ar=%u\n",
 					DEBUG_UDP_ARG(iph,l4),
-					id, flags, qd_count, an_count, ns_count, ar_count);
+					id, dp.flags, dp.qdcount, dp.ancount, dp.nscount, dp.arcount);
 
-			if (!(IPS_NATCAP & ct->status) && (flags & 0xf) != 0) {
-				NATCAP_DEBUG("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x direct DNS ANS flags=%04x, drop\n", DEBUG_UDP_ARG(iph,l4), id, flags);
+			if (!(IPS_NATCAP & ct->status) && (dp.flags & 0xf) != 0) {
+				NATCAP_DEBUG("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x direct DNS ANS flags=%04x, drop\n", DEBUG_UDP_ARG(iph,l4), id, dp.flags);
 				return NF_DROP;
 			}
 
-			pos = 12;
-			for(i = 0; i < qd_count; i++) {
-				unsigned short qtype, qclass;
-
-				if (pos >= len) {
+			for (i = 0; i < dp.qdcount; i++) {
+				if (natcap_dns_parse_question(&dp, &q) != 0) {
 					break;
 				}
 
 				if (IS_NATCAP_DEBUG()) {
-					int qname_len;
-					char *qname = kmalloc(2048, GFP_ATOMIC);
-
-					if (qname != NULL) {
-						if ((qname_len = get_rdata(p, len, pos, qname, 2047)) >= 0) {
-							qname[qname_len] = 0;
-							NATCAP_DEBUG("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x, qname=%s\n", DEBUG_UDP_ARG(iph,l4), id, qname);
-						}
-						kfree(qname);
+					scratch = natcap_dns_scratch_get();
+					if (natcap_dns_name_read(&dp, q.name_pos, scratch->name, sizeof(scratch->name)) >= 0) {
+						NATCAP_DEBUG("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x, qname=%s\n", DEBUG_UDP_ARG(iph,l4), id, scratch->name);
 					}
+					natcap_dns_scratch_put();
 				}
 
-				while (pos < len && ((v = get_byte1(p + pos)) != 0)) {
-					if (v > 0x3F) {
-						pos++;
-						break;
-					} else {
-						pos += v + 1;
-					}
-				}
-				pos++;
-
-				if (pos + 1 >= len) {
-					break;
-				}
-				qtype = ntohs(get_byte2(p + pos));
-				pos += 2;
-
-				if (pos + 1 >= len) {
-					break;
-				}
-				qclass = ntohs(get_byte2(p + pos));
-				pos += 2;
-
-				NATCAP_DEBUG("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x, qtype=%d, qclass=%d\n", DEBUG_UDP_ARG(iph,l4), id, qtype, qclass);
+				NATCAP_DEBUG("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x, qtype=%d, qclass=%d\n", DEBUG_UDP_ARG(iph,l4), id, q.qtype, q.qclass);
 			}
-			for(i = 0; i < an_count; i++) {
-				unsigned int ttl;
-				unsigned short type, class;
-				unsigned short rdlength;
-
-				if (pos >= len) {
+			if (i < dp.qdcount) {
+				/* the answers start after the questions, a bad question leaves no offset to walk them from */
+				break;
+			}
+			for (i = 0; i < dp.ancount; i++) {
+				if (natcap_dns_parse_rr(&dp, &rr) != 0 || rr.rdlength == 0) {
 					break;
 				}
 
 				if (IS_NATCAP_DEBUG()) {
-					int name_len;
-					char *name = kmalloc(2048, GFP_ATOMIC);
-
-					if (name != NULL) {
-						if ((name_len = get_rdata(p, len, pos, name, 2047)) >= 0) {
-							name[name_len] = 0;
-							NATCAP_DEBUG("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x, name=%s\n", DEBUG_UDP_ARG(iph,l4), id, name);
-						}
-						kfree(name);
-					}
-				}
-
-				while (pos < len && ((v = get_byte1(p + pos)) != 0)) {
-					if (v > 0x3F) {
-						pos++;
-						break;
-					} else {
-						pos += v + 1;
+					scratch = natcap_dns_scratch_get();
+					if (natcap_dns_name_read(&dp, rr.name_pos, scratch->name, sizeof(scratch->name)) >= 0) {
+						NATCAP_DEBUG("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x, name=%s\n", DEBUG_UDP_ARG(iph,l4), id, scratch->name);
 					}
+					natcap_dns_scratch_put();
 				}
-				pos++;
-
-				if (pos + 1 >= len) {
-					break;
-				}
-				type = ntohs(get_byte2(p + pos));
-				pos += 2;
-
-				if (pos + 1 >= len) {
-					break;
-				}
-				class = ntohs(get_byte2(p + pos));
-				pos += 2;
-
-				if (pos + 3 >= len) {
-					break;
-				}
-				ttl = ntohl(get_byte4(p + pos));
-				pos += 4;
-
-				if (pos + 1 >= len) {
-					break;
-				}
-				rdlength = ntohs(get_byte2(p + pos));
-				pos += 2;
 
-				if (rdlength == 0 || pos + rdlength - 1 >= len) {
-					break;
-				}
-
-				switch(type)
+				switch(rr.type)
 				{
 					case 1: //A
-						if (rdlength == 4) {
-							ip = get_byte4(p + pos);
-							NATCAP_DEBUG("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x type=%d, class=%d, ttl=%d, rdlength=%d, ip=%pI4\n", DEBUG_UDP_ARG(iph,l4), id, type, class, ttl, rdlength, &ip);
+						if (rr.rdlength == 4 && natcap_dns_rdata_read(&dp, &rr, &ip, 4) == 0) {
+							NATCAP_DEBUG("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x type=%d, class=%d, ttl=%d, rdlength=%d, ip=%pI4\n", DEBUG_UDP_ARG(iph,l4), id, rr.type, rr.class, rr.ttl, rr.rdlength, &ip);
 							if (!IS_NATCAP_DEBUG()) {
 								goto dns_done;
 							}
@@ -2942,9 +2823,11 @@ static unsigned int natcap_client_pre_master_in_hook(void *priv,
 						break;
 
 					case 28: //AAAA
-						if (rdlength == 16) {
-							unsigned char *ipv6 = p + pos;
-							NATCAP_DEBUG("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x type=%d, class=%d, ttl=%d, rdlength=%d, ipv6=%pI6\n", DEBUG_UDP_ARG(iph,l4), id, type, class, ttl, rdlength, ipv6);
+						if (rr.rdlength == 16 && IS_NATCAP_DEBUG()) {
+							unsigned char ipv6[16];
+							if (natcap_dns_rdata_read(&dp, &rr, ipv6, 16) == 0) {
+								NATCAP_DEBUG("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x type=%d, class=%d, ttl=%d, rdlength=%d, ipv6=%pI6\n", DEBUG_UDP_ARG(iph,l4), id, rr.type, rr.class, rr.ttl, rr.rdlength, ipv6);
+							}
 						}
 						break;
 
@@ -2953,28 +2836,22 @@ static unsigned int natcap_client_pre_master_in_hook(void *priv,
 					case 4: //MF
 					case 5: //CNAME
 					case 15: //MX
-					case 16: //TXT
+						/* TXT (16) rdata is character-strings, not a name, it is only logged by default */
 						if (IS_NATCAP_DEBUG()) {
-							int name_len;
-							char *name = kmalloc(2048, GFP_ATOMIC);
-
-							if (name != NULL) {
-								if ((name_len = get_rdata(p, len, pos, name, 2047)) >= 0) {
-									name[name_len] = 0;
-									NATCAP_DEBUG("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x, name=%s\n", DEBUG_UDP_ARG(iph,l4), id, name);
-								}
-								kfree(name);
+							scratch = natcap_dns_scratch_get();
+							/* MX rdata has a 2 bytes preference before the name */
+							if (natcap_dns_name_read(&dp, rr.rdata_pos + (rr.type == 15 ? 2 : 0), scratch->name, sizeof(scratch->name)) >= 0) {
+								NATCAP_DEBUG("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x, name=%s\n", DEBUG_UDP_ARG(iph,l4), id, scratch->name);
 							}
+							natcap_dns_scratch_put();
 						}
-						NATCAP_DEBUG("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x type=%d, class=%d, ttl=%d, rdlength=%d\n", DEBUG_UDP_ARG(iph,l4), id, type, class, ttl, rdlength);
+						NATCAP_DEBUG("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x type=%d, class=%d, ttl=%d, rdlength=%d\n", DEBUG_UDP_ARG(iph,l4), id, rr.type, rr.class, rr.ttl, rr.rdlength);
 						break;
 
 					default:
-						NATCAP_DEBUG("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x type=%d, class=%d, ttl=%d, rdlength=%d\n", DEBUG_UDP_ARG(iph,l4), id, type, class, ttl, rdlength);
+						NATCAP_DEBUG("(CPMI)" DEBUG_UDP_FMT ": id=0x%04x type=%d, class=%d, ttl=%d, rdlength=%d\n", DEBUG_UDP_ARG(iph,l4), id, rr.type, rr.class, rr.ttl, rr.rdlength);
 						break;
 				}
-
-				pos += rdlength;
 			}
 		} while (0);
 
@@ -3000,6 +2877,13 @@ dns_done:
 				iph->daddr = old_ip;
 			}
 		}
+
+		natcap_dns_route_learn(skb, iph->ihl * 4 + sizeof(struct udphdr));
+		if (natcap_dns_cache_store(skb, iph->ihl * 4 + sizeof(struct udphdr),
+					natcap_dns_prefetch_ct((IPS_NATCAP & ct->status) ? master : ct)) == 1) {
+			consume_skb(skb);
+			return NF_STOLEN;
+		}
 	}
 
 	return NF_ACCEPT;
@@ -3092,10 +2976,27 @@ int natcap_client_init(void)
 	natcap_server_info_cleanup();
 	default_mac_addr_init();
 	ret = nf_register_hooks(client_hooks, ARRAY_SIZE(client_hooks));
+	if (ret != 0) {
+		return ret;
+	}
+
+	ret = natcap_dns_init();
+	if (ret != 0) {
+		nf_unregister_hooks(client_hooks, ARRAY_SIZE(client_hooks));
+		return ret;
+	}
+
+	ret = natcap_fastpath_init();
+	if (ret != 0) {
+		natcap_dns_exit();
+		nf_unregister_hooks(client_hooks, ARRAY_SIZE(client_hooks));
+	}
 	return ret;
 }
 
 void natcap_client_exit(void)
 {
+	natcap_fastpath_exit();
+	natcap_dns_exit();
 	nf_unregister_hooks(client_hooks, ARRAY_SIZE(client_hooks));
 }
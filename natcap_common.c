@@ -26,6 +26,10 @@
 #include <linux/highmem.h>
 #include <linux/udp.h>
 #include <linux/netfilter.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/timer.h>
+#include <linux/vmalloc.h>
 #include <net/netfilter/nf_conntrack.h>
 #include <net/netfilter/nf_conntrack_core.h>
 #include <net/netfilter/nf_conntrack_zones.h>
@@ -1202,6 +1206,7 @@ int natcap_udp_to_tcp_pack(struct sk_buff *skb, struct natcap_session *ns, int m
 	int ret = NF_DROP;
 	struct iphdr *iph;
 	void *l4;
+	struct net *net;
 
 	iph = ip_hdr(skb);
 
@@ -1243,10 +1248,14 @@ int natcap_udp_to_tcp_pack(struct sk_buff *skb, struct natcap_session *ns, int m
 	ns->n.current_seq = ntohl(TCPH(l4)->seq) + ntohs(iph->tot_len) - iph->ihl * 4 - sizeof(struct tcphdr);
 
 	ct = nf_ct_get(skb, &ctinfo);
+	if (!ct) {
+		return -EINVAL;
+	}
+	net = nf_ct_net(ct);
 	skb_nfct_reset(skb);
-	nf_conntrack_in(&init_net, PF_INET, NF_INET_PRE_ROUTING, skb);
+	nf_conntrack_in(net, PF_INET, NF_INET_PRE_ROUTING, skb);
 	ct2 = nf_ct_get(skb, &ctinfo);
-	if (!ct || !ct2) {
+	if (!ct2) {
 		return -EINVAL;
 	}
 	natcap_clone_timeout(ct2, ct);
@@ -1258,7 +1267,235 @@ int natcap_udp_to_tcp_pack(struct sk_buff *skb, struct natcap_session *ns, int m
 	return 0;
 }
 
-struct cone_nat_session *cone_nat_array = NULL;
+/* endpoint independent mapping table for cone nat
+ * keyed by (wan_ip, protonum, wan_port) -> internal ip:port
+ */
+struct cone_nat_node {
+	struct hlist_node hnode;
+	struct rcu_head rcu;
+	__be32 wan_ip;
+	__be16 wan_port;
+	__u8 protonum;
+	struct cone_nat_session cns;
+	unsigned long last_active;
+};
+
+unsigned int cone_nat_hash_size = 65536;
+module_param(cone_nat_hash_size, int, 0);
+MODULE_PARM_DESC(cone_nat_hash_size, "Cone nat mapping hash buckets default=65536");
+
+unsigned int cone_nat_max = 1048576;
+module_param(cone_nat_max, int, 0);
+MODULE_PARM_DESC(cone_nat_max, "Cone nat max mapping entries default=1048576");
+
+unsigned int cone_nat_timeout = 180;
+unsigned int cone_nat_tcp = 0;
+
+#define CONE_NAT_LOCKS 256
+#define CONE_NAT_GC_STEP_SHIFT 5
+static struct hlist_head *cone_nat_hash = NULL;
+static spinlock_t cone_nat_locks[CONE_NAT_LOCKS];
+static atomic_t cone_nat_count = ATOMIC_INIT(0);
+static unsigned int cone_nat_hash_rnd __read_mostly;
+static struct timer_list cone_nat_gc_timer;
+static int cone_nat_gc_stop = 1;
+
+static inline unsigned int cone_nat_hashfn(__be32 wan_ip, __u8 protonum, __be16 wan_port)
+{
+	return jhash_3words((__force u32)wan_ip, (__force u32)wan_port, protonum, cone_nat_hash_rnd) % cone_nat_hash_size;
+}
+
+static inline spinlock_t *cone_nat_lock(unsigned int hash)
+{
+	return &cone_nat_locks[hash % CONE_NAT_LOCKS];
+}
+
+static inline int cone_nat_expired(const struct cone_nat_node *node)
+{
+	return time_after(jiffies, node->last_active + cone_nat_timeout * HZ);
+}
+
+int natcap_cone_nat_lookup(__be32 wan_ip, __u8 protonum, __be16 wan_port, struct cone_nat_session *cns)
+{
+	unsigned int hash;
+	struct cone_nat_node *node;
+
+	if (cone_nat_hash == NULL)
+		return -ENOENT;
+
+	hash = cone_nat_hashfn(wan_ip, protonum, wan_port);
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(node, &cone_nat_hash[hash], hnode) {
+		if (node->wan_ip == wan_ip && node->wan_port == wan_port && node->protonum == protonum) {
+			if (cone_nat_expired(node))
+				break;
+			*cns = node->cns;
+			rcu_read_unlock();
+			return 0;
+		}
+	}
+	rcu_read_unlock();
+
+	return -ENOENT;
+}
+
+/* return 0 if the mapping is unchanged (only touched), 1 if a new mapping is published
+ * and old holds the previous one (zero if none), or -errno
+ */
+int natcap_cone_nat_update(__be32 wan_ip, __u8 protonum, __be16 wan_port, const struct cone_nat_session *cns, struct cone_nat_session *old)
+{
+	unsigned int hash;
+	spinlock_t *lock;
+	struct cone_nat_node *node, *new;
+
+	if (cone_nat_hash == NULL)
+		return -ENOENT;
+
+	memset(old, 0, sizeof(*old));
+	hash = cone_nat_hashfn(wan_ip, protonum, wan_port);
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(node, &cone_nat_hash[hash], hnode) {
+		if (node->wan_ip == wan_ip && node->wan_port == wan_port && node->protonum == protonum) {
+			if (node->cns.ip == cns->ip && node->cns.port == cns->port) {
+				if (node->last_active != jiffies)
+					node->last_active = jiffies;
+				rcu_read_unlock();
+				return 0;
+			}
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	new = kmalloc(sizeof(struct cone_nat_node), GFP_ATOMIC);
+	if (new == NULL)
+		return -ENOMEM;
+	new->wan_ip = wan_ip;
+	new->wan_port = wan_port;
+	new->protonum = protonum;
+	new->cns = *cns;
+	new->last_active = jiffies;
+
+	lock = cone_nat_lock(hash);
+	spin_lock_bh(lock);
+	hlist_for_each_entry(node, &cone_nat_hash[hash], hnode) {
+		if (node->wan_ip == wan_ip && node->wan_port == wan_port && node->protonum == protonum) {
+			if (!cone_nat_expired(node))
+				*old = node->cns;
+			hlist_replace_rcu(&node->hnode, &new->hnode);
+			spin_unlock_bh(lock);
+			kfree_rcu(node, rcu);
+			return 1;
+		}
+	}
+	if (atomic_inc_return(&cone_nat_count) > cone_nat_max) {
+		atomic_dec(&cone_nat_count);
+		spin_unlock_bh(lock);
+		kfree(new);
+		return -ENOSPC;
+	}
+	hlist_add_head_rcu(&new->hnode, &cone_nat_hash[hash]);
+	spin_unlock_bh(lock);
+
+	return 1;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+static void cone_nat_gc(unsigned long ignore)
+#else
+static void cone_nat_gc(struct timer_list *ignore)
+#endif
+{
+	static unsigned int gc_idx = 0;
+	unsigned int i, step;
+	spinlock_t *lock;
+	struct cone_nat_node *node;
+	struct hlist_node *n;
+
+	step = (cone_nat_hash_size >> CONE_NAT_GC_STEP_SHIFT) + 1;
+	for (i = 0; i < step; i++) {
+		if (gc_idx >= cone_nat_hash_size)
+			gc_idx = 0;
+		if (hlist_empty(&cone_nat_hash[gc_idx])) {
+			gc_idx++;
+			continue;
+		}
+		lock = cone_nat_lock(gc_idx);
+		spin_lock_bh(lock);
+		hlist_for_each_entry_safe(node, n, &cone_nat_hash[gc_idx], hnode) {
+			if (cone_nat_expired(node)) {
+				hlist_del_rcu(&node->hnode);
+				atomic_dec(&cone_nat_count);
+				kfree_rcu(node, rcu);
+			}
+		}
+		spin_unlock_bh(lock);
+		gc_idx++;
+	}
+
+	if (cone_nat_gc_stop) {
+		return;
+	}
+	mod_timer(&cone_nat_gc_timer, jiffies + HZ / 2);
+}
+
+static int cone_nat_init(void)
+{
+	unsigned int i;
+
+	if (cone_nat_hash_size == 0)
+		cone_nat_hash_size = 65536;
+
+	cone_nat_hash = vmalloc(sizeof(struct hlist_head) * cone_nat_hash_size);
+	if (cone_nat_hash == NULL) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < cone_nat_hash_size; i++)
+		INIT_HLIST_HEAD(&cone_nat_hash[i]);
+	for (i = 0; i < CONE_NAT_LOCKS; i++)
+		spin_lock_init(&cone_nat_locks[i]);
+	get_random_bytes(&cone_nat_hash_rnd, sizeof(cone_nat_hash_rnd));
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+	init_timer(&cone_nat_gc_timer);
+	cone_nat_gc_timer.data = 0;
+	cone_nat_gc_timer.function = cone_nat_gc;
+#else
+	timer_setup(&cone_nat_gc_timer, cone_nat_gc, 0);
+#endif
+	cone_nat_gc_stop = 0;
+	mod_timer(&cone_nat_gc_timer, jiffies + HZ);
+
+	return 0;
+}
+
+static void cone_nat_exit(void)
+{
+	unsigned int i;
+	struct cone_nat_node *node;
+	struct hlist_node *n;
+
+	if (cone_nat_hash == NULL)
+		return;
+
+	cone_nat_gc_stop = 1;
+	del_timer_sync(&cone_nat_gc_timer);
+
+	for (i = 0; i < cone_nat_hash_size; i++) {
+		spin_lock_bh(cone_nat_lock(i));
+		hlist_for_each_entry_safe(node, n, &cone_nat_hash[i], hnode) {
+			hlist_del_rcu(&node->hnode);
+			atomic_dec(&cone_nat_count);
+			kfree_rcu(node, rcu);
+		}
+		spin_unlock_bh(cone_nat_lock(i));
+	}
+	rcu_barrier();
+
+	vfree(cone_nat_hash);
+	cone_nat_hash = NULL;
+}
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
 static unsigned int natcap_common_cone_in_hook(unsigned int hooknum,
@@ -1305,7 +1542,7 @@ static unsigned int natcap_common_cone_in_hook(void *priv,
 	struct cone_nat_session cns;
 
 	iph = ip_hdr(skb);
-	if (iph->protocol != IPPROTO_UDP) {
+	if (iph->protocol != IPPROTO_UDP && (iph->protocol != IPPROTO_TCP || !cone_nat_tcp)) {
 		return NF_ACCEPT;
 	}
 	l4 = (void *)iph + iph->ihl * 4;
@@ -1324,6 +1561,12 @@ static unsigned int natcap_common_cone_in_hook(void *priv,
 		xt_mark_natcap_set(XT_MARK_NATCAP, &skb->mark);
 		return NF_ACCEPT;
 	}
+	if (iph->protocol == IPPROTO_TCP) {
+		/* only a new inbound connection can be mapped */
+		if (ctinfo != IP_CT_NEW || !TCPH(l4)->syn || TCPH(l4)->ack) {
+			return NF_ACCEPT;
+		}
+	}
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 3, 0)
 	if (nf_nat_initialized(ct, IP_NAT_MANIP_DST)) {
@@ -1335,17 +1578,19 @@ static unsigned int natcap_common_cone_in_hook(void *priv,
 	}
 #endif
 
-	if (cone_nat_array && IP_SET_test_dst_ip(state, in, out, skb, "natcap_wan_ip") > 0) {
-		memcpy(&cns, &cone_nat_array[ntohs(UDPH(l4)->dest)], sizeof(cns));
+	if (natcap_cone_nat_lookup(iph->daddr, iph->protocol, UDPH(l4)->dest, &cns) == 0 &&
+			IP_SET_test_dst_ip(state, in, out, skb, "natcap_wan_ip") > 0) {
 		if (cns.ip != 0 && cns.port != 0) {
 			if (natcap_dnat_setup(ct, cns.ip, cns.port) != NF_ACCEPT) {
-				NATCAP_ERROR("(CCI)" DEBUG_UDP_FMT ": do mapping failed, target=%pI4:%u @port=%u\n",
-						DEBUG_UDP_ARG(iph,l4), &cns.ip, ntohs(cns.port), ntohs(UDPH(l4)->dest));
+				NATCAP_ERROR("(CCI)[%s]" DEBUG_FMT_PREFIX "[" IP_TCPUDP_FMT "|P:%u]: do mapping failed, target=%pI4:%u @port=%u\n",
+						hooknames[hooknum], DEBUG_ARG_PREFIX, IP_TCPUDP_ARG(iph,l4), iph->protocol,
+						&cns.ip, ntohs(cns.port), ntohs(UDPH(l4)->dest));
 				return NF_ACCEPT;
 			}
 
-			NATCAP_INFO("(CCI)" DEBUG_UDP_FMT ": do mapping, target=%pI4:%u @port=%u\n",
-					DEBUG_UDP_ARG(iph,l4), &cns.ip, ntohs(cns.port), ntohs(UDPH(l4)->dest));
+			NATCAP_INFO("(CCI)[%s]" DEBUG_FMT_PREFIX "[" IP_TCPUDP_FMT "|P:%u]: do mapping, target=%pI4:%u @port=%u\n",
+					hooknames[hooknum], DEBUG_ARG_PREFIX, IP_TCPUDP_ARG(iph,l4), iph->protocol,
+					&cns.ip, ntohs(cns.port), ntohs(UDPH(l4)->dest));
 
 			set_bit(IPS_NATCAP_CONE_BIT, &ct->status);
 			xt_mark_natcap_set(XT_MARK_NATCAP, &skb->mark);
@@ -1397,10 +1642,10 @@ static unsigned int natcap_common_cone_out_hook(void *priv,
 	struct nf_conn *ct;
 	struct iphdr *iph;
 	void *l4;
-	struct cone_nat_session cns;
+	struct cone_nat_session cns, old;
 
 	iph = ip_hdr(skb);
-	if (iph->protocol != IPPROTO_UDP) {
+	if (iph->protocol != IPPROTO_UDP && (iph->protocol != IPPROTO_TCP || !cone_nat_tcp)) {
 		return NF_ACCEPT;
 	}
 	l4 = (void *)iph + iph->ihl * 4;
@@ -1416,26 +1661,20 @@ static unsigned int natcap_common_cone_out_hook(void *priv,
 		return NF_ACCEPT;
 	}
 
-	if (cone_nat_array &&
-			ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.all != __constant_htons(53) &&
+	if (ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u.all != __constant_htons(53) &&
 			ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u.all != __constant_htons(53) &&
 			((IPS_NATCAP & ct->status) ||
 			 (ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u3.ip != iph->saddr &&
 			  IP_SET_test_src_ip(state, in, out, skb, "natcap_wan_ip") > 0))) {
 
-		memcpy(&cns, &cone_nat_array[ntohs(UDPH(l4)->source)], sizeof(cns));
-		if (ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip != cns.ip ||
-				ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port != cns.port) {
-
-			NATCAP_INFO("(CCO)" DEBUG_UDP_FMT ": update mapping from %pI4:%u to %pI4:%u @port=%u\n", DEBUG_UDP_ARG(iph,l4),
+		cns.ip = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip;
+		cns.port = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.all;
+		if (natcap_cone_nat_update(iph->saddr, iph->protocol, UDPH(l4)->source, &cns, &old) == 1) {
+			NATCAP_INFO("(CCO)[%s]" DEBUG_FMT_PREFIX "[" IP_TCPUDP_FMT "|P:%u]: update mapping from %pI4:%u to %pI4:%u @port=%u\n",
+					hooknames[hooknum], DEBUG_ARG_PREFIX, IP_TCPUDP_ARG(iph,l4), iph->protocol,
+					&old.ip, ntohs(old.port),
 					&cns.ip, ntohs(cns.port),
-					&ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip,
-					ntohs(ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port),
 					ntohs(UDPH(l4)->source));
-
-			cns.ip = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip;
-			cns.port = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port;
-			memcpy(&cone_nat_array[ntohs(UDPH(l4)->source)], &cns, sizeof(cns));
 		}
 	}
 
@@ -1468,16 +1707,15 @@ int natcap_common_init(void)
 	int ret = 0;
 
 	dnatcap_map_init();
-	cone_nat_array = vmalloc(sizeof(struct cone_nat_session) * 65536);
-	if (cone_nat_array == NULL) {
-		return -ENOMEM;
+	ret = cone_nat_init();
+	if (ret != 0) {
+		return ret;
 	}
-	memset(cone_nat_array, 0, sizeof(struct cone_nat_session) * 65536);
 
 	need_conntrack();
 	ret = nf_register_hooks(common_hooks, ARRAY_SIZE(common_hooks));
 	if (ret != 0) {
-		vfree(cone_nat_array);
+		cone_nat_exit();
 	}
 	return ret;
 }
@@ -1486,10 +1724,6 @@ void natcap_common_exit(void)
 {
 	nf_unregister_hooks(common_hooks, ARRAY_SIZE(common_hooks));
 
-	if (cone_nat_array) {
-		void *tmp = cone_nat_array;
-		cone_nat_array = NULL;
-		synchronize_rcu();
-		vfree(tmp);
-	}
+	synchronize_rcu();
+	cone_nat_exit();
 }
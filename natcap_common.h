@@ -66,7 +66,10 @@ static inline void natcap_tuple_to_ns(struct natcap_session *ns, const struct tu
 	ns->n.target_port = t->port;
 }
 
-extern struct cone_nat_session *cone_nat_array;
+extern unsigned int cone_nat_timeout;
+extern unsigned int cone_nat_tcp;
+extern int natcap_cone_nat_lookup(__be32 wan_ip, __u8 protonum, __be16 wan_port, struct cone_nat_session *cns);
+extern int natcap_cone_nat_update(__be32 wan_ip, __u8 protonum, __be16 wan_port, const struct cone_nat_session *cns, struct cone_nat_session *old);
 
 extern unsigned int natcap_touch_timeout;
 
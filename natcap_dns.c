@@ -0,0 +1,1101 @@
+/*
+ * Author: natcap contributors
+ *  Date : Sun, 18 Oct 2026 16:52:09 +0000
+ *
+ * This file is part of the natcap.
+ *
+ * natcap is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * natcap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with natcap; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#include <linux/ctype.h>
+#include <linux/if_ether.h>
+#include <linux/init.h>
+#include <linux/ip.h>
+#include <linux/jhash.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/netdevice.h>
+#include <linux/netfilter.h>
+#include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/skbuff.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/timer.h>
+#include <linux/udp.h>
+#include <linux/version.h>
+#include <net/netfilter/nf_conntrack.h>
+#include "natcap_common.h"
+#include "natcap_dns.h"
+
+unsigned int dns_cache_enabled = 0;
+unsigned int dns_cache_mem_limit = 1024 * 1024;
+
+unsigned long dns_cache_hits = 0;
+unsigned long dns_cache_misses = 0;
+unsigned long dns_cache_prefetches = 0;
+
+/* the refresh queries of the cache go out from this source port, so their answers
+ * never mix with the client's own queries
+ */
+unsigned short dns_cache_prefetch_port = 65353;
+module_param(dns_cache_prefetch_port, ushort, 0);
+MODULE_PARM_DESC(dns_cache_prefetch_port, "Source port of the DNS cache refresh queries default=65353");
+
+#define DNS_HDR_LEN 12
+#define DNS_NAME_MAX 255
+#define DNS_QUESTION_MAX (DNS_NAME_MAX + 4)
+
+#define DNS_CACHE_MSG_MAX 1400
+#define DNS_CACHE_MAX_RR 32
+#define DNS_CACHE_TTL_MAX 3600
+#define DNS_CACHE_HASH_SIZE 1024
+/* a name hit this many times is refreshed ahead when less than 1/10 of its ttl is left */
+#define DNS_CACHE_PREFETCH_HITS 2
+/* a refresh without an answer in this time is given up, the next hit sends another */
+#define DNS_CACHE_PREFETCH_TIMEOUT (5 * HZ)
+
+struct dns_cache_node {
+	struct hlist_node hnode;
+	struct list_head lru;
+	unsigned long expires;
+	unsigned int ttl;
+	unsigned int hits;
+	unsigned int mem;
+	unsigned short len;
+	unsigned short qlen;
+	unsigned short ttl_off[DNS_CACHE_MAX_RR];
+	unsigned char ttl_num;
+	unsigned char prefetching;
+	unsigned long prefetch_expires;
+	unsigned char *key; /* lower case question: qname + qtype + qclass */
+	unsigned char msg[0];
+};
+
+static DEFINE_SPINLOCK(dns_cache_lock);
+static struct hlist_head dns_cache_hash[DNS_CACHE_HASH_SIZE];
+static LIST_HEAD(dns_cache_lru);
+static unsigned int dns_cache_count = 0;
+static unsigned int dns_cache_mem = 0;
+static unsigned int dns_cache_rnd __read_mostly;
+
+unsigned int dns_cache_entries(void)
+{
+	return dns_cache_count;
+}
+
+unsigned int dns_cache_mem_used(void)
+{
+	return dns_cache_mem;
+}
+
+static inline void dns_key_setup(unsigned char *key, const unsigned char *question, int name_len)
+{
+	int i;
+
+	for (i = 0; i < name_len; i++) {
+		key[i] = tolower(question[i]);
+	}
+	memcpy(key + name_len, question + name_len, 4);
+}
+
+static inline unsigned int dns_cache_hashfn(const unsigned char *key, int qlen)
+{
+	return jhash(key, qlen, dns_cache_rnd) % DNS_CACHE_HASH_SIZE;
+}
+
+static struct dns_cache_node *dns_cache_find(unsigned int hash, const unsigned char *key, int qlen)
+{
+	struct dns_cache_node *node;
+
+	hlist_for_each_entry(node, &dns_cache_hash[hash], hnode) {
+		if (node->qlen == qlen && memcmp(node->key, key, qlen) == 0) {
+			return node;
+		}
+	}
+
+	return NULL;
+}
+
+/* called with dns_cache_lock held */
+static void dns_cache_node_del(struct dns_cache_node *node)
+{
+	hlist_del(&node->hnode);
+	list_del(&node->lru);
+	dns_cache_count--;
+	dns_cache_mem -= node->mem;
+	kfree(node);
+}
+
+int natcap_dns_cache_store(struct sk_buff *skb, unsigned int off, int prefetch)
+{
+	int i, len, qlen, count;
+	unsigned int min_ttl = DNS_CACHE_TTL_MAX;
+	unsigned int mem, hash;
+	struct dns_cache_node *node, *old;
+	struct natcap_dns_parser dp;
+	struct natcap_dns_question q;
+	struct natcap_dns_rr rr;
+	unsigned char *p;
+
+	if (!dns_cache_enabled || skb->len <= off) {
+		return prefetch;
+	}
+	len = skb->len - off;
+	if (len < DNS_HDR_LEN || len > DNS_CACHE_MSG_MAX) {
+		return prefetch;
+	}
+
+	mem = sizeof(struct dns_cache_node) + len + DNS_QUESTION_MAX;
+	node = kmalloc(mem, GFP_ATOMIC);
+	if (node == NULL) {
+		return prefetch;
+	}
+	p = node->msg;
+	if (skb_copy_bits(skb, off, p, len) != 0) {
+		goto free_out;
+	}
+
+	if (natcap_dns_parser_init(&dp, skb, off) != 0 || !(dp.flags & 0x8000) || dp.qdcount != 1) {
+		goto free_out;
+	}
+	/* the key is the plain qname, a compressed one is not cached */
+	if (natcap_dns_parse_question(&dp, &q) != 0 || natcap_dns_qname_len(&dp, q.name_pos) != q.name_len) {
+		goto free_out;
+	}
+	node->key = p + len;
+	dns_key_setup(node->key, p + q.name_pos, q.name_len);
+	qlen = q.name_len + 4;
+	hash = dns_cache_hashfn(node->key, qlen);
+
+	if (prefetch) {
+		spin_lock_bh(&dns_cache_lock);
+		old = dns_cache_find(hash, node->key, qlen);
+		if (old) {
+			old->prefetching = 0;
+		}
+		spin_unlock_bh(&dns_cache_lock);
+	}
+
+	/* QR=1, OPCODE=QUERY, TC=0, RCODE=NOERROR */
+	if ((dp.flags & 0xFA0F) != 0x8000 || dp.ancount == 0) {
+		goto free_out;
+	}
+	if (q.qtype != 1 && q.qtype != 5 && q.qtype != 28) {
+		/* only A CNAME AAAA */
+		goto free_out;
+	}
+
+	count = dp.ancount + dp.nscount + dp.arcount;
+	node->ttl_num = 0;
+	for (i = 0; i < count; i++) {
+		if (natcap_dns_parse_rr(&dp, &rr) != 0) {
+			goto free_out;
+		}
+		if (rr.type != 41) {
+			/* OPT has no ttl */
+			if (node->ttl_num >= DNS_CACHE_MAX_RR) {
+				goto free_out;
+			}
+			/* the ttl is 6 bytes before the rdata */
+			node->ttl_off[node->ttl_num++] = rr.rdata_pos - 6;
+			if (rr.ttl < min_ttl) {
+				min_ttl = rr.ttl;
+			}
+		}
+	}
+	if (node->ttl_num == 0 || min_ttl == 0) {
+		goto free_out;
+	}
+
+	node->len = len;
+	node->qlen = qlen;
+	node->ttl = min_ttl;
+	node->expires = jiffies + min_ttl * HZ;
+	node->hits = 0;
+	node->prefetching = 0;
+	node->mem = mem;
+
+	spin_lock_bh(&dns_cache_lock);
+	old = dns_cache_find(hash, node->key, qlen);
+	if (old) {
+		node->hits = old->hits;
+		dns_cache_node_del(old);
+	}
+	hlist_add_head(&node->hnode, &dns_cache_hash[hash]);
+	list_add(&node->lru, &dns_cache_lru);
+	dns_cache_count++;
+	dns_cache_mem += node->mem;
+	while (dns_cache_mem > dns_cache_mem_limit && !list_empty(&dns_cache_lru)) {
+		old = list_entry(dns_cache_lru.prev, struct dns_cache_node, lru);
+		dns_cache_node_del(old);
+	}
+	spin_unlock_bh(&dns_cache_lock);
+
+	return prefetch;
+
+free_out:
+	kfree(node);
+	return prefetch;
+}
+
+void natcap_dns_cache_cleanup(void)
+{
+	struct dns_cache_node *node, *n;
+
+	spin_lock_bh(&dns_cache_lock);
+	list_for_each_entry_safe(node, n, &dns_cache_lru, lru) {
+		dns_cache_node_del(node);
+	}
+	spin_unlock_bh(&dns_cache_lock);
+}
+
+static DEFINE_PER_CPU(struct natcap_dns_scratch, dns_scratch);
+
+/* the scratch is per cpu, bh must stay disabled until natcap_dns_scratch_put() */
+struct natcap_dns_scratch *natcap_dns_scratch_get(void)
+{
+	local_bh_disable();
+	return this_cpu_ptr(&dns_scratch);
+}
+
+void natcap_dns_scratch_put(void)
+{
+	local_bh_enable();
+}
+
+static inline int dns_parser_byte(const struct natcap_dns_parser *dp, unsigned int pos)
+{
+	unsigned char _v, *v;
+
+	if (pos >= dp->len) {
+		return -1;
+	}
+	v = skb_header_pointer(dp->skb, dp->off + pos, 1, &_v);
+	if (v == NULL) {
+		return -1;
+	}
+	return *v;
+}
+
+int natcap_dns_parser_init(struct natcap_dns_parser *dp, const struct sk_buff *skb, unsigned int off)
+{
+	unsigned char _hdr[DNS_HDR_LEN], *hdr;
+
+	if (skb->len < off + DNS_HDR_LEN) {
+		return -EINVAL;
+	}
+	hdr = skb_header_pointer(skb, off, DNS_HDR_LEN, _hdr);
+	if (hdr == NULL) {
+		return -EINVAL;
+	}
+
+	dp->skb = skb;
+	dp->off = off;
+	dp->len = min_t(unsigned int, skb->len - off, 65535);
+	dp->pos = DNS_HDR_LEN;
+	dp->id = ntohs(get_byte2(hdr + 0));
+	dp->flags = ntohs(get_byte2(hdr + 2));
+	dp->qdcount = ntohs(get_byte2(hdr + 4));
+	dp->ancount = ntohs(get_byte2(hdr + 6));
+	dp->nscount = ntohs(get_byte2(hdr + 8));
+	dp->arcount = ntohs(get_byte2(hdr + 10));
+
+	return 0;
+}
+
+/* skip a (maybe compressed) name at pos, return the pos after it or -1 */
+int natcap_dns_name_skip(const struct natcap_dns_parser *dp, unsigned int pos)
+{
+	int v;
+	unsigned int start = pos;
+
+	while ((v = dns_parser_byte(dp, pos)) >= 0 && pos - start <= DNS_NAME_MAX) {
+		if (v == 0) {
+			return pos + 1;
+		}
+		if ((v & 0xC0) == 0xC0) {
+			return pos + 2 <= dp->len ? pos + 2 : -1;
+		}
+		if (v > 0x3F) {
+			return -1;
+		}
+		pos += v + 1;
+	}
+
+	return -1;
+}
+
+/* length of the uncompressed name at pos, the ending zero included, or -1 */
+int natcap_dns_qname_len(const struct natcap_dns_parser *dp, unsigned int pos)
+{
+	int v;
+	unsigned int start = pos;
+
+	while ((v = dns_parser_byte(dp, pos)) >= 0 && pos - start < DNS_NAME_MAX) {
+		if (v == 0) {
+			return pos + 1 - start;
+		}
+		if (v > 0x3F) {
+			return -1;
+		}
+		pos += v + 1;
+	}
+
+	return -1;
+}
+
+int natcap_dns_parse_question(struct natcap_dns_parser *dp, struct natcap_dns_question *q)
+{
+	int pos;
+	unsigned char _v[4], *v;
+
+	pos = natcap_dns_name_skip(dp, dp->pos);
+	if (pos < 0 || pos + 4 > dp->len) {
+		return -EINVAL;
+	}
+	v = skb_header_pointer(dp->skb, dp->off + pos, 4, _v);
+	if (v == NULL) {
+		return -EINVAL;
+	}
+
+	q->name_pos = dp->pos;
+	q->name_len = pos - dp->pos;
+	q->qtype = ntohs(get_byte2(v));
+	q->qclass = ntohs(get_byte2(v + 2));
+	dp->pos = pos + 4;
+
+	return 0;
+}
+
+int natcap_dns_parse_rr(struct natcap_dns_parser *dp, struct natcap_dns_rr *rr)
+{
+	int pos;
+	unsigned char _v[10], *v;
+
+	pos = natcap_dns_name_skip(dp, dp->pos);
+	if (pos < 0 || pos + 10 > dp->len) {
+		return -EINVAL;
+	}
+	v = skb_header_pointer(dp->skb, dp->off + pos, 10, _v);
+	if (v == NULL) {
+		return -EINVAL;
+	}
+
+	rr->name_pos = dp->pos;
+	rr->type = ntohs(get_byte2(v));
+	rr->class = ntohs(get_byte2(v + 2));
+	rr->ttl = ntohl(get_byte4(v + 4));
+	rr->rdlength = ntohs(get_byte2(v + 8));
+	rr->rdata_pos = pos + 10;
+	if (rr->rdata_pos + rr->rdlength > dp->len) {
+		return -EINVAL;
+	}
+	dp->pos = rr->rdata_pos + rr->rdlength;
+
+	return 0;
+}
+
+int natcap_dns_rdata_read(const struct natcap_dns_parser *dp, const struct natcap_dns_rr *rr, void *buf, unsigned int len)
+{
+	if (len > rr->rdlength) {
+		return -EINVAL;
+	}
+	return skb_copy_bits(dp->skb, dp->off + rr->rdata_pos, buf, len);
+}
+
+/*
+ * read the name at pos in dotted text format, follow the compression pointers.
+ * a pointer must go backwards, so a crafted loop can not hold us.
+ * return the text length or -1
+ */
+int natcap_dns_name_read(const struct natcap_dns_parser *dp, unsigned int pos, char *buf, unsigned int size)
+{
+	int v;
+	unsigned int n = 0;
+	unsigned int label = pos;
+
+	if (size == 0) {
+		return -1;
+	}
+	while ((v = dns_parser_byte(dp, pos)) > 0) {
+		if ((v & 0xC0) == 0xC0) {
+			int lo = dns_parser_byte(dp, pos + 1);
+			if (lo < 0) {
+				return -1;
+			}
+			pos = ((v & 0x3F) << 8) | lo;
+			if (pos >= label) {
+				return -1;
+			}
+			label = pos;
+			continue;
+		}
+		if (v > 0x3F || n + v + 1 >= size || n + v + 1 > DNS_NAME_MAX) {
+			return -1;
+		}
+		if (skb_copy_bits(dp->skb, dp->off + pos + 1, buf + n, v) != 0) {
+			return -1;
+		}
+		n += v;
+		buf[n++] = '.';
+		pos += v + 1;
+	}
+	if (v < 0) {
+		return -1;
+	}
+
+	if (n > 0) {
+		n--;
+	}
+	buf[n] = 0;
+	return n;
+}
+
+/* domain suffix set: one hash of the domains in dotted text, a qname probes each of its
+ * suffixes at a label boundary
+ */
+struct dns_domain_node {
+	struct hlist_node hnode;
+	struct rcu_head rcu;
+	unsigned int hash;
+	unsigned char len;
+	char name[0];
+};
+
+#define DNS_DOMAIN_HASH_SIZE 8192
+static DEFINE_MUTEX(dns_domain_mutex);
+static struct hlist_head dns_domain_hash[DNS_DOMAIN_HASH_SIZE];
+static unsigned int dns_domain_count = 0;
+
+struct dns_route_node {
+	struct hlist_node hnode;
+	struct rcu_head rcu;
+	__be32 ip;
+	unsigned long expires;
+};
+
+unsigned int dns_route_max = 65536;
+
+#define DNS_ROUTE_HASH_SIZE 4096
+#define DNS_ROUTE_TTL_MIN 60
+#define DNS_ROUTE_TTL_MAX 86400
+#define DNS_ROUTE_GC_STEP (DNS_ROUTE_HASH_SIZE / 32)
+
+static DEFINE_SPINLOCK(dns_route_lock);
+static struct hlist_head dns_route_hash[DNS_ROUTE_HASH_SIZE];
+static atomic_t dns_route_count = ATOMIC_INIT(0);
+static struct timer_list dns_route_gc_timer;
+static int dns_route_gc_stop = 1;
+
+unsigned int dns_domain_entries(void)
+{
+	return dns_domain_count;
+}
+
+unsigned int dns_route_entries(void)
+{
+	return atomic_read(&dns_route_count);
+}
+
+/* hashed from the last char so that all suffixes of a name come in one pass */
+static inline unsigned int dns_domain_hash_step(unsigned int h, unsigned char c)
+{
+	return h * 31 + tolower(c);
+}
+
+static inline struct hlist_head *dns_domain_bucket(unsigned int hash)
+{
+	return &dns_domain_hash[jhash_1word(hash, dns_cache_rnd) % DNS_DOMAIN_HASH_SIZE];
+}
+
+/* the wire format name from the label at @pos equals the dotted @text */
+static int dns_domain_wire_eq(const char *text, int len, const unsigned char *name, int name_len, int pos)
+{
+	int i = 0;
+
+	while (pos < name_len && name[pos] != 0) {
+		int l = name[pos++];
+
+		if (i != 0) {
+			if (i >= len || text[i] != '.')
+				return 0;
+			i++;
+		}
+		if (i + l > len || pos + l > name_len || strncasecmp(text + i, (const char *)name + pos, l) != 0)
+			return 0;
+		i += l;
+		pos += l;
+	}
+
+	return i == len;
+}
+
+/* add a domain in dotted text format: example.com */
+int natcap_dns_domain_add(const char *domain)
+{
+	int i, len, label;
+	unsigned int hash = 0;
+	struct dns_domain_node *node, *old;
+
+	len = strlen(domain);
+	while (len > 0 && domain[len - 1] == '.') len--;
+	while (len > 0 && domain[0] == '.') {
+		domain++;
+		len--;
+	}
+	if (len == 0 || len > DNS_NAME_MAX - 2) {
+		return -EINVAL;
+	}
+
+	label = 0;
+	for (i = 0; i < len; i++) {
+		if (domain[i] == '.') {
+			if (i + 1 == len || domain[i + 1] == '.') {
+				return -EINVAL;
+			}
+			label = 0;
+		} else if (++label > 63) {
+			return -EINVAL;
+		}
+	}
+
+	node = kmalloc(sizeof(struct dns_domain_node) + len, GFP_KERNEL);
+	if (node == NULL) {
+		return -ENOMEM;
+	}
+	for (i = len - 1; i >= 0; i--) {
+		node->name[i] = tolower(domain[i]);
+		hash = dns_domain_hash_step(hash, node->name[i]);
+	}
+	node->len = len;
+	node->hash = hash;
+
+	mutex_lock(&dns_domain_mutex);
+	hlist_for_each_entry(old, dns_domain_bucket(hash), hnode) {
+		if (old->hash == hash && old->len == len && memcmp(old->name, node->name, len) == 0) {
+			mutex_unlock(&dns_domain_mutex);
+			kfree(node);
+			return 0;
+		}
+	}
+	hlist_add_head_rcu(&node->hnode, dns_domain_bucket(hash));
+	dns_domain_count++;
+	mutex_unlock(&dns_domain_mutex);
+
+	return 0;
+}
+
+void natcap_dns_domain_cleanup(void)
+{
+	unsigned int i;
+	struct dns_domain_node *node;
+	struct hlist_node *n;
+
+	mutex_lock(&dns_domain_mutex);
+	for (i = 0; i < DNS_DOMAIN_HASH_SIZE; i++) {
+		hlist_for_each_entry_safe(node, n, &dns_domain_hash[i], hnode) {
+			hlist_del_rcu(&node->hnode);
+			kfree_rcu(node, rcu);
+		}
+	}
+	dns_domain_count = 0;
+	mutex_unlock(&dns_domain_mutex);
+}
+
+/* @name is the uncompressed qname in wire format, called with rcu_read_lock held
+ * one hash probe per suffix at a label boundary, hashed in one pass from the end
+ */
+static int dns_domain_match(const unsigned char *name, int name_len)
+{
+	int i, l, n = 0;
+	int pos = 0;
+	unsigned int hash = 0;
+	unsigned char off[DNS_NAME_MAX / 2];
+	struct dns_domain_node *node;
+
+	while (pos < name_len && name[pos] != 0) {
+		if (n >= ARRAY_SIZE(off)) {
+			return 0;
+		}
+		off[n++] = pos;
+		pos += name[pos] + 1;
+	}
+	if (n == 0 || pos >= name_len) {
+		return 0;
+	}
+
+	/* the length byte of a label ends the text suffix from that label, then counts as a dot */
+	l = n - 1;
+	for (i = pos - 1; i >= 0; i--) {
+		if (i != off[l]) {
+			hash = dns_domain_hash_step(hash, name[i]);
+			continue;
+		}
+		hlist_for_each_entry_rcu(node, dns_domain_bucket(hash), hnode) {
+			if (node->hash == hash && dns_domain_wire_eq(node->name, node->len, name, name_len, i)) {
+				return 1;
+			}
+		}
+		if (l-- == 0)
+			break;
+		hash = dns_domain_hash_step(hash, '.');
+	}
+
+	return 0;
+}
+
+static inline unsigned int dns_route_hashfn(__be32 ip)
+{
+	return jhash_1word((__force u32)ip, dns_cache_rnd) % DNS_ROUTE_HASH_SIZE;
+}
+
+int natcap_dns_route_lookup(__be32 ip)
+{
+	int ret = 0;
+	struct dns_route_node *node;
+
+	if (atomic_read(&dns_route_count) == 0) {
+		return 0;
+	}
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(node, &dns_route_hash[dns_route_hashfn(ip)], hnode) {
+		if (node->ip == ip) {
+			ret = time_before(jiffies, node->expires);
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	return ret;
+}
+
+static void dns_route_insert(__be32 ip, unsigned int ttl)
+{
+	unsigned int hash;
+	unsigned long expires;
+	struct dns_route_node *node;
+
+	if (ttl < DNS_ROUTE_TTL_MIN) {
+		/* clients keep using an answer a bit past its ttl */
+		ttl = DNS_ROUTE_TTL_MIN;
+	} else if (ttl > DNS_ROUTE_TTL_MAX) {
+		ttl = DNS_ROUTE_TTL_MAX;
+	}
+	expires = jiffies + ttl * HZ;
+	hash = dns_route_hashfn(ip);
+
+	spin_lock_bh(&dns_route_lock);
+	hlist_for_each_entry(node, &dns_route_hash[hash], hnode) {
+		if (node->ip == ip) {
+			if (time_after(expires, node->expires)) {
+				node->expires = expires;
+			}
+			goto out;
+		}
+	}
+	if (atomic_read(&dns_route_count) >= dns_route_max) {
+		goto out;
+	}
+	node = kmalloc(sizeof(struct dns_route_node), GFP_ATOMIC);
+	if (node == NULL) {
+		goto out;
+	}
+	node->ip = ip;
+	node->expires = expires;
+	hlist_add_head_rcu(&node->hnode, &dns_route_hash[hash]);
+	atomic_inc(&dns_route_count);
+out:
+	spin_unlock_bh(&dns_route_lock);
+}
+
+void natcap_dns_route_learn(struct sk_buff *skb, unsigned int off)
+{
+	int i, qlen, match;
+	__be32 ip;
+	unsigned char *name;
+	struct natcap_dns_parser dp;
+	struct natcap_dns_question q;
+	struct natcap_dns_rr rr;
+	struct natcap_dns_scratch *scratch;
+
+	if (dns_domain_count == 0) {
+		return;
+	}
+	if (natcap_dns_parser_init(&dp, skb, off) != 0) {
+		return;
+	}
+	/* QR=1, RCODE=NOERROR, QDCOUNT=1 */
+	if ((dp.flags & 0x800F) != 0x8000 || dp.qdcount != 1 || dp.ancount == 0) {
+		return;
+	}
+	if (natcap_dns_parse_question(&dp, &q) != 0 || q.name_len > NATCAP_DNS_NAME_BUF) {
+		return;
+	}
+
+	qlen = natcap_dns_qname_len(&dp, q.name_pos);
+	if (qlen <= 0) {
+		return;
+	}
+
+	scratch = natcap_dns_scratch_get();
+	name = skb_header_pointer(skb, off + q.name_pos, qlen, scratch->name);
+	rcu_read_lock();
+	match = name != NULL && dns_domain_match(name, qlen);
+	rcu_read_unlock();
+	natcap_dns_scratch_put();
+	if (!match) {
+		return;
+	}
+
+	/* every A answer belongs to the qname or to its CNAME chain */
+	for (i = 0; i < dp.ancount; i++) {
+		if (natcap_dns_parse_rr(&dp, &rr) != 0) {
+			return;
+		}
+		if (rr.type == 1 && rr.class == 1 && rr.rdlength == 4 && natcap_dns_rdata_read(&dp, &rr, &ip, 4) == 0) {
+			NATCAP_DEBUG(DEBUG_FMT_PREFIX "dns route add %pI4 ttl=%u\n", DEBUG_ARG_PREFIX, &ip, rr.ttl);
+			dns_route_insert(ip, rr.ttl);
+		}
+	}
+}
+
+void natcap_dns_route_cleanup(void)
+{
+	unsigned int i;
+	struct dns_route_node *node;
+	struct hlist_node *n;
+
+	spin_lock_bh(&dns_route_lock);
+	for (i = 0; i < DNS_ROUTE_HASH_SIZE; i++) {
+		hlist_for_each_entry_safe(node, n, &dns_route_hash[i], hnode) {
+			hlist_del_rcu(&node->hnode);
+			atomic_dec(&dns_route_count);
+			kfree_rcu(node, rcu);
+		}
+	}
+	spin_unlock_bh(&dns_route_lock);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+static void dns_route_gc(unsigned long ignore)
+#else
+static void dns_route_gc(struct timer_list *ignore)
+#endif
+{
+	static unsigned int gc_idx = 0;
+	unsigned int i;
+	struct dns_route_node *node;
+	struct hlist_node *n;
+
+	spin_lock_bh(&dns_route_lock);
+	for (i = 0; i < DNS_ROUTE_GC_STEP; i++) {
+		gc_idx = (gc_idx + 1) % DNS_ROUTE_HASH_SIZE;
+		hlist_for_each_entry_safe(node, n, &dns_route_hash[gc_idx], hnode) {
+			if (time_after_eq(jiffies, node->expires)) {
+				hlist_del_rcu(&node->hnode);
+				atomic_dec(&dns_route_count);
+				kfree_rcu(node, rcu);
+			}
+		}
+	}
+	spin_unlock_bh(&dns_route_lock);
+
+	if (dns_route_gc_stop) {
+		return;
+	}
+	mod_timer(&dns_route_gc_timer, jiffies + HZ);
+}
+
+/* called with dns_cache_lock held */
+static struct sk_buff *dns_cache_reply_build(struct sk_buff *oskb, const struct udphdr *oudph,
+		const struct dns_cache_node *node, unsigned int remain, const unsigned char *q)
+{
+	int i;
+	int len;
+	struct sk_buff *nskb;
+	struct ethhdr *neth, *oeth;
+	struct iphdr *niph, *oiph;
+	struct udphdr *nudph;
+	unsigned char *data;
+
+	len = sizeof(struct iphdr) + sizeof(struct udphdr) + node->len;
+
+	oeth = (struct ethhdr *)skb_mac_header(oskb);
+	oiph = ip_hdr(oskb);
+
+	nskb = skb_copy_expand(oskb, skb_headroom(oskb), len > oskb->len ? len - oskb->len : 0, GFP_ATOMIC);
+	if (!nskb) {
+		NATCAP_ERROR(DEBUG_FMT_PREFIX "alloc_skb fail\n", DEBUG_ARG_PREFIX);
+		return NULL;
+	}
+	if (len > nskb->len) {
+		skb_put(nskb, len - nskb->len);
+	} else {
+		skb_trim(nskb, len);
+	}
+
+	neth = eth_hdr(nskb);
+	memcpy(neth->h_dest, oeth->h_source, ETH_ALEN);
+	memcpy(neth->h_source, oeth->h_dest, ETH_ALEN);
+
+	niph = ip_hdr(nskb);
+	niph->saddr = oiph->daddr;
+	niph->daddr = oiph->saddr;
+	niph->version = oiph->version;
+	niph->ihl = sizeof(struct iphdr) / 4;
+	niph->tos = 0;
+	niph->tot_len = htons(len);
+	niph->ttl = 0x80;
+	niph->protocol = IPPROTO_UDP;
+	niph->id = __constant_htons(0xDEAD);
+	niph->frag_off = 0x0;
+
+	nudph = (struct udphdr *)((void *)niph + niph->ihl * 4);
+	nudph->source = oudph->dest;
+	nudph->dest = oudph->source;
+	nudph->len = htons(len - niph->ihl * 4);
+	nudph->check = CSUM_MANGLED_0;
+
+	data = (unsigned char *)nudph + sizeof(struct udphdr);
+	memcpy(data, node->msg, node->len);
+	/* the query id, the RD bit and the 0x20 case of the question come from the query */
+	set_byte2(data, get_byte2(q));
+	set_byte2(data + 2, htons((ntohs(get_byte2(data + 2)) & ~0x0100) | (ntohs(get_byte2(q + 2)) & 0x0100)));
+	memcpy(data + DNS_HDR_LEN, q + DNS_HDR_LEN, node->qlen);
+	for (i = 0; i < node->ttl_num; i++) {
+		set_byte4(data + node->ttl_off[i], htonl(remain));
+	}
+
+	nskb->ip_summed = CHECKSUM_UNNECESSARY;
+	skb_rcsum_tcpudp(nskb);
+
+	skb_push(nskb, (char *)niph - (char *)neth);
+
+	return nskb;
+}
+
+/* turn the client query of skb into the refresh query of the cache, a flow of its own
+ * from dns_cache_prefetch_port, conntrack has not seen the skb yet
+ */
+static int dns_cache_prefetch_query(struct sk_buff *skb)
+{
+	struct iphdr *iph;
+	struct udphdr *udph;
+	__be16 port = htons(dns_cache_prefetch_port);
+
+	iph = ip_hdr(skb);
+	if (!skb_make_writable(skb, iph->ihl * 4 + sizeof(struct udphdr))) {
+		return -1;
+	}
+	iph = ip_hdr(skb);
+	udph = (struct udphdr *)((void *)iph + iph->ihl * 4);
+	if (udph->check) {
+		inet_proto_csum_replace2(&udph->check, skb, udph->source, port, false);
+		if (udph->check == 0)
+			udph->check = CSUM_MANGLED_0;
+	}
+	udph->source = port;
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
+static unsigned int natcap_dns_pre_in_hook(unsigned int hooknum,
+		struct sk_buff *skb,
+		const struct net_device *in,
+		const struct net_device *out,
+		int (*okfn)(struct sk_buff *))
+{
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 1, 0)
+static unsigned int natcap_dns_pre_in_hook(const struct nf_hook_ops *ops,
+		struct sk_buff *skb,
+		const struct net_device *in,
+		const struct net_device *out,
+		int (*okfn)(struct sk_buff *))
+{
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
+static unsigned int natcap_dns_pre_in_hook(const struct nf_hook_ops *ops,
+		struct sk_buff *skb,
+		const struct nf_hook_state *state)
+{
+	const struct net_device *in = state->in;
+#else
+static unsigned int natcap_dns_pre_in_hook(void *priv,
+		struct sk_buff *skb,
+		const struct nf_hook_state *state)
+{
+	const struct net_device *in = state->in;
+#endif
+	int qlen;
+	int prefetch = 0;
+	unsigned int hash;
+	unsigned long remain;
+	struct iphdr *iph;
+	struct udphdr _udph, *udph;
+	struct sk_buff *nskb;
+	struct dns_cache_node *node;
+	struct natcap_dns_parser dp;
+	struct natcap_dns_question dq;
+	unsigned char _q[DNS_HDR_LEN + DNS_QUESTION_MAX];
+	unsigned char key[DNS_QUESTION_MAX];
+	unsigned char *q;
+
+	if (disabled || !dns_cache_enabled)
+		return NF_ACCEPT;
+
+	iph = ip_hdr(skb);
+	if (iph->protocol != IPPROTO_UDP) {
+		return NF_ACCEPT;
+	}
+	if ((iph->frag_off & __constant_htons(IP_MF | IP_OFFSET))) {
+		return NF_ACCEPT;
+	}
+	/* only answer the LAN clients, never the local resolver */
+	if (in == NULL || !skb_mac_header_was_set(skb) || inet_is_local(in, iph->daddr)) {
+		return NF_ACCEPT;
+	}
+
+	udph = skb_header_pointer(skb, iph->ihl * 4, sizeof(_udph), &_udph);
+	if (udph == NULL || udph->dest != __constant_htons(53)) {
+		return NF_ACCEPT;
+	}
+
+	if (natcap_dns_parser_init(&dp, skb, iph->ihl * 4 + sizeof(struct udphdr)) != 0) {
+		return NF_ACCEPT;
+	}
+	/* QR=0, OPCODE=QUERY, QDCOUNT=1, ANCOUNT=0 */
+	if ((dp.flags & 0xF800) != 0 || dp.qdcount != 1 || dp.ancount != 0) {
+		return NF_ACCEPT;
+	}
+	if (natcap_dns_parse_question(&dp, &dq) != 0 || natcap_dns_qname_len(&dp, dq.name_pos) != dq.name_len) {
+		return NF_ACCEPT;
+	}
+	qlen = dq.name_len + 4;
+	/* the header and the question, copied out when the skb is non-linear */
+	q = skb_header_pointer(skb, iph->ihl * 4 + sizeof(struct udphdr), DNS_HDR_LEN + qlen, _q);
+	if (q == NULL) {
+		return NF_ACCEPT;
+	}
+	dns_key_setup(key, q + DNS_HDR_LEN, dq.name_len);
+	hash = dns_cache_hashfn(key, qlen);
+
+	spin_lock_bh(&dns_cache_lock);
+	node = dns_cache_find(hash, key, qlen);
+	if (node && time_after_eq(jiffies, node->expires)) {
+		dns_cache_node_del(node);
+		node = NULL;
+	}
+	if (node == NULL) {
+		dns_cache_misses++;
+		spin_unlock_bh(&dns_cache_lock);
+		return NF_ACCEPT;
+	}
+	node->hits++;
+	list_move(&node->lru, &dns_cache_lru);
+	remain = (node->expires - jiffies + HZ - 1) / HZ;
+	nskb = dns_cache_reply_build(skb, udph, node, remain, q);
+	if (nskb == NULL) {
+		spin_unlock_bh(&dns_cache_lock);
+		return NF_ACCEPT;
+	}
+	dns_cache_hits++;
+	if (node->hits >= DNS_CACHE_PREFETCH_HITS && remain * 10 < node->ttl &&
+			(!node->prefetching || time_after_eq(jiffies, node->prefetch_expires))) {
+		node->prefetching = 1;
+		node->prefetch_expires = jiffies + DNS_CACHE_PREFETCH_TIMEOUT;
+		prefetch = 1;
+		dns_cache_prefetches++;
+	}
+	spin_unlock_bh(&dns_cache_lock);
+
+	nskb->dev = (struct net_device *)in;
+	nf_reset(nskb);
+	dev_queue_xmit(nskb);
+
+	if (prefetch && udph->source != htons(dns_cache_prefetch_port) && dns_cache_prefetch_query(skb) == 0) {
+		/* the client is answered, its query goes upstream from the prefetch port
+		 * and the answer of that flow only goes into the cache
+		 */
+		return NF_ACCEPT;
+	}
+
+	consume_skb(skb);
+	return NF_STOLEN;
+}
+
+static struct nf_hook_ops dns_hooks[] = {
+	{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
+		.owner = THIS_MODULE,
+#endif
+		.hook = natcap_dns_pre_in_hook,
+		.pf = PF_INET,
+		.hooknum = NF_INET_PRE_ROUTING,
+		.priority = NF_IP_PRI_CONNTRACK - 5,
+	},
+};
+
+int natcap_dns_init(void)
+{
+	int i;
+	int ret = 0;
+
+	get_random_bytes(&dns_cache_rnd, sizeof(dns_cache_rnd));
+	for (i = 0; i < DNS_CACHE_HASH_SIZE; i++) {
+		INIT_HLIST_HEAD(&dns_cache_hash[i]);
+	}
+
+	for (i = 0; i < DNS_ROUTE_HASH_SIZE; i++) {
+		INIT_HLIST_HEAD(&dns_route_hash[i]);
+	}
+
+	for (i = 0; i < DNS_DOMAIN_HASH_SIZE; i++) {
+		INIT_HLIST_HEAD(&dns_domain_hash[i]);
+	}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+	init_timer(&dns_route_gc_timer);
+	dns_route_gc_timer.data = 0;
+	dns_route_gc_timer.function = dns_route_gc;
+#else
+	timer_setup(&dns_route_gc_timer, dns_route_gc, 0);
+#endif
+	dns_route_gc_stop = 0;
+	mod_timer(&dns_route_gc_timer, jiffies + HZ);
+
+	ret = nf_register_hooks(dns_hooks, ARRAY_SIZE(dns_hooks));
+	if (ret != 0) {
+		dns_route_gc_stop = 1;
+		del_timer_sync(&dns_route_gc_timer);
+	}
+	return ret;
+}
+
+void natcap_dns_exit(void)
+{
+	nf_unregister_hooks(dns_hooks, ARRAY_SIZE(dns_hooks));
+	natcap_dns_cache_cleanup();
+
+	dns_route_gc_stop = 1;
+	del_timer_sync(&dns_route_gc_timer);
+	natcap_dns_route_cleanup();
+	natcap_dns_domain_cleanup();
+	rcu_barrier();
+}
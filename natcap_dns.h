@@ -0,0 +1,114 @@
+/*
+ * Author: natcap contributors
+ *  Date : Sun, 18 Oct 2026 16:52:09 +0000
+ *
+ * This file is part of the natcap.
+ *
+ * natcap is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * natcap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with natcap; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifndef _NATCAP_DNS_H_
+#define _NATCAP_DNS_H_
+
+#include <linux/types.h>
+#include <linux/skbuff.h>
+#include <net/netfilter/nf_conntrack.h>
+#include "natcap.h"
+
+extern unsigned int dns_cache_enabled;
+extern unsigned int dns_cache_mem_limit;
+
+extern unsigned long dns_cache_hits;
+extern unsigned long dns_cache_misses;
+extern unsigned long dns_cache_prefetches;
+extern unsigned short dns_cache_prefetch_port;
+extern unsigned int dns_cache_entries(void);
+extern unsigned int dns_cache_mem_used(void);
+
+/* store the DNS answer at @off of skb, the skb can be non-linear
+ * @prefetch: skb is of the flow of a refresh query, return 1 then and the caller drops it
+ */
+extern int natcap_dns_cache_store(struct sk_buff *skb, unsigned int off, int prefetch);
+
+/* the flow of ct was started by dns_cache_prefetch_query() */
+static inline int natcap_dns_prefetch_ct(const struct nf_conn *ct)
+{
+	return ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.udp.port == htons(dns_cache_prefetch_port);
+}
+extern void natcap_dns_cache_cleanup(void);
+
+#define NATCAP_DNS_NAME_BUF 256
+
+/* a bounded parser over the DNS message at @off of skb, the skb can be non-linear */
+struct natcap_dns_parser {
+	const struct sk_buff *skb;
+	unsigned int off;
+	unsigned int len;
+	unsigned int pos;
+	unsigned short id;
+	unsigned short flags;
+	unsigned short qdcount;
+	unsigned short ancount;
+	unsigned short nscount;
+	unsigned short arcount;
+};
+
+struct natcap_dns_question {
+	unsigned int name_pos;
+	unsigned int name_len;
+	unsigned short qtype;
+	unsigned short qclass;
+};
+
+struct natcap_dns_rr {
+	unsigned int name_pos;
+	unsigned int rdata_pos;
+	unsigned int ttl;
+	unsigned short type;
+	unsigned short class;
+	unsigned short rdlength;
+};
+
+struct natcap_dns_scratch {
+	char name[NATCAP_DNS_NAME_BUF];
+};
+
+extern struct natcap_dns_scratch *natcap_dns_scratch_get(void);
+extern void natcap_dns_scratch_put(void);
+
+extern int natcap_dns_parser_init(struct natcap_dns_parser *dp, const struct sk_buff *skb, unsigned int off);
+extern int natcap_dns_name_skip(const struct natcap_dns_parser *dp, unsigned int pos);
+extern int natcap_dns_qname_len(const struct natcap_dns_parser *dp, unsigned int pos);
+extern int natcap_dns_name_read(const struct natcap_dns_parser *dp, unsigned int pos, char *buf, unsigned int size);
+extern int natcap_dns_parse_question(struct natcap_dns_parser *dp, struct natcap_dns_question *q);
+extern int natcap_dns_parse_rr(struct natcap_dns_parser *dp, struct natcap_dns_rr *rr);
+extern int natcap_dns_rdata_read(const struct natcap_dns_parser *dp, const struct natcap_dns_rr *rr, void *buf, unsigned int len);
+
+extern unsigned int dns_route_max;
+extern unsigned int dns_domain_entries(void);
+extern unsigned int dns_route_entries(void);
+
+/* domains whose A answers are routed through the natcap server */
+extern int natcap_dns_domain_add(const char *domain);
+extern void natcap_dns_domain_cleanup(void);
+
+/* learn the A answers at @off of skb when the qname matches a domain */
+extern void natcap_dns_route_learn(struct sk_buff *skb, unsigned int off);
+extern int natcap_dns_route_lookup(__be32 ip);
+extern void natcap_dns_route_cleanup(void);
+
+int natcap_dns_init(void);
+void natcap_dns_exit(void);
+
+#endif /* _NATCAP_DNS_H_ */
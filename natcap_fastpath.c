@@ -0,0 +1,695 @@
+/*
+ * Author: natcap contributors
+ *  Date : Sun, 18 Oct 2026 17:39:58 +0000
+ *
+ * This file is part of the natcap.
+ *
+ * natcap is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * natcap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with natcap; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#include <linux/etherdevice.h>
+#include <linux/if_arp.h>
+#include <linux/if_ether.h>
+#include <linux/init.h>
+#include <linux/ip.h>
+#include <linux/jhash.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/module.h>
+#include <linux/netdevice.h>
+#include <linux/netfilter.h>
+#include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/skbuff.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/tcp.h>
+#include <linux/timer.h>
+#include <linux/version.h>
+#include <net/checksum.h>
+#include <net/ip.h>
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_acct.h>
+#include "net/netfilter/nf_conntrack_seqadj.h"
+#include "natcap_common.h"
+#include "natcap_client.h"
+#include "natcap_fastpath.h"
+
+/* established natcap client tcp flows are offloaded here:
+ * the slow path learns the in/out devs and the mac of both sides,
+ * then the packets of the flow are rewritten and sent out at PRE_ROUTING
+ * before conntrack, without passing the nat and natcap hooks again.
+ */
+unsigned int fastpath_enabled = 0;
+unsigned int fastpath_max = 8192;
+
+unsigned long fastpath_hits = 0;
+
+#define FASTPATH_HASH_SIZE 4096
+#define FASTPATH_GC_STEP (FASTPATH_HASH_SIZE / 8)
+/* drop the idle flows and the flows that never get ready */
+#define FASTPATH_IDLE_TIMEOUT (30 * HZ)
+/* the learned route is only trusted for this long, then the slow path learns it again */
+#define FASTPATH_RELEARN_TIMEOUT (60 * HZ)
+
+enum {
+	FASTPATH_LEARNING = 0,
+	FASTPATH_READY,
+	FASTPATH_BAD, //asymmetric route or not ethernet, keep it so the flow is not learned again
+};
+
+struct fastpath_tuple {
+	struct hlist_node hnode;
+	unsigned char dir;
+};
+
+struct fastpath_node {
+	struct fastpath_tuple tuple[IP_CT_DIR_MAX];
+	struct rcu_head rcu;
+	struct nf_conn *ct;
+	unsigned long active;
+	unsigned long ready_jiffies;
+	unsigned long span; //the ct timeout refreshed on each packet
+	unsigned char state;
+	unsigned char enc;
+	unsigned char dead;
+	unsigned char learned[IP_CT_DIR_MAX];
+	struct net_device *indev[IP_CT_DIR_MAX];
+	struct net_device *outdev[IP_CT_DIR_MAX];
+	unsigned char in_mac[IP_CT_DIR_MAX][ETH_ALEN]; //the mac of the sender seen on indev
+	unsigned char l2_head[IP_CT_DIR_MAX][ETH_HLEN]; //built when ready, pushed on the packets of dir
+};
+
+static DEFINE_SPINLOCK(fastpath_lock);
+static struct hlist_head fastpath_hash[FASTPATH_HASH_SIZE];
+static atomic_t fastpath_count = ATOMIC_INIT(0);
+static unsigned int fastpath_rnd __read_mostly;
+static struct timer_list fastpath_gc_timer;
+static int fastpath_gc_stop = 1;
+
+unsigned int fastpath_entries(void)
+{
+	return atomic_read(&fastpath_count);
+}
+
+static inline struct fastpath_node *fastpath_tuple_node(const struct fastpath_tuple *ft)
+{
+	return container_of(ft, struct fastpath_node, tuple[ft->dir]);
+}
+
+static inline unsigned int fastpath_hashfn(__be32 saddr, __be32 daddr, __be16 sport, __be16 dport)
+{
+	return jhash_3words(saddr, daddr, ((__force u32)sport << 16) | (__force u32)dport, fastpath_rnd) % FASTPATH_HASH_SIZE;
+}
+
+static inline unsigned int fastpath_tuple_hashfn(const struct nf_conntrack_tuple *t)
+{
+	return fastpath_hashfn(t->src.u3.ip, t->dst.u3.ip, t->src.u.tcp.port, t->dst.u.tcp.port);
+}
+
+/* called with rcu_read_lock or fastpath_lock held */
+static struct fastpath_tuple *fastpath_find(__be32 saddr, __be32 daddr, __be16 sport, __be16 dport)
+{
+	struct fastpath_tuple *ft;
+
+	hlist_for_each_entry_rcu(ft, &fastpath_hash[fastpath_hashfn(saddr, daddr, sport, dport)], hnode) {
+		const struct nf_conntrack_tuple *t = &fastpath_tuple_node(ft)->ct->tuplehash[ft->dir].tuple;
+		if (t->src.u3.ip == saddr && t->dst.u3.ip == daddr &&
+				t->src.u.tcp.port == sport && t->dst.u.tcp.port == dport) {
+			return ft;
+		}
+	}
+	return NULL;
+}
+
+static void fastpath_node_free_rcu(struct rcu_head *head)
+{
+	struct fastpath_node *fp = container_of(head, struct fastpath_node, rcu);
+
+	nf_ct_put(fp->ct);
+	kfree(fp);
+}
+
+/* called with fastpath_lock held */
+static void fastpath_node_del(struct fastpath_node *fp)
+{
+	if (fp->dead)
+		return;
+	fp->dead = 1;
+	hlist_del_rcu(&fp->tuple[IP_CT_DIR_ORIGINAL].hnode);
+	hlist_del_rcu(&fp->tuple[IP_CT_DIR_REPLY].hnode);
+	atomic_dec(&fastpath_count);
+	call_rcu(&fp->rcu, fastpath_node_free_rcu);
+}
+
+void natcap_fastpath_cleanup(void)
+{
+	int i;
+	struct fastpath_tuple *ft;
+	struct hlist_node *n;
+
+	spin_lock_bh(&fastpath_lock);
+	for (i = 0; i < FASTPATH_HASH_SIZE; i++) {
+		hlist_for_each_entry_safe(ft, n, &fastpath_hash[i], hnode) {
+			fastpath_node_del(fastpath_tuple_node(ft));
+		}
+	}
+	spin_unlock_bh(&fastpath_lock);
+}
+
+static inline unsigned long fastpath_ct_remain(struct nf_conn *ct)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 9, 0)
+	long remain = (long)(ct->timeout.expires - jiffies);
+#else
+	s32 remain = (s32)(ct->timeout - (u32)jiffies);
+#endif
+	return remain > 0 ? remain : 0;
+}
+
+static inline void fastpath_ct_touch(struct nf_conn *ct, unsigned long span)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 9, 0)
+	unsigned long newtimeout = jiffies + span;
+	if (newtimeout - ct->timeout.expires > HZ) {
+		mod_timer_pending(&ct->timeout, newtimeout);
+	}
+#else
+	u32 newtimeout = (u32)jiffies + span;
+	if ((s32)(newtimeout - ct->timeout) > HZ) {
+		ct->timeout = newtimeout;
+	}
+#endif
+}
+
+/* only the plain client flows, whose packets are NATed and at most payload encoded */
+static int fastpath_ct_eligible(struct nf_conn *ct)
+{
+	struct natcap_session *ns;
+
+	if (!(IPS_NATCAP & ct->status) ||
+			(ct->status & (IPS_NATCAP_BYPASS | IPS_NATCAP_SERVER | IPS_NATCAP_DUAL | IPS_NATCAP_PEER))) {
+		return 0;
+	}
+	if (nf_ct_protonum(ct) != IPPROTO_TCP || nf_ct_is_dying(ct) || !(IPS_SEEN_REPLY & ct->status)) {
+		return 0;
+	}
+	if (ct->proto.tcp.state != TCP_CONNTRACK_ESTABLISHED || nfct_seqadj(ct)) {
+		return 0;
+	}
+	ns = natcap_session_get(ct);
+	if (ns == NULL || !(NS_NATCAP_AUTH & ns->n.status) ||
+			(ns->n.status & (NS_NATCAP_TCPUDPENC | NS_NATCAP_CONFUSION)) || ns->n.tcp_seq_offset != 0) {
+		return 0;
+	}
+	if (!(NS_NATCAP_NOLIMIT & ns->n.status) && (natcap_tx_speed_get() != 0 || natcap_rx_speed_get() != 0)) {
+		return 0;
+	}
+	return 1;
+}
+
+/* called with fastpath_lock held, all the devs and macs of both dirs are learned */
+static void fastpath_node_ready(struct fastpath_node *fp)
+{
+	int dir;
+	struct ethhdr *eth;
+	struct nf_conn *ct = fp->ct;
+	struct natcap_session *ns = natcap_session_get(ct);
+
+	for (dir = 0; dir < IP_CT_DIR_MAX; dir++) {
+		if (fp->outdev[dir] != fp->indev[!dir] || fp->outdev[dir]->type != ARPHRD_ETHER) {
+			fp->state = FASTPATH_BAD;
+			return;
+		}
+	}
+	if (ns == NULL || !fastpath_ct_eligible(ct)) {
+		return;
+	}
+	fp->span = fastpath_ct_remain(ct);
+	if (fp->span < HZ) {
+		return;
+	}
+	fp->enc = !!(NS_NATCAP_ENC & ns->n.status);
+
+	for (dir = 0; dir < IP_CT_DIR_MAX; dir++) {
+		eth = (struct ethhdr *)fp->l2_head[dir];
+		memcpy(eth->h_dest, fp->in_mac[!dir], ETH_ALEN);
+		memcpy(eth->h_source, fp->outdev[dir]->dev_addr, ETH_ALEN);
+		eth->h_proto = __constant_htons(ETH_P_IP);
+	}
+
+	/* the window tracking of ct no longer sees every packet */
+	spin_lock_bh(&ct->lock);
+	ct->proto.tcp.seen[0].flags |= IP_CT_TCP_FLAG_BE_LIBERAL;
+	ct->proto.tcp.seen[1].flags |= IP_CT_TCP_FLAG_BE_LIBERAL;
+	spin_unlock_bh(&ct->lock);
+
+	fp->ready_jiffies = jiffies;
+	smp_wmb();
+	fp->state = FASTPATH_READY;
+}
+
+/* learn the route of dir from a packet of the slow path at POST_ROUTING */
+static void fastpath_learn(struct sk_buff *skb, struct nf_conn *ct, int dir, struct net_device *in, const struct net_device *out)
+{
+	struct fastpath_tuple *ft;
+	struct fastpath_node *fp;
+	struct ethhdr *eth = eth_hdr(skb);
+	const struct nf_conntrack_tuple *t = &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+
+	rcu_read_lock();
+	ft = fastpath_find(t->src.u3.ip, t->dst.u3.ip, t->src.u.tcp.port, t->dst.u.tcp.port);
+	if (ft != NULL) {
+		fp = fastpath_tuple_node(ft);
+		if (fp->active != jiffies)
+			fp->active = jiffies;
+		if (fp->state != FASTPATH_LEARNING) {
+			rcu_read_unlock();
+			return;
+		}
+	}
+	rcu_read_unlock();
+
+	spin_lock_bh(&fastpath_lock);
+	//re-check-in-lock
+	ft = fastpath_find(t->src.u3.ip, t->dst.u3.ip, t->src.u.tcp.port, t->dst.u.tcp.port);
+	if (ft == NULL) {
+		if (atomic_read(&fastpath_count) >= fastpath_max) {
+			spin_unlock_bh(&fastpath_lock);
+			return;
+		}
+		fp = kzalloc(sizeof(struct fastpath_node), GFP_ATOMIC);
+		if (fp == NULL) {
+			spin_unlock_bh(&fastpath_lock);
+			return;
+		}
+		nf_conntrack_get(&ct->ct_general);
+		fp->ct = ct;
+		fp->active = jiffies;
+		fp->tuple[IP_CT_DIR_ORIGINAL].dir = IP_CT_DIR_ORIGINAL;
+		fp->tuple[IP_CT_DIR_REPLY].dir = IP_CT_DIR_REPLY;
+		hlist_add_head_rcu(&fp->tuple[IP_CT_DIR_ORIGINAL].hnode, &fastpath_hash[fastpath_tuple_hashfn(&ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple)]);
+		hlist_add_head_rcu(&fp->tuple[IP_CT_DIR_REPLY].hnode, &fastpath_hash[fastpath_tuple_hashfn(&ct->tuplehash[IP_CT_DIR_REPLY].tuple)]);
+		atomic_inc(&fastpath_count);
+	} else {
+		fp = fastpath_tuple_node(ft);
+		if (fp->state != FASTPATH_LEARNING) {
+			spin_unlock_bh(&fastpath_lock);
+			return;
+		}
+	}
+
+	fp->indev[dir] = in;
+	fp->outdev[dir] = (struct net_device *)out;
+	memcpy(fp->in_mac[dir], eth->h_source, ETH_ALEN);
+	fp->learned[dir] = 1;
+
+	if (fp->learned[IP_CT_DIR_ORIGINAL] && fp->learned[IP_CT_DIR_REPLY]) {
+		fastpath_node_ready(fp);
+	}
+	spin_unlock_bh(&fastpath_lock);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
+static unsigned int natcap_fastpath_post_hook(unsigned int hooknum,
+		struct sk_buff *skb,
+		const struct net_device *in,
+		const struct net_device *out,
+		int (*okfn)(struct sk_buff *))
+{
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 1, 0)
+static unsigned int natcap_fastpath_post_hook(const struct nf_hook_ops *ops,
+		struct sk_buff *skb,
+		const struct net_device *in,
+		const struct net_device *out,
+		int (*okfn)(struct sk_buff *))
+{
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
+static unsigned int natcap_fastpath_post_hook(const struct nf_hook_ops *ops,
+		struct sk_buff *skb,
+		const struct nf_hook_state *state)
+{
+	const struct net_device *out = state->out;
+#else
+static unsigned int natcap_fastpath_post_hook(void *priv,
+		struct sk_buff *skb,
+		const struct nf_hook_state *state)
+{
+	const struct net_device *out = state->out;
+#endif
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct;
+	struct net_device *indev;
+	struct iphdr *iph;
+	struct tcphdr *tcph;
+
+	if (disabled || !fastpath_enabled)
+		return NF_ACCEPT;
+
+	iph = ip_hdr(skb);
+	if (iph->protocol != IPPROTO_TCP || (iph->frag_off & __constant_htons(IP_MF | IP_OFFSET))) {
+		return NF_ACCEPT;
+	}
+	ct = nf_ct_get(skb, &ctinfo);
+	if (ct == NULL || !(IPS_NATCAP & ct->status)) {
+		return NF_ACCEPT;
+	}
+	if (!fastpath_ct_eligible(ct)) {
+		return NF_ACCEPT;
+	}
+	tcph = (struct tcphdr *)((void *)iph + iph->ihl * 4);
+	if (skb_headlen(skb) < iph->ihl * 4 + sizeof(struct tcphdr) || tcph->syn || tcph->fin || tcph->rst) {
+		return NF_ACCEPT;
+	}
+
+	/* only the forwarded packets that came in on ethernet, the mac header is still there */
+	if (out == NULL || skb->skb_iif == 0 || !skb_mac_header_was_set(skb) ||
+			skb_network_header(skb) - skb_mac_header(skb) != ETH_HLEN ||
+			eth_hdr(skb)->h_proto != __constant_htons(ETH_P_IP) ||
+			skb_dst(skb) == NULL || dst_xfrm(skb_dst(skb)) != NULL) {
+		return NF_ACCEPT;
+	}
+
+	rcu_read_lock();
+	indev = dev_get_by_index_rcu(dev_net(out), skb->skb_iif);
+	if (indev != NULL && indev->reg_state == NETREG_REGISTERED && netif_running(indev) && netif_running(out)) {
+		fastpath_learn(skb, ct, CTINFO2DIR(ctinfo), indev, out);
+	}
+	rcu_read_unlock();
+
+	return NF_ACCEPT;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
+static unsigned int natcap_fastpath_pre_hook(unsigned int hooknum,
+		struct sk_buff *skb,
+		const struct net_device *in,
+		const struct net_device *out,
+		int (*okfn)(struct sk_buff *))
+{
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 1, 0)
+static unsigned int natcap_fastpath_pre_hook(const struct nf_hook_ops *ops,
+		struct sk_buff *skb,
+		const struct net_device *in,
+		const struct net_device *out,
+		int (*okfn)(struct sk_buff *))
+{
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
+static unsigned int natcap_fastpath_pre_hook(const struct nf_hook_ops *ops,
+		struct sk_buff *skb,
+		const struct nf_hook_state *state)
+{
+	const struct net_device *in = state->in;
+#else
+static unsigned int natcap_fastpath_pre_hook(void *priv,
+		struct sk_buff *skb,
+		const struct nf_hook_state *state)
+{
+	const struct net_device *in = state->in;
+#endif
+	int dir;
+	int hlen;
+	unsigned int mtu;
+	__be32 saddr, daddr;
+	__be16 sport, dport;
+	struct iphdr *iph;
+	struct tcphdr *tcph;
+	struct fastpath_tuple *ft;
+	struct fastpath_node *fp;
+	struct nf_conn *ct;
+	const struct nf_conntrack_tuple *t;
+	struct nf_conn_acct *acct;
+	struct net_device *outdev;
+
+	if (disabled || !fastpath_enabled)
+		return NF_ACCEPT;
+
+	iph = ip_hdr(skb);
+	if (iph->protocol != IPPROTO_TCP || (iph->frag_off & __constant_htons(IP_MF | IP_OFFSET))) {
+		return NF_ACCEPT;
+	}
+	if (iph->ttl <= 1 || skb->pkt_type != PACKET_HOST || skb_nfct(skb) != NULL) {
+		return NF_ACCEPT;
+	}
+	if (!pskb_may_pull(skb, iph->ihl * 4 + sizeof(struct tcphdr))) {
+		return NF_ACCEPT;
+	}
+	iph = ip_hdr(skb);
+	tcph = (struct tcphdr *)((void *)iph + iph->ihl * 4);
+
+	rcu_read_lock();
+	ft = fastpath_find(iph->saddr, iph->daddr, tcph->source, tcph->dest);
+	if (ft == NULL) {
+		rcu_read_unlock();
+		return NF_ACCEPT;
+	}
+	fp = fastpath_tuple_node(ft);
+	dir = ft->dir;
+	if (fp->state != FASTPATH_READY) {
+		rcu_read_unlock();
+		return NF_ACCEPT;
+	}
+	smp_rmb();
+	ct = fp->ct;
+	if (nf_ct_is_dying(ct) || fp->indev[dir] != in) {
+		rcu_read_unlock();
+		return NF_ACCEPT;
+	}
+	if (tcph->syn || tcph->fin || tcph->rst) {
+		if (tcph->fin || tcph->rst) {
+			spin_lock_bh(&fastpath_lock);
+			fastpath_node_del(fp);
+			spin_unlock_bh(&fastpath_lock);
+		}
+		rcu_read_unlock();
+		return NF_ACCEPT;
+	}
+	/* the speed limit was turned on after the flow got ready */
+	if (natcap_tx_speed_get() != 0 || natcap_rx_speed_get() != 0) {
+		struct natcap_session *ns = natcap_session_get(ct);
+		if (ns == NULL || !(NS_NATCAP_NOLIMIT & ns->n.status)) {
+			rcu_read_unlock();
+			return NF_ACCEPT;
+		}
+	}
+
+	hlen = iph->ihl * 4 + tcph->doff * 4;
+	outdev = fp->outdev[dir];
+	mtu = outdev->mtu;
+	if (skb_is_gso(skb)) {
+		if (skb_shinfo(skb)->gso_size + hlen > mtu) {
+			rcu_read_unlock();
+			return NF_ACCEPT;
+		}
+	} else if (skb->len > mtu) {
+		rcu_read_unlock();
+		return NF_ACCEPT;
+	}
+
+	if (!skb_make_writable(skb, fp->enc ? skb->len : hlen) || skb_cow_head(skb, ETH_HLEN)) {
+		rcu_read_unlock();
+		return NF_ACCEPT;
+	}
+	iph = ip_hdr(skb);
+	tcph = (struct tcphdr *)((void *)iph + iph->ihl * 4);
+
+	/* the server may still send its option on the reply, let the slow path strip it */
+	if (dir == IP_CT_DIR_REPLY && natcap_tcp_decode_header(tcph) != NULL) {
+		rcu_read_unlock();
+		return NF_ACCEPT;
+	}
+
+	t = &ct->tuplehash[!dir].tuple;
+	saddr = t->dst.u3.ip;
+	daddr = t->src.u3.ip;
+	sport = t->dst.u.tcp.port;
+	dport = t->src.u.tcp.port;
+
+	ip_decrease_ttl(iph);
+	if (fp->enc) {
+		iph->saddr = saddr;
+		iph->daddr = daddr;
+		tcph->source = sport;
+		tcph->dest = dport;
+		skb_data_hook(skb, hlen, skb->len - hlen, dir == IP_CT_DIR_ORIGINAL ? natcap_data_encode : natcap_data_decode);
+		skb_rcsum_tcpudp(skb);
+	} else {
+		if (iph->saddr != saddr) {
+			csum_replace4(&iph->check, iph->saddr, saddr);
+			inet_proto_csum_replace4(&tcph->check, skb, iph->saddr, saddr, true);
+			iph->saddr = saddr;
+		}
+		if (iph->daddr != daddr) {
+			csum_replace4(&iph->check, iph->daddr, daddr);
+			inet_proto_csum_replace4(&tcph->check, skb, iph->daddr, daddr, true);
+			iph->daddr = daddr;
+		}
+		if (tcph->source != sport) {
+			inet_proto_csum_replace2(&tcph->check, skb, tcph->source, sport, false);
+			tcph->source = sport;
+		}
+		if (tcph->dest != dport) {
+			inet_proto_csum_replace2(&tcph->check, skb, tcph->dest, dport, false);
+			tcph->dest = dport;
+		}
+	}
+
+	acct = nf_conn_acct_find(ct);
+	if (acct) {
+		struct nf_conn_counter *counter = acct->counter;
+		atomic64_inc(&counter[dir].packets);
+		atomic64_add(skb->len, &counter[dir].bytes);
+	}
+	if (dir == IP_CT_DIR_ORIGINAL) {
+		flow_total_tx_bytes += skb->len;
+	} else {
+		flow_total_rx_bytes += skb->len;
+	}
+	fastpath_ct_touch(ct, fp->span);
+	if (fp->active != jiffies)
+		fp->active = jiffies;
+	fastpath_hits++;
+
+	xt_mark_natcap_set(XT_MARK_NATCAP, &skb->mark);
+	skb_push(skb, ETH_HLEN);
+	skb_reset_mac_header(skb);
+	memcpy(skb_mac_header(skb), fp->l2_head[dir], ETH_HLEN);
+	skb->protocol = __constant_htons(ETH_P_IP);
+	skb->dev = outdev;
+	rcu_read_unlock();
+
+	dev_queue_xmit(skb);
+	return NF_STOLEN;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+static void fastpath_gc(unsigned long ignore)
+#else
+static void fastpath_gc(struct timer_list *ignore)
+#endif
+{
+	static unsigned int gc_idx = 0;
+	unsigned int i;
+	struct fastpath_tuple *ft;
+	struct fastpath_node *fp;
+	struct hlist_node *n;
+
+	spin_lock_bh(&fastpath_lock);
+	for (i = 0; i < FASTPATH_GC_STEP; i++) {
+		gc_idx = (gc_idx + 1) % FASTPATH_HASH_SIZE;
+		hlist_for_each_entry_safe(ft, n, &fastpath_hash[gc_idx], hnode) {
+			fp = fastpath_tuple_node(ft);
+			if (nf_ct_is_dying(fp->ct) ||
+					time_after_eq(jiffies, fp->active + FASTPATH_IDLE_TIMEOUT) ||
+					(fp->state == FASTPATH_READY && time_after_eq(jiffies, fp->ready_jiffies + FASTPATH_RELEARN_TIMEOUT))) {
+				fastpath_node_del(fp);
+			}
+		}
+	}
+	spin_unlock_bh(&fastpath_lock);
+
+	if (fastpath_gc_stop) {
+		return;
+	}
+	mod_timer(&fastpath_gc_timer, jiffies + HZ);
+}
+
+static int fastpath_netdev_event(struct notifier_block *this, unsigned long event, void *ptr)
+{
+	struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+
+	if (event != NETDEV_UNREGISTER && event != NETDEV_DOWN && event != NETDEV_CHANGEADDR)
+		return NOTIFY_DONE;
+
+	natcap_fastpath_cleanup();
+
+	NATCAP_DEBUG("flush fastpath on event=%lu for dev=%s\n", event, dev ? dev->name : "(null)");
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block fastpath_netdev_notifier = {
+	.notifier_call  = fastpath_netdev_event,
+};
+
+static struct nf_hook_ops fastpath_hooks[] = {
+	{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
+		.owner = THIS_MODULE,
+#endif
+		.hook = natcap_fastpath_pre_hook,
+		.pf = PF_INET,
+		.hooknum = NF_INET_PRE_ROUTING,
+		.priority = NF_IP_PRI_CONNTRACK - 10,
+	},
+	{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 4, 0)
+		.owner = THIS_MODULE,
+#endif
+		.hook = natcap_fastpath_post_hook,
+		.pf = PF_INET,
+		.hooknum = NF_INET_POST_ROUTING,
+		.priority = NF_IP_PRI_LAST,
+	},
+};
+
+int natcap_fastpath_init(void)
+{
+	int i;
+	int ret = 0;
+
+	get_random_bytes(&fastpath_rnd, sizeof(fastpath_rnd));
+	for (i = 0; i < FASTPATH_HASH_SIZE; i++) {
+		INIT_HLIST_HEAD(&fastpath_hash[i]);
+	}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+	init_timer(&fastpath_gc_timer);
+	fastpath_gc_timer.data = 0;
+	fastpath_gc_timer.function = fastpath_gc;
+#else
+	timer_setup(&fastpath_gc_timer, fastpath_gc, 0);
+#endif
+	fastpath_gc_stop = 0;
+	mod_timer(&fastpath_gc_timer, jiffies + HZ);
+
+	ret = register_netdevice_notifier(&fastpath_netdev_notifier);
+	if (ret != 0) {
+		goto notifier_failed;
+	}
+
+	ret = nf_register_hooks(fastpath_hooks, ARRAY_SIZE(fastpath_hooks));
+	if (ret != 0) {
+		goto hooks_failed;
+	}
+	return 0;
+
+hooks_failed:
+	unregister_netdevice_notifier(&fastpath_netdev_notifier);
+notifier_failed:
+	fastpath_gc_stop = 1;
+	del_timer_sync(&fastpath_gc_timer);
+	return ret;
+}
+
+void natcap_fastpath_exit(void)
+{
+	nf_unregister_hooks(fastpath_hooks, ARRAY_SIZE(fastpath_hooks));
+	unregister_netdevice_notifier(&fastpath_netdev_notifier);
+
+	fastpath_gc_stop = 1;
+	del_timer_sync(&fastpath_gc_timer);
+	natcap_fastpath_cleanup();
+	rcu_barrier();
+}
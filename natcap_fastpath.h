@@ -0,0 +1,39 @@
+/*
+ * Author: natcap contributors
+ *  Date : Sun, 18 Oct 2026 17:39:58 +0000
+ *
+ * This file is part of the natcap.
+ *
+ * natcap is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * natcap is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with natcap; see the file COPYING. If not, see
+ * <http://www.gnu.org/licenses/>.
+ */
+#ifndef _NATCAP_FASTPATH_H_
+#define _NATCAP_FASTPATH_H_
+
+#include <linux/types.h>
+#include "natcap.h"
+
+extern unsigned int fastpath_enabled;
+extern unsigned int fastpath_max;
+
+extern unsigned long fastpath_hits;
+extern unsigned int fastpath_entries(void);
+
+/* drop all offloaded flows, they go back to the slow path */
+extern void natcap_fastpath_cleanup(void);
+
+int natcap_fastpath_init(void);
+void natcap_fastpath_exit(void);
+
+#endif /* _NATCAP_FASTPATH_H_ */
@@ -55,6 +55,8 @@
 #include "natcap_forward.h"
 #include "natcap_knock.h"
 #include "natcap_peer.h"
+#include "natcap_dns.h"
+#include "natcap_fastpath.h"
 
 static int natcap_major = 0;
 static int natcap_minor = 0;
@@ -100,6 +102,11 @@ static void *natcap_start(struct seq_file *m, loff_t *pos)
 				"#    natcap_redirect_port=%u\n"
 				"#    natcap_client_redirect_port=%u\n"
 				"#    natcap_touch_timeout=%u\n"
+				"#    cone_nat_timeout=%u\n"
+				"#    cone_nat_tcp=%u\n"
+				"#    dns_cache=%u mem=%u/%u entries=%u hits=%lu misses=%lu prefetches=%lu\n"
+				"#    dns_route_domains=%u dns_route_entries=%u/%u\n"
+				"#    fastpath=%u entries=%u/%u hits=%lu\n"
 				"#    flow_total_tx_bytes=%llu\n"
 				"#    flow_total_rx_bytes=%llu\n"
 				"#    auth_http_redirect_url=%s\n"
@@ -129,6 +136,11 @@ static void *natcap_start(struct seq_file *m, loff_t *pos)
 				rx_pkts_threshold,
 				http_confusion, encode_http_only, sproxy, ntohs(knock_port),
 				ntohs(natcap_redirect_port), ntohs(natcap_client_redirect_port), natcap_touch_timeout,
+				cone_nat_timeout, cone_nat_tcp,
+				dns_cache_enabled, dns_cache_mem_used(), dns_cache_mem_limit, dns_cache_entries(),
+				dns_cache_hits, dns_cache_misses, dns_cache_prefetches,
+				dns_domain_entries(), dns_route_entries(), dns_route_max,
+				fastpath_enabled, fastpath_entries(), fastpath_max, fastpath_hits,
 				flow_total_tx_bytes, flow_total_rx_bytes,
 				auth_http_redirect_url,
 				htp_confusion_host,
@@ -457,6 +469,94 @@ static ssize_t natcap_write(struct file *file, const char __user *buf, size_t bu
 				goto done;
 			}
 		}
+	} else if (strncmp(data, "dns_cache=", 10) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			unsigned int d;
+			n = sscanf(data, "dns_cache=%u", &d);
+			if (n == 1) {
+				dns_cache_enabled = !!d;
+				if (!dns_cache_enabled) {
+					natcap_dns_cache_cleanup();
+				}
+				goto done;
+			}
+		}
+	} else if (strncmp(data, "dns_cache_mem=", 14) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			unsigned int d;
+			n = sscanf(data, "dns_cache_mem=%u", &d);
+			if (n == 1) {
+				dns_cache_mem_limit = d;
+				goto done;
+			}
+		}
+	} else if (strncmp(data, "dns_cache_clean", 15) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			natcap_dns_cache_cleanup();
+			goto done;
+		}
+	} else if (strncmp(data, "dns_route_domain=", 17) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			if ((err = natcap_dns_domain_add(data + 17)) == 0) {
+				goto done;
+			}
+			NATCAP_println("natcap_dns_domain_add() failed ret=%d", err);
+		}
+	} else if (strncmp(data, "dns_route_domain_clean", 22) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			natcap_dns_domain_cleanup();
+			natcap_dns_route_cleanup();
+			goto done;
+		}
+	} else if (strncmp(data, "dns_route_max=", 14) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			unsigned int d;
+			n = sscanf(data, "dns_route_max=%u", &d);
+			if (n == 1) {
+				dns_route_max = d;
+				goto done;
+			}
+		}
+	} else if (strncmp(data, "fastpath=", 9) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			unsigned int d;
+			n = sscanf(data, "fastpath=%u", &d);
+			if (n == 1) {
+				fastpath_enabled = !!d;
+				if (!fastpath_enabled) {
+					natcap_fastpath_cleanup();
+				}
+				goto done;
+			}
+		}
+	} else if (strncmp(data, "fastpath_max=", 13) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			unsigned int d;
+			n = sscanf(data, "fastpath_max=%u", &d);
+			if (n == 1) {
+				fastpath_max = d;
+				goto done;
+			}
+		}
+	} else if (strncmp(data, "fastpath_clean", 14) == 0) {
+		if (mode == CLIENT_MODE || mode == MIXING_MODE) {
+			natcap_fastpath_cleanup();
+			goto done;
+		}
+	} else if (strncmp(data, "cone_nat_timeout=", 17) == 0) {
+		unsigned int d;
+		n = sscanf(data, "cone_nat_timeout=%u", &d);
+		if (n == 1 && d > 0) {
+			cone_nat_timeout = d;
+			goto done;
+		}
+	} else if (strncmp(data, "cone_nat_tcp=", 13) == 0) {
+		unsigned int d;
+		n = sscanf(data, "cone_nat_tcp=%u", &d);
+		if (n == 1) {
+			cone_nat_tcp = !!d;
+			goto done;
+		}
 	} else if (strncmp(data, "natcap_touch_timeout=", 21) == 0) {
 		unsigned int d;
 		n = sscanf(data, "natcap_touch_timeout=%u", &d);
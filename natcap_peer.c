@@ -21,18 +21,24 @@
 #include <linux/ctype.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
+#include <linux/hash.h>
+#include <linux/hrtimer.h>
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
 #include <linux/if_arp.h>
 #include <linux/init.h>
+#include <linux/interrupt.h>
 #include <linux/ip.h>
+#include <linux/jhash.h>
 #include <linux/kernel.h>
 #include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/netdevice.h>
 #include <linux/inetdevice.h>
 #include <linux/netfilter.h>
+#include <linux/rculist.h>
 #include <linux/skbuff.h>
+#include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/tcp.h>
 #include <linux/udp.h>
@@ -49,123 +55,201 @@
 #include "natcap_client.h"
 #include "natcap_knock.h"
 
+/* skbs held while the peer handshake of their ct completes,
+ * hashed by ct and bounded by the truesize of the held skbs
+ */
 struct peer_cache_node {
-	struct nf_conn *user;
-	struct sk_buff *skb;
+	struct list_head list;
+	struct nf_conn *user; //NULL for a peer_hello
+	struct sk_buff *skb; //chained by skb->next in seq order
+	unsigned int truesize;
 	unsigned long jiffies;
 };
 
-DEFINE_SPINLOCK(peer_cache_lock);
-#define MAX_PEER_CACHE 64
-static unsigned short peer_cache_next_to_clean = 0;
-static unsigned short peer_cache_next_to_use = 0;
-static struct peer_cache_node peer_cache[MAX_PEER_CACHE];
+struct peer_cache_bucket {
+	spinlock_t lock;
+	struct list_head head; //in attach order
+};
+
+#define PEER_CACHE_HASH_BITS 8
+#define PEER_CACHE_HASH_SIZE (1 << PEER_CACHE_HASH_BITS)
+static struct peer_cache_bucket peer_cache[PEER_CACHE_HASH_SIZE];
 #define PEER_CACHE_TIMEOUT 4
 
+#define PEER_CACHE_MEM_LIMIT_DEFAULT (4 * 1024 * 1024)
+unsigned int peer_cache_mem_limit = PEER_CACHE_MEM_LIMIT_DEFAULT;
+static atomic_t peer_cache_mem = ATOMIC_INIT(0);
+static atomic_t peer_cache_entries = ATOMIC_INIT(0);
+static atomic_long_t peer_cache_drops = ATOMIC_LONG_INIT(0);
+static atomic_long_t peer_cache_expired = ATOMIC_LONG_INIT(0);
+
+static inline struct peer_cache_bucket *peer_cache_bucket(const struct nf_conn *ct)
+{
+	return &peer_cache[hash_ptr((void *)ct, PEER_CACHE_HASH_BITS)];
+}
+
 static inline void peer_cache_init(void)
 {
-	spin_lock_bh(&peer_cache_lock);
-	memset(peer_cache, 0, sizeof(struct peer_cache_node) * MAX_PEER_CACHE);
-	spin_unlock_bh(&peer_cache_lock);
+	int i;
+
+	for (i = 0; i < PEER_CACHE_HASH_SIZE; i++) {
+		spin_lock_init(&peer_cache[i].lock);
+		INIT_LIST_HEAD(&peer_cache[i].head);
+	}
+}
+
+static inline void peer_cache_skb_free(struct sk_buff *skb)
+{
+	struct sk_buff *next;
+
+	while (skb != NULL) {
+		next = skb->next;
+		skb->next = NULL;
+		consume_skb(skb);
+		skb = next;
+	}
+}
+
+static inline void peer_cache_node_free(struct peer_cache_node *pc)
+{
+	atomic_sub(pc->truesize, &peer_cache_mem);
+	atomic_dec(&peer_cache_entries);
+	if (pc->user != NULL) {
+		nf_ct_put(pc->user);
+	}
+	peer_cache_skb_free(pc->skb);
+	kfree(pc);
 }
 
 static inline int peer_cache_attach(struct nf_conn *ct, struct sk_buff *skb)
 {
+	struct peer_cache_node *pc;
+	struct peer_cache_bucket *pb;
+	struct sk_buff *n;
+	unsigned int truesize = 0;
 	struct natcap_session *ns = natcap_session_get(ct);
-	//XXX we use p.cache_index - 1 as index
+	//XXX p.cache_index != 0 means ct has a node in peer_cache
 	if (ns == NULL || ns->p.cache_index != 0) {
 		return -1;
 	}
-	spin_lock_bh(&peer_cache_lock);
-	if (peer_cache[peer_cache_next_to_use].user != NULL) {
-		spin_unlock_bh(&peer_cache_lock);
+	for (n = skb; n != NULL; n = n->next) {
+		truesize += n->truesize;
+	}
+	if ((unsigned int)atomic_add_return(truesize, &peer_cache_mem) > peer_cache_mem_limit) {
+		atomic_sub(truesize, &peer_cache_mem);
+		atomic_long_inc(&peer_cache_drops);
+		return -1;
+	}
+	pc = kmalloc(sizeof(struct peer_cache_node), GFP_ATOMIC);
+	if (pc == NULL) {
+		atomic_sub(truesize, &peer_cache_mem);
+		atomic_long_inc(&peer_cache_drops);
+		return -1;
+	}
+	pc->user = ct;
+	pc->skb = skb;
+	pc->truesize = truesize;
+	pc->jiffies = jiffies;
+
+	pb = peer_cache_bucket(ct);
+	spin_lock_bh(&pb->lock);
+	//re-check-in-lock
+	if (ns->p.cache_index != 0) {
+		spin_unlock_bh(&pb->lock);
+		atomic_sub(pc->truesize, &peer_cache_mem);
+		kfree(pc);
 		return -1;
 	}
 	nf_conntrack_get(&ct->ct_general);
-	peer_cache[peer_cache_next_to_use].jiffies = jiffies;
-	peer_cache[peer_cache_next_to_use].user = ct;
-	peer_cache[peer_cache_next_to_use].skb = skb;
-	ns->p.cache_index = peer_cache_next_to_use + 1;
-	peer_cache_next_to_use = (peer_cache_next_to_use + 1) % MAX_PEER_CACHE;
-	spin_unlock_bh(&peer_cache_lock);
+	list_add_tail(&pc->list, &pb->head);
+	ns->p.cache_index = 1;
+	spin_unlock_bh(&pb->lock);
+	atomic_inc(&peer_cache_entries);
 	return 0;
 }
 
 static inline struct sk_buff *peer_cache_detach(struct nf_conn *ct)
 {
-	unsigned short i;
 	struct sk_buff *skb = NULL;
+	struct peer_cache_node *pc, *found = NULL;
+	struct peer_cache_bucket *pb;
 	struct natcap_session *ns = natcap_session_get(ct);
 
-	if (ns == NULL)
+	if (ns == NULL || ns->p.cache_index == 0)
 		return NULL;
-	i = ns->p.cache_index;
-	if (i == 0 || i > MAX_PEER_CACHE)
-		return NULL;
-	i = i - 1;
-	spin_lock_bh(&peer_cache_lock);
-	if (peer_cache[i].user == ct) {
-		ns->p.cache_index = 0;
-		nf_ct_put(peer_cache[i].user);
-		peer_cache[i].user = NULL;
-		if (peer_cache[i].skb != NULL) {
-			skb = peer_cache[i].skb;
-			peer_cache[i].skb = NULL;
-		}
-	}
-	spin_unlock_bh(&peer_cache_lock);
+
+	pb = peer_cache_bucket(ct);
+	spin_lock_bh(&pb->lock);
+	list_for_each_entry(pc, &pb->head, list) {
+		if (pc->user == ct) {
+			list_del(&pc->list);
+			ns->p.cache_index = 0;
+			found = pc;
+			break;
+		}
+	}
+	spin_unlock_bh(&pb->lock);
+
+	if (found != NULL) {
+		skb = found->skb;
+		found->skb = NULL;
+		peer_cache_node_free(found);
+	}
 	return skb;
 }
 
 static inline void peer_cache_cleaner(void)
 {
-	unsigned short i;
+	int i;
+	LIST_HEAD(expired);
 	struct natcap_session *ns;
-	if (peer_cache[peer_cache_next_to_clean].user != NULL &&
-			!time_after(jiffies, peer_cache[peer_cache_next_to_clean].jiffies + PEER_CACHE_TIMEOUT * HZ))
-		return;
-	spin_lock_bh(&peer_cache_lock);
-	i = peer_cache_next_to_clean;
-	while (i != peer_cache_next_to_use) {
-		if (peer_cache[i].user == NULL) {
-			i = (i + 1) % MAX_PEER_CACHE;
+	struct peer_cache_node *pc, *n;
+	struct peer_cache_bucket *pb;
+
+	for (i = 0; i < PEER_CACHE_HASH_SIZE; i++) {
+		pb = &peer_cache[i];
+		if (list_empty(&pb->head))
 			continue;
+		spin_lock_bh(&pb->lock);
+		list_for_each_entry_safe(pc, n, &pb->head, list) {
+			if (!time_after(jiffies, pc->jiffies + PEER_CACHE_TIMEOUT * HZ))
+				break;
+			ns = pc->user ? natcap_session_get(pc->user) : NULL;
+			if (ns != NULL) {
+				ns->p.cache_index = 0;
+			}
+			list_move_tail(&pc->list, &expired);
 		}
-		if (!time_after(jiffies, peer_cache[i].jiffies + PEER_CACHE_TIMEOUT * HZ))
-			break;
-		ns = natcap_session_get(peer_cache[i].user);
-		ns->p.cache_index = 0;
-		nf_ct_put(peer_cache[i].user);
-		peer_cache[i].user = NULL;
-		if (peer_cache[i].skb != NULL) {
-			consume_skb(peer_cache[i].skb);
-			peer_cache[i].skb = NULL;
-		}
-		i = (i + 1) % MAX_PEER_CACHE;
+		spin_unlock_bh(&pb->lock);
+	}
+
+	list_for_each_entry_safe(pc, n, &expired, list) {
+		list_del(&pc->list);
+		peer_cache_node_free(pc);
+		atomic_long_inc(&peer_cache_expired);
 	}
-	peer_cache_next_to_clean = i;
-	spin_unlock_bh(&peer_cache_lock);
 }
 
 static inline void peer_cache_cleanup(void)
 {
-	unsigned short i;
+	int i;
 	struct natcap_session *ns;
-	spin_lock_bh(&peer_cache_lock);
-	for (i = 0; i < MAX_PEER_CACHE; i++) {
-		if (peer_cache[i].user == NULL)
-			continue;
-		ns = natcap_session_get(peer_cache[i].user);
-		//BUG_ON(ns == NULL);
-		ns->p.cache_index = 0;
-		nf_ct_put(peer_cache[i].user);
-		peer_cache[i].user = NULL;
-		if (peer_cache[i].skb != NULL) {
-			consume_skb(peer_cache[i].skb);
-			peer_cache[i].skb = NULL;
+	struct peer_cache_node *pc, *n;
+	struct peer_cache_bucket *pb;
+
+	for (i = 0; i < PEER_CACHE_HASH_SIZE; i++) {
+		pb = &peer_cache[i];
+		spin_lock_bh(&pb->lock);
+		list_for_each_entry_safe(pc, n, &pb->head, list) {
+			ns = pc->user ? natcap_session_get(pc->user) : NULL;
+			if (ns != NULL) {
+				ns->p.cache_index = 0;
+			}
+			list_del(&pc->list);
+			peer_cache_node_free(pc);
 		}
+		spin_unlock_bh(&pb->lock);
 	}
-	spin_unlock_bh(&peer_cache_lock);
 }
 
 static int peer_stop = 1;
@@ -248,8 +332,33 @@ static __be16 peer_local_port = __constant_htons(443);
 
 #define ICMP_PAYLOAD_LIMIT 1024
 
-#define MAX_PEER_SERVER 8
-struct peer_server_node peer_server[MAX_PEER_SERVER];
+#define MAX_PEER_SERVER 256
+#define PEER_SERVER_HASH_SIZE 64
+static struct hlist_head peer_server_hash[PEER_SERVER_HASH_SIZE];
+static DEFINE_SPINLOCK(peer_server_lock);
+static unsigned int peer_server_count = 0;
+static unsigned int peer_server_rnd __read_mostly;
+
+/* seconds of new connections the idle conns of a server should absorb */
+#define PEER_POOL_HEADROOM 2
+
+static inline unsigned int peer_server_hashfn(__be32 ip)
+{
+	return jhash_1word((__force u32)ip, peer_server_rnd) % PEER_SERVER_HASH_SIZE;
+}
+
+/* called with rcu_read_lock held */
+static struct peer_server_node *peer_server_node_find(__be32 ip)
+{
+	struct peer_server_node *ps;
+
+	hlist_for_each_entry_rcu(ps, &peer_server_hash[peer_server_hashfn(ip)], hnode) {
+		if (ps->ip == ip) {
+			return ps;
+		}
+	}
+	return NULL;
+}
 
 static inline __be16 peer_fakeuser_sport(struct nf_conn *user)
 {
@@ -265,8 +374,8 @@ static inline __be16 peer_fakeuser_dport(struct nf_conn *user)
 }
 
 #define MAX_PEER_PORT_MAP 65536
-static struct nf_conn **peer_port_map = NULL;
-DEFINE_SPINLOCK(peer_port_map_lock);
+/* slots are claimed and released with cmpxchg, readers use rcu */
+static struct nf_conn __rcu **peer_port_map = NULL;
 static struct timer_list peer_timer;
 
 #define NATCAP_PEER_EXPECT_TIMEOUT 5
@@ -277,108 +386,118 @@ unsigned int peer_port_map_timeout = NATCAP_PEER_USER_TIMEOUT_DEFAULT;
 #define NATCAP_PEER_CONN_TIMEOUT_DEFAULT 180
 unsigned int peer_conn_timeout = NATCAP_PEER_CONN_TIMEOUT_DEFAULT;
 
-#define PEER_PORT_MAP_FLUSH_STEP 256
+/* the peer_tuple slots of a user are an open-addressed table sized when the user is created,
+ * a tuple lives in the PEER_TUPLE_PROBE slots from its hash so a lookup never scans more
+ */
+#define PEER_TUPLE_PROBE 8
+#define PEER_USER_TUPLES_DEFAULT 32
+#define PEER_USER_TUPLES_MAX 256
+unsigned int peer_user_tuples = PEER_USER_TUPLES_DEFAULT;
+static unsigned int peer_tuple_rnd __read_mostly;
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
-static void peer_timer_flush(unsigned long ignore)
-#else
-static void peer_timer_flush(struct timer_list *ignore)
-#endif
+static inline unsigned int peer_tuple_hash(__be32 sip, __be32 dip, __be16 sport, __be16 dport)
 {
-	static unsigned short flush_idx = 0;
-	int i, j = 0;
-	struct nf_conn *user;
-	for (i = 0; i < PEER_PORT_MAP_FLUSH_STEP; i++) {
-		if (peer_port_map[flush_idx] == NULL) {
-			flush_idx++;
-			continue;
-		}
-		spin_lock_bh(&peer_port_map_lock);
-		user = peer_port_map[flush_idx];
-		if (user != NULL) {
-			unsigned char client_mac[ETH_ALEN];
-			struct user_expect *ue = peer_user_expect(user);
-			if (after(jiffies, ue->last_active + peer_port_map_timeout * HZ)) {
-				set_byte4(client_mac, get_byte4((void *)&user->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip));
-				set_byte2(client_mac + 4, get_byte2((void *)&user->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.all));
-				NATCAP_INFO(DEBUG_FMT_PREFIX "C[%02X:%02X:%02X:%02X:%02X:%02X,%pI4,%pI4] P=%u [AS %ds] timeout drop\n", DEBUG_ARG_PREFIX,
-						client_mac[0], client_mac[1], client_mac[2], client_mac[3], client_mac[4], client_mac[5],
-						&ue->local_ip, &ue->ip, ntohs(ue->map_port), ue->last_active != 0 ? (uintdiff(ue->last_active, jiffies) + HZ / 2) / HZ : (-1)
-						);
-				peer_port_map[flush_idx] = NULL;
-				nf_ct_put(user);
-				j++;
-			}
-		}
-		spin_unlock_bh(&peer_port_map_lock);
-		flush_idx++;
-	}
+	return jhash_3words(sip, dip, ((__force u32)sport << 16) | (__force u32)dport, peer_tuple_rnd);
+}
 
-	for (i = 0; i < MAX_PEER_SERVER; i++) {
-		struct peer_server_node *ps = &peer_server[i];
-		spin_lock_bh(&ps->lock);
-		for (j = 0; j < MAX_PEER_CONN; j++) {
-			user = ps->port_map[j];
-			if (user != NULL) {
-				struct fakeuser_expect *fue = peer_fakeuser_expect(user);
-				if (after(jiffies, fue->last_active + peer_conn_timeout * HZ)) {
-					NATCAP_INFO(DEBUG_FMT_PREFIX "conn[%u:%u] @N[[%pI4:%u] [AS %ds] timeout drop\n", DEBUG_ARG_PREFIX,
-							ntohs(peer_fakeuser_sport(user)), ntohs(peer_fakeuser_dport(user)),
-							&ps->ip, ntohs(ps->map_port), fue->last_active != 0 ?(uintdiff(fue->last_active, jiffies) + HZ / 2) / HZ : (-1)
-							);
-					peer_server[i].port_map[j] = NULL;
-					nf_ct_put(user);
-				}
-			}
+/* the connected tuple of ue active last within peer_port_map_timeout, called without ue->lock */
+static struct peer_tuple *peer_user_tuple_pick(struct user_expect *ue)
+{
+	unsigned int i;
+	unsigned long mindiff = peer_port_map_timeout * HZ;
+	struct peer_tuple *pt = NULL;
+
+	for (i = 0; i <= ue->tuple_mask; i++) {
+		if (ue->tuple[i].connected && ue->tuple[i].sip != 0 && mindiff > uintdiff(jiffies, ue->tuple[i].last_active)) {
+			pt = &ue->tuple[i];
+			mindiff = uintdiff(jiffies, ue->tuple[i].last_active);
 		}
-		spin_unlock_bh(&ps->lock);
 	}
+	return pt;
+}
 
-	peer_cache_cleaner();
+/* a lazy expiry wheel for the users in peer_port_map and the conns in peer_server_node:
+ * each node holds a ref of its user and is checked when its bucket comes round,
+ * touching a user only updates last_active, a node still active is queued again
+ */
+struct peer_expire_node {
+	struct list_head list;
+	struct nf_conn *user;
+#define PEER_EXPIRE_USER 0
+#define PEER_EXPIRE_CONN 1
+	int type;
+	__be32 ip; //server ip of a conn
+};
 
-	if (peer_stop) {
-		return;
+#define PEER_WHEEL_SIZE 1024
+#define PEER_WHEEL_TICK (HZ / 4 ? HZ / 4 : 1)
+static struct list_head peer_wheel[PEER_WHEEL_SIZE];
+static DEFINE_SPINLOCK(peer_wheel_lock);
+static unsigned int peer_wheel_idx = 0;
+static unsigned long peer_wheel_clock = 0;
+
+static void peer_expire_queue(struct peer_expire_node *pe, unsigned long expires)
+{
+	long ticks;
+
+	spin_lock_bh(&peer_wheel_lock);
+	ticks = (long)(expires - peer_wheel_clock);
+	if (ticks < 0)
+		ticks = 0;
+	ticks = (ticks + PEER_WHEEL_TICK - 1) / PEER_WHEEL_TICK;
+	if (ticks >= PEER_WHEEL_SIZE) {
+		//beyond the wheel, it is queued again when the last bucket comes round
+		ticks = PEER_WHEEL_SIZE - 1;
 	}
-	mod_timer(&peer_timer, jiffies + HZ / 2);
+	list_add_tail(&pe->list, &peer_wheel[(peer_wheel_idx + ticks) % PEER_WHEEL_SIZE]);
+	spin_unlock_bh(&peer_wheel_lock);
 }
 
-static int peer_timer_init(void)
+static int peer_expire_add(struct nf_conn *user, int type, __be32 ip, unsigned long expires)
 {
-	struct timer_list *timer = &peer_timer;
+	struct peer_expire_node *pe;
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
-	init_timer(timer);
-	timer->data = 0;
-	timer->function = peer_timer_flush;
-#else
-	timer_setup(timer, peer_timer_flush, 0);
-#endif
-	return 0;
-}
+	pe = kmalloc(sizeof(struct peer_expire_node), GFP_ATOMIC);
+	if (pe == NULL) {
+		NATCAP_ERROR(DEBUG_FMT_PREFIX "alloc peer_expire_node fail\n", DEBUG_ARG_PREFIX);
+		return -ENOMEM;
+	}
+	nf_conntrack_get(&user->ct_general);
+	pe->user = user;
+	pe->type = type;
+	pe->ip = ip;
+	peer_expire_queue(pe, expires);
 
-static void peer_timer_start(void)
-{
-	struct timer_list *timer = &peer_timer;
-	mod_timer(timer, jiffies + 8 * HZ);
+	return 0;
 }
 
-static void peer_timer_exit(void)
+static inline int peer_user_get_not_zero(struct nf_conn *user)
 {
-	del_timer(&peer_timer);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 11, 0)
+	return atomic_inc_not_zero(&user->ct_general.use);
+#else
+	return refcount_inc_not_zero(&user->ct_general.use);
+#endif
 }
 
 static inline struct nf_conn *get_peer_user(unsigned int port)
 {
 	struct nf_conn *user;
-	if (port >= MAX_PEER_PORT_MAP || peer_port_map[port] == NULL)
+	if (port >= MAX_PEER_PORT_MAP)
 		return NULL;
 
-	spin_lock_bh(&peer_port_map_lock);
-	user = peer_port_map[port];
+	rcu_read_lock();
+	user = rcu_dereference(peer_port_map[port]);
 	if (user) {
-		nf_conntrack_get(&user->ct_general);
+		//the ct slab is SLAB_TYPESAFE_BY_RCU: the ref must be taken on a live ct that is still in the slot
+		if (!peer_user_get_not_zero(user)) {
+			user = NULL;
+		} else if (rcu_access_pointer(peer_port_map[port]) != user) {
+			nf_ct_put(user);
+			user = NULL;
+		}
 	}
-	spin_unlock_bh(&peer_port_map_lock);
+	rcu_read_unlock();
 	return user;
 }
 
@@ -387,366 +506,572 @@ static inline void put_peer_user(struct nf_conn *user)
 	nf_ct_put(user);
 }
 
+/* the slot as a plain pointer for cmpxchg and xchg */
+static inline struct nf_conn **peer_port_slot(unsigned int port)
+{
+	return (__force struct nf_conn **)&peer_port_map[port];
+}
+
+/* drop the slot ref of @user if it still owns @port */
+static inline int release_peer_port(unsigned int port, struct nf_conn *user)
+{
+	if (cmpxchg(peer_port_slot(port), user, NULL) != user)
+		return 0;
+	nf_ct_put(user);
+	return 1;
+}
+
+/* scan PEER_PORT_STRIDE slots (8 cache lines of pointers) at a time, up to PEER_PORT_STRIDE_MAX strides */
+#define PEER_PORT_STRIDE 64
+#define PEER_PORT_STRIDE_MAX 64
+#define PEER_PORT_STRIDE_STEP (17 * PEER_PORT_STRIDE)
+
 static __be16 alloc_peer_port(struct nf_conn *user, const unsigned char *mac)
 {
 	static unsigned int seed_rnd;
-	unsigned short port;
-	unsigned int hash;
+	unsigned int i, j;
+	unsigned int hash, base, port;
 	unsigned int data = get_byte4(mac);
+	const unsigned int range = MAX_PEER_PORT_MAP - 1 - 1024;
 
 	get_random_once(&seed_rnd, sizeof(seed_rnd));
 
 	hash = jhash2(&data, 1, get_byte2(mac + 4)^seed_rnd);
 
-	port = 1024 + hash % (MAX_PEER_PORT_MAP - 1024);
-
-	for (; port < MAX_PEER_PORT_MAP - 1; port++) {
-		if (peer_port_map[port] == NULL) {
-			spin_lock_bh(&peer_port_map_lock);
-			//re-check-in-lock
-			if (peer_port_map[port] == NULL) {
-				peer_port_map[port] = user;
-				nf_conntrack_get(&user->ct_general);
-				spin_unlock_bh(&peer_port_map_lock);
-				return htons(port);
-			}
-			spin_unlock_bh(&peer_port_map_lock);
-		}
-	}
-
-	for (port = 1024; port < 1024 + hash % (MAX_PEER_PORT_MAP - 1024); port++) {
-		if (peer_port_map[port] == NULL) {
-			spin_lock_bh(&peer_port_map_lock);
-			//re-check-in-lock
-			if (peer_port_map[port] == NULL) {
-				peer_port_map[port] = user;
-				nf_conntrack_get(&user->ct_general);
-				spin_unlock_bh(&peer_port_map_lock);
+	//the slot owns a ref, take it before the slot gets visible
+	nf_conntrack_get(&user->ct_general);
+	for (i = 0; i < PEER_PORT_STRIDE_MAX; i++) {
+		base = (hash + i * PEER_PORT_STRIDE_STEP) % range;
+		for (j = 0; j < PEER_PORT_STRIDE; j++) {
+			port = 1024 + (base + j) % range;
+			if (rcu_access_pointer(peer_port_map[port]) == NULL && cmpxchg(peer_port_slot(port), NULL, user) == NULL) {
+				if (peer_expire_add(user, PEER_EXPIRE_USER, 0, jiffies + peer_port_map_timeout * HZ) != 0) {
+					release_peer_port(port, user);
+					return 0;
+				}
 				return htons(port);
 			}
-			spin_unlock_bh(&peer_port_map_lock);
 		}
 	}
+	nf_ct_put(user);
 
 	return 0;
 }
 
-struct peer_server_node *peer_server_node_in(__be32 ip, unsigned short conn, int new)
+/* called with ps->lock held, once a second at most */
+static void peer_server_pool_update(struct peer_server_node *ps)
 {
 	int i;
-	unsigned long maxdiff = 0;
-	unsigned long last_jiffies = jiffies;
-	struct peer_server_node *ps = NULL;
-
-	if (conn <= 0)
-		conn = 1;
+	unsigned int diff, pool, limit, inflight = 0;
+	struct nf_conn *user;
 
-	for (i = 0; i < MAX_PEER_SERVER; i++) {
-		if (peer_server[i].ip == ip) {
-			spin_lock_bh(&peer_server[i].lock);
-			//re-check-in-lock
-			if (peer_server[i].ip == ip) {
-				if (new == 1 && peer_server[i].conn != conn) {
-					peer_server[i].conn = conn;
-				}
-				spin_unlock_bh(&peer_server[i].lock);
-				return &peer_server[i];
-			}
-			spin_unlock_bh(&peer_server[i].lock);
-			break;
+	diff = uintdiff(ps->rate_stamp, jiffies);
+	if (diff < HZ)
+		return;
+	ps->icmp_rate = (ps->icmp_rate * 3 + (unsigned long)ps->icmp_cnt * 16 * HZ / diff) / 4;
+	ps->use_rate = (ps->use_rate * 3 + (unsigned long)ps->use_cnt * 16 * HZ / diff) / 4;
+	ps->icmp_cnt = 0;
+	ps->use_cnt = 0;
+	ps->rate_stamp = jiffies;
+
+	//conns refilled after the server took them and still handshaking
+	for (i = 0; i < ps->pool; i++) {
+		user = ps->port_map[i];
+		if (user != NULL && peer_fakeuser_expect(user)->state != FUE_STATE_CONNECTED) {
+			inflight++;
 		}
 	}
-	if (new == 0)
-		return NULL;
 
-	for (i = 0; i < MAX_PEER_SERVER; i++) {
-		if (peer_server[i].ip == 0) {
-			spin_lock_bh(&peer_server[i].lock);
-			if (peer_server[i].ip == 0) {
-				ps = &peer_server[i];
-				goto init_out;
-			}
-			spin_unlock_bh(&peer_server[i].lock);
-		}
-		if (maxdiff < uintdiff(peer_server[i].last_active, last_jiffies)) {
-			maxdiff = uintdiff(peer_server[i].last_active, last_jiffies);
-			ps = &peer_server[i];
-		}
+	pool = MIN_PEER_CONN + ps->use_rate * PEER_POOL_HEADROOM / 16;
+	if (ps->use_rate != 0 && inflight * 2 > ps->pool && pool < ps->pool * 2) {
+		//the server takes conns faster than the refills complete
+		pool = ps->pool * 2;
+	}
+	//a conn stays alive only if some ping hits it within peer_conn_timeout
+	limit = (unsigned long)ps->icmp_rate * peer_conn_timeout / 16;
+	if (pool > limit)
+		pool = limit;
+	if (pool < MIN_PEER_CONN)
+		pool = MIN_PEER_CONN;
+	if (pool > MAX_PEER_CONN)
+		pool = MAX_PEER_CONN;
+	if (pool < ps->pool) {
+		//shrink slowly
+		pool = (ps->pool + pool) / 2;
 	}
 
-	if (ps) {
-		spin_lock_bh(&ps->lock);
-init_out:
-		if (ps->ip != 0) {
-			NATCAP_WARN(DEBUG_FMT_PREFIX "drop the old server %pI4 map_port=%u replace new=%pI4\n",
-					DEBUG_ARG_PREFIX, &ps->ip, ntohs(ps->map_port), &ip);
+	if (pool != ps->pool) {
+		NATCAP_DEBUG(DEBUG_FMT_PREFIX "N[%pI4:%u] pool %u -> %u icmp=%u/16s use=%u/16s inflight=%u\n", DEBUG_ARG_PREFIX,
+				&ps->ip, ntohs(ps->map_port), ps->pool, pool, ps->icmp_rate, ps->use_rate, inflight);
+		ps->pool = pool;
+	}
+	for (i = ps->pool; i < MAX_PEER_CONN; i++) {
+		if (ps->port_map[i] != NULL) {
+			nf_ct_put(ps->port_map[i]);
+			ps->port_map[i] = NULL;
 		}
-		for (i = 0; i < MAX_PEER_CONN; i++) {
-			if (ps->port_map[i] != NULL) {
-				nf_ct_put(ps->port_map[i]);
-				ps->port_map[i] = NULL;
+	}
+}
+
+static void peer_expire_fire(struct peer_expire_node *pe)
+{
+	struct nf_conn *user = pe->user;
+	unsigned int expires;
+
+	if (pe->type == PEER_EXPIRE_USER) {
+		struct user_expect *ue = peer_user_expect(user);
+		unsigned int port = ntohs(ue->map_port);
+		if (rcu_access_pointer(peer_port_map[port]) == user) {
+			expires = ue->last_active + peer_port_map_timeout * HZ;
+			if (before(jiffies, expires)) {
+				peer_expire_queue(pe, jiffies + (expires - (unsigned int)jiffies));
+				return;
+			}
+			if (release_peer_port(port, user)) {
+				unsigned char client_mac[ETH_ALEN];
+				set_byte4(client_mac, get_byte4((void *)&user->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip));
+				set_byte2(client_mac + 4, get_byte2((void *)&user->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.all));
+				NATCAP_INFO(DEBUG_FMT_PREFIX "C[%02X:%02X:%02X:%02X:%02X:%02X,%pI4,%pI4] P=%u [AS %ds] timeout drop\n", DEBUG_ARG_PREFIX,
+						client_mac[0], client_mac[1], client_mac[2], client_mac[3], client_mac[4], client_mac[5],
+						&ue->local_ip, &ue->ip, ntohs(ue->map_port), ue->last_active != 0 ? (uintdiff(ue->last_active, jiffies) + HZ / 2) / HZ : (-1)
+						);
 			}
 		}
-		ps->ip = ip;
-		ps->map_port = 0;
-		ps->conn = conn;
-		ps->last_active = 0;
-		ps->last_inuse = 0;
+	} else {
+		struct fakeuser_expect *fue = peer_fakeuser_expect(user);
+		struct peer_server_node *ps;
 
-		spin_unlock_bh(&ps->lock);
+		rcu_read_lock();
+		ps = peer_server_node_find(pe->ip);
+		if (ps != NULL) {
+			spin_lock_bh(&ps->lock);
+			if (fue->pmi < MAX_PEER_CONN && ps->port_map[fue->pmi] == user) {
+				expires = fue->last_active + peer_conn_timeout * HZ;
+				if (before(jiffies, expires)) {
+					peer_expire_queue(pe, jiffies + (expires - (unsigned int)jiffies));
+					spin_unlock_bh(&ps->lock);
+					rcu_read_unlock();
+					return;
+				}
+				NATCAP_INFO(DEBUG_FMT_PREFIX "conn[%u:%u] @N[[%pI4:%u] [AS %ds] timeout drop\n", DEBUG_ARG_PREFIX,
+						ntohs(peer_fakeuser_sport(user)), ntohs(peer_fakeuser_dport(user)),
+						&ps->ip, ntohs(ps->map_port), fue->last_active != 0 ?(uintdiff(fue->last_active, jiffies) + HZ / 2) / HZ : (-1)
+						);
+				ps->port_map[fue->pmi] = NULL;
+				nf_ct_put(user);
+			}
+			spin_unlock_bh(&ps->lock);
+		}
+		rcu_read_unlock();
 	}
 
-	return ps;
+	nf_ct_put(user);
+	kfree(pe);
 }
 
-static struct sk_buff *peer_user_uskbs[NR_CPUS];
-#define PEER_USKB_SIZE (sizeof(struct iphdr) + sizeof(struct udphdr))
-#define PEER_FAKEUSER_DADDR __constant_htonl(0x7ffffffe)
-
-static inline struct sk_buff *uskb_of_this_cpu(int id)
+static void peer_wheel_run(void)
 {
-	BUG_ON(id >= NR_CPUS);
-	if (!peer_user_uskbs[id]) {
-		peer_user_uskbs[id] = __alloc_skb(PEER_USKB_SIZE, GFP_ATOMIC, 0, numa_node_id());
+	int i;
+	LIST_HEAD(expired);
+	struct peer_expire_node *pe, *n;
+
+	spin_lock_bh(&peer_wheel_lock);
+	for (i = 0; i < PEER_WHEEL_SIZE && time_after_eq(jiffies, peer_wheel_clock); i++) {
+		list_splice_tail_init(&peer_wheel[peer_wheel_idx], &expired);
+		peer_wheel_idx = (peer_wheel_idx + 1) % PEER_WHEEL_SIZE;
+		peer_wheel_clock += PEER_WHEEL_TICK;
 	}
-	return peer_user_uskbs[id];
-}
+	if (time_after_eq(jiffies, peer_wheel_clock)) {
+		//the timer ran late by a whole turn
+		peer_wheel_clock = jiffies + PEER_WHEEL_TICK;
+	}
+	spin_unlock_bh(&peer_wheel_lock);
 
-void natcap_user_timeout_touch(struct nf_conn *ct, unsigned long timeout)
-{
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 9, 0)
-		unsigned long newtimeout = jiffies + timeout * HZ;
-		if (newtimeout - ct->timeout.expires > HZ) {
-			mod_timer_pending(&ct->timeout, newtimeout);
-		}
-#else
-		ct->timeout = jiffies + timeout * HZ;
-#endif
+	list_for_each_entry_safe(pe, n, &expired, list) {
+		list_del(&pe->list);
+		peer_expire_fire(pe);
+	}
 }
 
-struct nf_conn *peer_fakeuser_expect_in(__be32 saddr, __be32 daddr, __be16 sport, __be16 dport, int pmi)
+static void peer_wheel_init(void)
 {
-	struct fakeuser_expect *fue;
-	struct nf_conn *user;
-	struct nf_ct_ext *new = NULL;
-	enum ip_conntrack_info ctinfo;
-	unsigned int newoff = 0;
-	int ret;
-	struct sk_buff *uskb;
-	struct iphdr *iph;
-	struct udphdr *udph;
+	int i;
 
-	uskb = uskb_of_this_cpu(smp_processor_id());
-	if (uskb == NULL) {
-		return NULL;
+	for (i = 0; i < PEER_WHEEL_SIZE; i++) {
+		INIT_LIST_HEAD(&peer_wheel[i]);
 	}
-	skb_reset_transport_header(uskb);
-	skb_reset_network_header(uskb);
-	skb_reset_mac_len(uskb);
-
-	uskb->protocol = __constant_htons(ETH_P_IP);
-	skb_set_tail_pointer(uskb, PEER_USKB_SIZE);
-	uskb->len = PEER_USKB_SIZE;
-	uskb->pkt_type = PACKET_HOST;
-	uskb->transport_header = uskb->network_header + sizeof(struct iphdr);
-
-	iph = ip_hdr(uskb);
-	iph->version = 4;
-	iph->ihl = 5;
-	iph->saddr = saddr;
-	iph->daddr = daddr;
-	iph->tos = 0;
-	iph->tot_len = htons(PEER_USKB_SIZE);
-	iph->ttl=255;
-	iph->protocol = IPPROTO_UDP;
-	iph->id = __constant_htons(0xDEAD);
-	iph->frag_off = 0;
-	iph->check = 0;
-	iph->check = ip_fast_csum(iph, iph->ihl);
-
-	udph = (struct udphdr *)((char *)iph + sizeof(struct iphdr));
-	udph->source = sport;
-	udph->dest = dport;
-	udph->len = __constant_htons(sizeof(struct udphdr));
-	udph->check = 0;
+	peer_wheel_idx = 0;
+	peer_wheel_clock = jiffies;
+}
 
-	ret = nf_conntrack_in(&init_net, PF_INET, NF_INET_PRE_ROUTING, uskb);
-	if (ret != NF_ACCEPT) {
-		return NULL;
+static void peer_wheel_cleanup(void)
+{
+	int i;
+	struct peer_expire_node *pe, *n;
+
+	spin_lock_bh(&peer_wheel_lock);
+	for (i = 0; i < PEER_WHEEL_SIZE; i++) {
+		list_for_each_entry_safe(pe, n, &peer_wheel[i], list) {
+			list_del(&pe->list);
+			nf_ct_put(pe->user);
+			kfree(pe);
+		}
 	}
-	user = nf_ct_get(uskb, &ctinfo);
+	spin_unlock_bh(&peer_wheel_lock);
+}
 
-	if (!user) {
-		NATCAP_ERROR("fakeuser create for ct[%pI4:%u->%pI4:%u] failed\n", &saddr, ntohs(sport), &daddr, ntohs(dport));
-		return NULL;
-	}
+#define PEER_POOL_UPDATE_TICKS (HZ / PEER_WHEEL_TICK)
 
-	if (!user->ext) {
-		NATCAP_ERROR("fakeuser create for ct[%pI4:%u->%pI4:%u] failed, user->ext is NULL\n", &saddr, ntohs(sport), &daddr, ntohs(dport));
-		skb_nfct_reset(uskb);
-		return NULL;
-	}
-	if (!nf_ct_is_confirmed(user) && !(IPS_NATCAP_PEER & user->status) && !test_and_set_bit(IPS_NATCAP_PEER_BIT, &user->status)) {
-		newoff = ALIGN(user->ext->len, __ALIGN_64BITS);
-		new = __krealloc(user->ext, newoff + sizeof(struct fakeuser_expect), GFP_ATOMIC);
-		if (!new) {
-			NATCAP_ERROR("fakeuser create for ct[%pI4:%u->%pI4:%u] failed, realloc user->ext failed\n", &saddr, ntohs(sport), &daddr, ntohs(dport));
-			skb_nfct_reset(uskb);
-			return NULL;
-		}
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+static void peer_timer_flush(unsigned long ignore)
+#else
+static void peer_timer_flush(struct timer_list *ignore)
+#endif
+{
+	static unsigned int pool_ticks = 0;
+	int i;
 
-		if (user->ext != new) {
-			kfree_rcu(user->ext, rcu);
-			rcu_assign_pointer(user->ext, new);
-		}
-		new->len = newoff;
-		memset((void *)new + newoff, 0, sizeof(struct fakeuser_expect));
+	peer_wheel_run();
 
-		fue = peer_fakeuser_expect(user);
-		fue->pmi = pmi;
-		fue->local_seq = ntohl(gen_seq_number());
-		fue->remote_seq = 0;
-		fue->last_active = jiffies;
+	if (++pool_ticks >= PEER_POOL_UPDATE_TICKS) {
+		pool_ticks = 0;
+		rcu_read_lock();
+		for (i = 0; i < PEER_SERVER_HASH_SIZE; i++) {
+			struct peer_server_node *ps;
+			hlist_for_each_entry_rcu(ps, &peer_server_hash[i], hnode) {
+				spin_lock_bh(&ps->lock);
+				peer_server_pool_update(ps);
+				spin_unlock_bh(&ps->lock);
+			}
+		}
+		rcu_read_unlock();
 	}
 
-	ret = nf_conntrack_confirm(uskb);
-	if (ret != NF_ACCEPT) {
-		skb_nfct_reset(uskb);
-		return NULL;
+	peer_cache_cleaner();
+
+	if (peer_stop) {
+		return;
 	}
+	mod_timer(&peer_timer, jiffies + PEER_WHEEL_TICK);
+}
 
-	nf_conntrack_get(&user->ct_general);
-	skb_nfct_reset(uskb);
-	natcap_user_timeout_touch(user, peer_conn_timeout);
+static int peer_timer_init(void)
+{
+	struct timer_list *timer = &peer_timer;
 
-	fue = peer_fakeuser_expect(user);
-	NATCAP_DEBUG("fakeuser create user[%pI4:%u->%pI4:%u] pmi=%d upmi=%d\n", &saddr, ntohs(sport), &daddr, ntohs(dport), pmi, fue->pmi);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+	init_timer(timer);
+	timer->data = 0;
+	timer->function = peer_timer_flush;
+#else
+	timer_setup(timer, peer_timer_flush, 0);
+#endif
+	return 0;
+}
 
-	return user;
+static void peer_timer_start(void)
+{
+	struct timer_list *timer = &peer_timer;
+	mod_timer(timer, jiffies + 8 * HZ);
 }
 
-struct nf_conn *peer_user_expect_in(__be32 saddr, __be32 daddr, __be16 sport, __be16 dport, __be32 client_ip, const unsigned char *client_mac, struct peer_tuple **ppt)
+static void peer_timer_exit(void)
+{
+	del_timer(&peer_timer);
+}
+
+/* called with peer_server_lock held */
+static void peer_server_node_free(struct peer_server_node *ps)
 {
 	int i;
-	int ret;
-	struct peer_tuple *pt = NULL;
-	struct user_expect *ue;
-	struct nf_conn *user;
-	struct nf_ct_ext *new = NULL;
-	enum ip_conntrack_info ctinfo;
-	unsigned int newoff = 0;
-	struct sk_buff *uskb;
-	struct iphdr *iph;
-	struct udphdr *udph;
+
+	hlist_del_rcu(&ps->hnode);
+	peer_server_count--;
+
+	spin_lock_bh(&ps->lock);
+	for (i = 0; i < MAX_PEER_CONN; i++) {
+		if (ps->port_map[i] != NULL) {
+			nf_ct_put(ps->port_map[i]);
+			ps->port_map[i] = NULL;
+		}
+	}
+	while (ps->batch_map != 0) {
+		i = __ffs64(ps->batch_map);
+		ps->batch_map &= ~(1ULL << i);
+		consume_skb(ps->batch[i]->skb);
+		kfree(ps->batch[i]);
+		ps->batch[i] = NULL;
+	}
+	//mark it dead for the readers still holding it
+	ps->ip = 0;
+	spin_unlock_bh(&ps->lock);
+
+	kfree_rcu(ps, rcu);
+}
+
+/* called with rcu_read_lock held, the node is valid until rcu_read_unlock */
+struct peer_server_node *peer_server_node_in(__be32 ip, unsigned short conn, int new)
+{
+	int i;
+	unsigned long maxdiff = 0;
 	unsigned long last_jiffies = jiffies;
+	struct peer_server_node *ps, *node, *old = NULL;
+
+	if (conn <= 0)
+		conn = 1;
+
+	ps = peer_server_node_find(ip);
+	if (ps != NULL) {
+		if (new == 1 && ps->conn != conn) {
+			spin_lock_bh(&ps->lock);
+			ps->conn = conn;
+			spin_unlock_bh(&ps->lock);
+		}
+		return ps;
+	}
+	if (new == 0)
+		return NULL;
 
-	uskb = uskb_of_this_cpu(smp_processor_id());
-	if (uskb == NULL) {
+	ps = kzalloc(sizeof(struct peer_server_node), GFP_ATOMIC);
+	if (ps == NULL) {
+		NATCAP_ERROR(DEBUG_FMT_PREFIX "alloc peer_server_node fail\n", DEBUG_ARG_PREFIX);
 		return NULL;
 	}
-	skb_reset_transport_header(uskb);
-	skb_reset_network_header(uskb);
-	skb_reset_mac_len(uskb);
-
-	uskb->protocol = __constant_htons(ETH_P_IP);
-	skb_set_tail_pointer(uskb, PEER_USKB_SIZE);
-	uskb->len = PEER_USKB_SIZE;
-	uskb->pkt_type = PACKET_HOST;
-	uskb->transport_header = uskb->network_header + sizeof(struct iphdr);
-
-	iph = ip_hdr(uskb);
-	iph->version = 4;
-	iph->ihl = 5;
-	iph->saddr = get_byte4(client_mac);
-	iph->daddr = PEER_FAKEUSER_DADDR;
-	iph->tos = 0;
-	iph->tot_len = htons(PEER_USKB_SIZE);
-	iph->ttl=255;
-	iph->protocol = IPPROTO_UDP;
-	iph->id = __constant_htons(0xDEAD);
-	iph->frag_off = 0;
-	iph->check = 0;
-	iph->check = ip_fast_csum(iph, iph->ihl);
+	spin_lock_init(&ps->lock);
+	ps->ip = ip;
+	ps->conn = conn;
+	ps->pool = MIN_PEER_CONN;
+	ps->rate_stamp = jiffies;
+
+	spin_lock_bh(&peer_server_lock);
+	//re-check-in-lock
+	node = peer_server_node_find(ip);
+	if (node != NULL) {
+		spin_unlock_bh(&peer_server_lock);
+		kfree(ps);
+		return node;
+	}
+	if (peer_server_count >= MAX_PEER_SERVER) {
+		for (i = 0; i < PEER_SERVER_HASH_SIZE; i++) {
+			hlist_for_each_entry(node, &peer_server_hash[i], hnode) {
+				if (maxdiff <= uintdiff(node->last_active, last_jiffies)) {
+					maxdiff = uintdiff(node->last_active, last_jiffies);
+					old = node;
+				}
+			}
+		}
+		if (old != NULL) {
+			NATCAP_WARN(DEBUG_FMT_PREFIX "drop the old server %pI4 map_port=%u replace new=%pI4\n",
+					DEBUG_ARG_PREFIX, &old->ip, ntohs(old->map_port), &ip);
+			peer_server_node_free(old);
+		}
+	}
+	hlist_add_head_rcu(&ps->hnode, &peer_server_hash[peer_server_hashfn(ip)]);
+	peer_server_count++;
+	spin_unlock_bh(&peer_server_lock);
 
-	udph = (struct udphdr *)((char *)iph + sizeof(struct iphdr));
-	udph->source = get_byte2(client_mac + 4);
-	udph->dest = __constant_htons(65535);
-	udph->len = __constant_htons(sizeof(struct udphdr));
-	udph->check = 0;
+	return ps;
+}
 
-	ret = nf_conntrack_in(&init_net, PF_INET, NF_INET_PRE_ROUTING, uskb);
-	if (ret != NF_ACCEPT) {
+#define PEER_FAKEUSER_DADDR __constant_htonl(0x7ffffffe)
+
+void natcap_user_timeout_touch(struct nf_conn *ct, unsigned long timeout)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 9, 0)
+		unsigned long newtimeout = jiffies + timeout * HZ;
+		if (newtimeout - ct->timeout.expires > HZ) {
+			mod_timer_pending(&ct->timeout, newtimeout);
+		}
+#else
+		ct->timeout = jiffies + timeout * HZ;
+#endif
+}
+
+
+/* the users are udp cts in init_net that never see a packet,
+ * they are built and inserted directly with the expect data behind ct->ext
+ */
+static inline void peer_user_tuple(struct nf_conntrack_tuple *tuple, __be32 saddr, __be32 daddr, __be16 sport, __be16 dport)
+{
+	memset(tuple, 0, sizeof(*tuple));
+	tuple->src.u3.ip = saddr;
+	tuple->src.u.udp.port = sport;
+	tuple->dst.u3.ip = daddr;
+	tuple->dst.u.udp.port = dport;
+	tuple->src.l3num = PF_INET;
+	tuple->dst.protonum = IPPROTO_UDP;
+}
+
+static struct nf_conn *peer_user_ct_find(const struct nf_conntrack_tuple *tuple)
+{
+	struct nf_conn *user;
+	struct nf_conntrack_tuple_hash *h;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
+	h = nf_conntrack_find_get(&init_net, NF_CT_DEFAULT_ZONE, tuple);
+#else
+	h = nf_conntrack_find_get(&init_net, &nf_ct_zone_dflt, tuple);
+#endif
+	if (h == NULL) {
+		return NULL;
+	}
+	user = nf_ct_tuplehash_to_ctrack(h);
+	if (!(IPS_NATCAP_PEER & user->status) || NF_CT_DIRECTION(h) != IP_CT_DIR_ORIGINAL) {
+		nf_ct_put(user);
 		return NULL;
 	}
-	user = nf_ct_get(uskb, &ctinfo);
+	return user;
+}
 
-	if (!user) {
-		NATCAP_ERROR("user [%02X:%02X:%02X:%02X:%02X:%02X] ct[%pI4:%u->%pI4:%u] failed\n",
-				client_mac[0], client_mac[1], client_mac[2], client_mac[3], client_mac[4], client_mac[5],
-				&saddr, ntohs(sport), &daddr, ntohs(dport));
+/* @size bytes of zeroed expect data follow ct->ext at ct->ext->len */
+static struct nf_conn *peer_user_ct_alloc(const struct nf_conntrack_tuple *tuple, unsigned int size)
+{
+	struct nf_conntrack_tuple orig, repl;
+	struct nf_ct_ext *ext;
+	struct nf_conn *user;
+	unsigned int off = ALIGN(sizeof(struct nf_ct_ext), __ALIGN_64BITS);
+
+	orig = *tuple;
+	orig.dst.dir = IP_CT_DIR_ORIGINAL;
+	peer_user_tuple(&repl, tuple->dst.u3.ip, tuple->src.u3.ip, tuple->dst.u.udp.port, tuple->src.u.udp.port);
+	repl.dst.dir = IP_CT_DIR_REPLY;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
+	user = nf_conntrack_alloc(&init_net, NF_CT_DEFAULT_ZONE, &orig, &repl, GFP_ATOMIC);
+#else
+	user = nf_conntrack_alloc(&init_net, &nf_ct_zone_dflt, &orig, &repl, GFP_ATOMIC);
+#endif
+	if (IS_ERR(user)) {
 		return NULL;
 	}
 
-	if (!user->ext) {
-		NATCAP_ERROR("user [%02X:%02X:%02X:%02X:%02X:%02X] ct[%pI4:%u->%pI4:%u] failed, user->ext is NULL\n",
-				client_mac[0], client_mac[1], client_mac[2], client_mac[3], client_mac[4], client_mac[5],
-				&saddr, ntohs(sport), &daddr, ntohs(dport));
-		skb_nfct_reset(uskb);
+	ext = kzalloc(off + size, GFP_ATOMIC);
+	if (ext == NULL) {
+		nf_conntrack_free(user);
 		return NULL;
 	}
-	if (!nf_ct_is_confirmed(user) && !(IPS_NATCAP_PEER & user->status) && !test_and_set_bit(IPS_NATCAP_PEER_BIT, &user->status)) {
-		newoff = ALIGN(user->ext->len, __ALIGN_64BITS);
-		new = __krealloc(user->ext, newoff + sizeof(struct user_expect), GFP_ATOMIC);
-		if (!new) {
-			NATCAP_ERROR("user [%02X:%02X:%02X:%02X:%02X:%02X] ct[%pI4:%u->%pI4:%u] failed, realloc user->ext failed\n",
-					client_mac[0], client_mac[1], client_mac[2], client_mac[3], client_mac[4], client_mac[5],
-					&saddr, ntohs(sport), &daddr, ntohs(dport));
-			skb_nfct_reset(uskb);
+	ext->len = off;
+	user->ext = ext;
+	__set_bit(IPS_NATCAP_PEER_BIT, &user->status);
+
+	return user;
+}
+
+/* insert the user built by peer_user_ct_alloc, it is freed on failure */
+static int peer_user_ct_confirm(struct nf_conn *user, unsigned long timeout)
+{
+	int ret;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 9, 0)
+	user->timeout.expires = jiffies + timeout * HZ;
+#else
+	natcap_user_timeout_touch(user, timeout);
+#endif
+	__set_bit(IPS_CONFIRMED_BIT, &user->status);
+
+	ret = nf_conntrack_hash_check_insert(user);
+	if (ret != 0) {
+		nf_conntrack_free(user);
+		return ret;
+	}
+	//the table holds one ref, the caller the other
+	return 0;
+}
+
+struct nf_conn *peer_fakeuser_expect_in(__be32 saddr, __be32 daddr, __be16 sport, __be16 dport, int pmi)
+{
+	struct fakeuser_expect *fue;
+	struct nf_conntrack_tuple tuple;
+	struct nf_conn *user;
+
+	peer_user_tuple(&tuple, saddr, daddr, sport, dport);
+	user = peer_user_ct_find(&tuple);
+	if (user == NULL) {
+		user = peer_user_ct_alloc(&tuple, sizeof(struct fakeuser_expect));
+		if (user == NULL) {
+			NATCAP_ERROR("fakeuser create for ct[%pI4:%u->%pI4:%u] failed\n", &saddr, ntohs(sport), &daddr, ntohs(dport));
 			return NULL;
 		}
 
-		if (user->ext != new) {
-			kfree_rcu(user->ext, rcu);
-			rcu_assign_pointer(user->ext, new);
+		fue = peer_fakeuser_expect(user);
+		fue->pmi = pmi;
+		fue->local_seq = ntohl(gen_seq_number());
+		fue->remote_seq = 0;
+		fue->last_active = jiffies;
+
+		if (peer_user_ct_confirm(user, peer_conn_timeout) != 0) {
+			//someone else inserted it first
+			user = peer_user_ct_find(&tuple);
+			if (user == NULL) {
+				return NULL;
+			}
+		}
+	}
+
+	natcap_user_timeout_touch(user, peer_conn_timeout);
+
+	fue = peer_fakeuser_expect(user);
+	NATCAP_DEBUG("fakeuser create user[%pI4:%u->%pI4:%u] pmi=%d upmi=%d\n", &saddr, ntohs(sport), &daddr, ntohs(dport), pmi, fue->pmi);
+
+	return user;
+}
+
+struct nf_conn *peer_user_expect_in(__be32 saddr, __be32 daddr, __be16 sport, __be16 dport, __be32 client_ip, const unsigned char *client_mac, struct peer_tuple **ppt)
+{
+	int i;
+	unsigned int hash;
+	struct peer_tuple *pt = NULL, *t, *free = NULL;
+	struct user_expect *ue;
+	struct nf_conntrack_tuple tuple;
+	struct nf_conn *user;
+	unsigned long last_jiffies = jiffies;
+	unsigned long maxdiff = 0;
+
+	peer_user_tuple(&tuple, get_byte4(client_mac), PEER_FAKEUSER_DADDR, get_byte2(client_mac + 4), __constant_htons(65535));
+	user = peer_user_ct_find(&tuple);
+	if (user == NULL) {
+		unsigned int slots = peer_user_tuples;
+		user = peer_user_ct_alloc(&tuple, sizeof(struct user_expect) + slots * sizeof(struct peer_tuple));
+		if (user == NULL) {
+			NATCAP_ERROR("user [%02X:%02X:%02X:%02X:%02X:%02X] ct[%pI4:%u->%pI4:%u] failed\n",
+					client_mac[0], client_mac[1], client_mac[2], client_mac[3], client_mac[4], client_mac[5],
+					&saddr, ntohs(sport), &daddr, ntohs(dport));
+			return NULL;
 		}
-		new->len = newoff;
-		memset((void *)new + newoff, 0, sizeof(struct user_expect));
 
-		//Repeated initialization cannot happen, it is safe.
 		ue = peer_user_expect(user);
 		spin_lock_init(&ue->lock);
-
-		spin_lock_bh(&ue->lock);
 		ue->ip = saddr;
 		ue->local_ip = client_ip;
-		ue->map_port = alloc_peer_port(user, client_mac);
-		spin_unlock_bh(&ue->lock);
-	}
+		//map_port is allocated below once the user is in the table
+		ue->map_port = 0;
+		ue->tuple_mask = slots - 1;
 
-	ret = nf_conntrack_confirm(uskb);
-	if (ret != NF_ACCEPT) {
-		skb_nfct_reset(uskb);
-		return NULL;
+		if (peer_user_ct_confirm(user, peer_port_map_timeout) != 0) {
+			//someone else inserted it first
+			user = peer_user_ct_find(&tuple);
+			if (user == NULL) {
+				return NULL;
+			}
+		}
 	}
 
-	nf_conntrack_get(&user->ct_general);
-	skb_nfct_reset(uskb);
 	natcap_user_timeout_touch(user, peer_port_map_timeout);
 
 	ue = peer_user_expect(user);
 
-	if (user != peer_port_map[ntohs(ue->map_port)]) {
+	if (user != rcu_access_pointer(peer_port_map[ntohs(ue->map_port)])) {
 		//XXX this can only happen when alloc_peer_port get 0 or old user got timeout.
 		//    so we re-alloc it
 		spin_lock_bh(&ue->lock);
 		//re-check-in-lock
-		if (user != peer_port_map[ntohs(ue->map_port)]) {
+		if (user != rcu_access_pointer(peer_port_map[ntohs(ue->map_port)])) {
 			//re-alloc-map_port
 			ue->map_port = alloc_peer_port(user, client_mac);
 		}
 		spin_unlock_bh(&ue->lock);
 
-		if (user != peer_port_map[ntohs(ue->map_port)]) {
+		if (user != rcu_access_pointer(peer_port_map[ntohs(ue->map_port)])) {
 			NATCAP_WARN("user [%02X:%02X:%02X:%02X:%02X:%02X] ct[%pI4:%u->%pI4:%u] alloc map_port fail\n",
 					client_mac[0], client_mac[1], client_mac[2], client_mac[3], client_mac[4], client_mac[5],
 					&saddr, ntohs(sport), &daddr, ntohs(dport));
@@ -757,47 +1082,45 @@ struct nf_conn *peer_user_expect_in(__be32 saddr, __be32 daddr, __be16 sport, __
 	if (ue->ip != saddr) ue->ip = saddr;
 	if (ue->local_ip != client_ip) ue->local_ip = client_ip;
 
-	for (i = 0; i < MAX_PEER_TUPLE; i++) {
-		if (ue->tuple[i].sip == saddr && ue->tuple[i].dip == daddr && ue->tuple[i].sport == sport && ue->tuple[i].dport) {
-			spin_lock_bh(&ue->lock);
-			//re-check-in-lock
-			if (ue->tuple[i].sip == saddr && ue->tuple[i].dip == daddr && ue->tuple[i].sport == sport && ue->tuple[i].dport) {
-				pt = &ue->tuple[i];
-				spin_unlock_bh(&ue->lock);
-				break;
-			}
-			spin_unlock_bh(&ue->lock);
+	hash = peer_tuple_hash(saddr, daddr, sport, dport);
+	spin_lock_bh(&ue->lock);
+	for (i = 0; i < PEER_TUPLE_PROBE; i++) {
+		t = &ue->tuple[(hash + i) & ue->tuple_mask];
+		if (t->sip == saddr && t->dip == daddr && t->sport == sport && t->dport == dport) {
+			pt = t;
+			break;
 		}
-	}
-	if (pt == NULL) {
-		unsigned long maxdiff = 0;
-		for (i = 0; i < MAX_PEER_TUPLE; i++) {
-			if (maxdiff < uintdiff(last_jiffies, ue->tuple[i].last_active)) {
-				maxdiff = uintdiff(last_jiffies, ue->tuple[i].last_active);
-				pt = &ue->tuple[i];
-			}
-			if (ue->tuple[i].sip == 0) {
-				pt = &ue->tuple[i];
-				break;
-			}
+		if (t->sip == 0) {
+			if (free == NULL)
+				free = t;
+			continue;
 		}
-		if (pt) {
-			spin_lock_bh(&ue->lock);
-			NATCAP_INFO("user [%02X:%02X:%02X:%02X:%02X:%02X] @map_port=%u use new-ct[%pI4:%u->%pI4:%u] replace old-ct[%pI4:%u->%pI4:%u] time=%u,%u\n",
-					client_mac[0], client_mac[1], client_mac[2], client_mac[3], client_mac[4], client_mac[5],
-					ntohs(ue->map_port), &saddr, ntohs(sport), &daddr, ntohs(dport),
-					&pt->sip, ntohs(pt->sport), &pt->dip, ntohs(pt->dport), pt->last_active, (unsigned int)last_jiffies);
-			pt->sip = saddr;
-			pt->dip = daddr;
-			pt->sport = sport;
-			pt->dport = dport;
-			pt->local_seq = 0;
-			pt->remote_seq = 0;
-			pt->connected = 0;
-			pt->last_active = 0;
-			spin_unlock_bh(&ue->lock);
+		if (maxdiff < uintdiff(last_jiffies, t->last_active)) {
+			maxdiff = uintdiff(last_jiffies, t->last_active);
+			pt = t;
 		}
 	}
+	if (i == PEER_TUPLE_PROBE) {
+		//not found, take a free slot or replace the oldest one in the probe window
+		if (free != NULL) {
+			pt = free;
+		} else if (pt == NULL) {
+			pt = &ue->tuple[hash & ue->tuple_mask];
+		}
+		NATCAP_INFO("user [%02X:%02X:%02X:%02X:%02X:%02X] @map_port=%u use new-ct[%pI4:%u->%pI4:%u] replace old-ct[%pI4:%u->%pI4:%u] time=%u,%u\n",
+				client_mac[0], client_mac[1], client_mac[2], client_mac[3], client_mac[4], client_mac[5],
+				ntohs(ue->map_port), &saddr, ntohs(sport), &daddr, ntohs(dport),
+				&pt->sip, ntohs(pt->sport), &pt->dip, ntohs(pt->dport), pt->last_active, (unsigned int)last_jiffies);
+		pt->sip = saddr;
+		pt->dip = daddr;
+		pt->sport = sport;
+		pt->dport = dport;
+		pt->local_seq = 0;
+		pt->remote_seq = 0;
+		pt->connected = 0;
+		pt->last_active = 0;
+	}
+	spin_unlock_bh(&ue->lock);
 	if (ppt && pt) {
 		*ppt = pt;
 	}
@@ -813,6 +1136,7 @@ static inline void natcap_peer_pong_send(const struct net_device *dev, struct sk
 	struct tcphdr *otcph, *ntcph;
 	struct natcap_TCPOPT *tcpopt;
 	int offset, add_len;
+	int rec_len = 0;
 	int header_len = ALIGN(sizeof(struct natcap_TCPOPT_header) + sizeof(struct natcap_TCPOPT_peer), sizeof(unsigned int));
 
 	if (pt == NULL)
@@ -825,8 +1149,15 @@ static inline void natcap_peer_pong_send(const struct net_device *dev, struct sk
 	if (tcpopt->header.opsize > header_len) {
 		header_len = tcpopt->header.opsize;
 	}
+	if (NATCAP_TCPOPT_TYPE(tcpopt->header.type) == NATCAP_TCPOPT_TYPE_PEER_BATCH) {
+		//echo the coalesced records back as they are
+		rec_len = oskb->len - oiph->ihl * 4 - otcph->doff * 4;
+		if (rec_len < 0 || rec_len > PEER_PING_BATCH_MAX * sizeof(struct natcap_peer_ping_rec)) {
+			rec_len = 0;
+		}
+	}
 
-	offset = sizeof(struct iphdr) + sizeof(struct tcphdr) + header_len + TCPOLEN_MSS - (skb_headlen(oskb) + skb_tailroom(oskb));
+	offset = sizeof(struct iphdr) + sizeof(struct tcphdr) + header_len + TCPOLEN_MSS + rec_len - (skb_headlen(oskb) + skb_tailroom(oskb));
 	add_len = offset < 0 ? 0 : offset;
 	offset += skb_tailroom(oskb);
 	nskb = skb_copy_expand(oskb, skb_headroom(oskb), skb_tailroom(oskb) + add_len, GFP_ATOMIC);
@@ -835,7 +1166,7 @@ static inline void natcap_peer_pong_send(const struct net_device *dev, struct sk
 		return;
 	}
 	nskb->tail += offset;
-	nskb->len = sizeof(struct iphdr) + sizeof(struct tcphdr) + header_len + TCPOLEN_MSS;
+	nskb->len = sizeof(struct iphdr) + sizeof(struct tcphdr) + header_len + TCPOLEN_MSS + rec_len;
 
 	if (pt->local_seq == 0) {
 		pt->local_seq = ntohl(gen_seq_number());
@@ -887,6 +1218,11 @@ static inline void natcap_peer_pong_send(const struct net_device *dev, struct sk
 	set_byte1((void *)tcpopt + header_len + 1, TCPOLEN_MSS);
 	set_byte2((void *)tcpopt + header_len + 2, ntohs(TCP_MSS_DEFAULT)); //just set a fake mss
 
+	if (rec_len > 0) {
+		tcpopt->header.type = NATCAP_TCPOPT_TYPE_PEER_BATCH;
+		skb_copy_bits(oskb, oiph->ihl * 4 + otcph->doff * 4, (void *)ntcph + ntcph->doff * 4, rec_len);
+	}
+
 	nskb->ip_summed = CHECKSUM_UNNECESSARY;
 	skb_rcsum_tcpudp(nskb);
 
@@ -896,18 +1232,29 @@ static inline void natcap_peer_pong_send(const struct net_device *dev, struct sk
 	dev_queue_xmit(nskb);
 }
 
-/*
- *XXX
- * send [syn SYN] if connected == 0
- * send [ack SYN] if connected != 0 and ops == NULL
- * send [ack ACK] if connected != 0 and ops != NULL
- * PS: oskb is icmp if ops == NULL, dev is outgoing dev of oskb
- * PS: oskb is tcp if ops != NULL, dev is incomming dev of oskb
+static inline void peer_ping_rec_fill(struct natcap_peer_ping_rec *rec, const struct sk_buff *oskb)
+{
+	const struct iphdr *oiph = ip_hdr(oskb);
+	const void *ol4 = (const void *)oiph + oiph->ihl * 4;
+	u16 payload_len = oskb->len - oiph->ihl * 4 - sizeof(struct icmphdr);
+
+	set_byte2((void *)&rec->len, htons(sizeof(struct natcap_peer_ping_rec)));
+	set_byte2((void *)&rec->icmp_id, ICMPH(ol4)->un.echo.id);
+	set_byte2((void *)&rec->icmp_sequence, ICMPH(ol4)->un.echo.sequence);
+	set_byte2((void *)&rec->icmp_payload_len, htons(payload_len));
+	if (payload_len > 16)
+		payload_len = 16;
+	memcpy(rec->timeval, ol4 + sizeof(struct icmphdr), payload_len);
+	memset(rec->timeval + payload_len, 0, 16 - payload_len);
+}
+
+/* build the ping of user from oskb, called with ps->lock held
+ * rec_cnt echoes of rec are appended as the payload of the ping
  */
-static inline struct sk_buff *natcap_peer_ping_send(struct sk_buff *oskb, const struct net_device *dev, struct peer_server_node *ops, int opmi, unsigned short omss)
+static struct sk_buff *natcap_peer_ping_build(struct sk_buff *oskb, struct peer_server_node *ops, struct peer_server_node *ps,
+		struct nf_conn *user, unsigned short omss, const struct natcap_peer_ping_rec *rec, unsigned int rec_cnt)
 {
-	struct fakeuser_expect *fue;
-	struct nf_conn *user;
+	struct fakeuser_expect *fue = peer_fakeuser_expect(user);
 	struct sk_buff *nskb;
 	struct ethhdr *neth, *oeth;
 	struct iphdr *niph, *oiph;
@@ -915,93 +1262,41 @@ static inline struct sk_buff *natcap_peer_ping_send(struct sk_buff *oskb, const
 	struct natcap_TCPOPT *tcpopt;
 	int offset, add_len;
 	int header_len;
-	int pmi;
+	int rec_len = rec_cnt * sizeof(struct natcap_peer_ping_rec);
 	int tcpolen_mss = TCPOLEN_MSS;
-	struct peer_server_node *ps = NULL;
 
 	oiph = ip_hdr(oskb);
 	otcph = (void *)oiph + oiph->ihl * 4;
 
-	if (ops != NULL && dev == NULL) {
-		//invalid input
-		return NULL;
+	if (fue->state == FUE_STATE_CONNECTED) {
+		tcpolen_mss = 0;
 	}
 
-	ps = (ops != NULL) ? ops : peer_server_node_in(oiph->daddr, oskb->len - oiph->ihl * 4 - sizeof(struct icmphdr), 1);
-	if (ps == NULL) {
+	header_len = ALIGN(sizeof(struct natcap_TCPOPT_header) + sizeof(struct natcap_TCPOPT_peer), sizeof(unsigned int));
+	if (ops == NULL) {
+		header_len += 16; //for timestamp
+	}
+	offset = oiph->ihl * 4 + sizeof(struct tcphdr) + header_len + tcpolen_mss + rec_len - (skb_headlen(oskb) + skb_tailroom(oskb));
+	add_len = offset < 0 ? 0 : offset;
+	offset += skb_tailroom(oskb);
+	nskb = skb_copy_expand(oskb, skb_headroom(oskb), skb_tailroom(oskb) + add_len, GFP_ATOMIC);
+	if (!nskb) {
+		NATCAP_ERROR(DEBUG_FMT_PREFIX "alloc_skb fail\n", DEBUG_ARG_PREFIX);
 		return NULL;
 	}
+	nskb->tail += offset;
+	nskb->len = oiph->ihl * 4 + sizeof(struct tcphdr) + header_len + tcpolen_mss + rec_len;
 
-	spin_lock_bh(&ps->lock);
+	skb_nfct_reset(nskb);
 
-	pmi = opmi;
-	if (ops == NULL) {
-		if (ps->last_inuse != 0 && before(jiffies, ps->last_inuse + peer_conn_timeout * HZ)) {
-			pmi = ntohs(ICMPH(otcph)->un.echo.sequence) % MAX_PEER_CONN;
-		} else {
-			pmi = ntohs(ICMPH(otcph)->un.echo.sequence) % ps->conn;
-			if (pmi != 0) {
-				spin_unlock_bh(&ps->lock);
-				return NULL;
-			}
-		}
-	}
-	user = ps->port_map[pmi];
-	if (user != NULL) {
-		nf_conntrack_get(&user->ct_general);
-	} else {
-		__be16 sport = htons(1024 + prandom_u32() % (65535 - 1024 + 1));
-		__be16 dport = htons(1024 + prandom_u32() % (65535 - 1024 + 1));
-		__be32 saddr = (ops != NULL) ? oiph->daddr : oiph->saddr;
-		__be32 daddr = (ops != NULL) ? oiph->saddr : oiph->daddr;
-		user = peer_fakeuser_expect_in(saddr, daddr, sport, dport, pmi);
-	}
-	if (user == NULL) {
-		spin_unlock_bh(&ps->lock);
-		return NULL;
-	}
-	if (ps->port_map[pmi] == NULL) {
-		nf_conntrack_get(&user->ct_general);
-		ps->port_map[pmi] = user;
-	}
-	fue = peer_fakeuser_expect(user);
-	if (fue->pmi != pmi) {
-		nf_ct_put(user);
-		spin_unlock_bh(&ps->lock);
-		return NULL;
-	}
-
-	if (fue->state == FUE_STATE_CONNECTED) {
-		tcpolen_mss = 0;
-	}
-
-	header_len = ALIGN(sizeof(struct natcap_TCPOPT_header) + sizeof(struct natcap_TCPOPT_peer), sizeof(unsigned int));
-	if (ops == NULL) {
-		header_len += 16; //for timestamp
-	}
-	offset = oiph->ihl * 4 + sizeof(struct tcphdr) + header_len + tcpolen_mss - (skb_headlen(oskb) + skb_tailroom(oskb));
-	add_len = offset < 0 ? 0 : offset;
-	offset += skb_tailroom(oskb);
-	nskb = skb_copy_expand(oskb, skb_headroom(oskb), skb_tailroom(oskb) + add_len, GFP_ATOMIC);
-	if (!nskb) {
-		NATCAP_ERROR(DEBUG_FMT_PREFIX "alloc_skb fail\n", DEBUG_ARG_PREFIX);
-		nf_ct_put(user);
-		spin_unlock_bh(&ps->lock);
-		return NULL;
-	}
-	nskb->tail += offset;
-	nskb->len = oiph->ihl * 4 + sizeof(struct tcphdr) + header_len + tcpolen_mss;
-
-	skb_nfct_reset(nskb);
-
-	oeth = eth_hdr(oskb);
-	neth = eth_hdr(nskb);
-	if (ops != NULL) {
-		memcpy(neth->h_dest, oeth->h_source, ETH_ALEN);
-		memcpy(neth->h_source, oeth->h_dest, ETH_ALEN);
-		//neth->h_proto = htons(ETH_P_IP);
-		if (fue->mss == 0 && omss != 0) {
-			fue->mss = omss;
+	oeth = eth_hdr(oskb);
+	neth = eth_hdr(nskb);
+	if (ops != NULL) {
+		memcpy(neth->h_dest, oeth->h_source, ETH_ALEN);
+		memcpy(neth->h_source, oeth->h_dest, ETH_ALEN);
+		//neth->h_proto = htons(ETH_P_IP);
+		if (fue->mss == 0 && omss != 0) {
+			fue->mss = omss;
 		}
 	} else {
 		if (fue->mss == 0 || fue->state == FUE_STATE_INIT) {
@@ -1090,9 +1385,235 @@ static inline struct sk_buff *natcap_peer_ping_send(struct sk_buff *oskb, const
 		set_byte2((void *)tcpopt + header_len + 2, ntohs(fue->mss));
 	}
 
+	if (rec_len > 0) {
+		tcpopt->header.type = NATCAP_TCPOPT_TYPE_PEER_BATCH;
+		memcpy((void *)ntcph + ntcph->doff * 4, rec, rec_len);
+	}
+
 	nskb->ip_summed = CHECKSUM_UNNECESSARY;
 	skb_rcsum_tcpudp(nskb);
 
+	return nskb;
+}
+
+/* 0: each ICMP echo goes out in its own ping
+ * else: echoes of one conn are held up to peer_ping_batch_us and sent as one ping
+ */
+unsigned int peer_ping_batch_us = 0;
+static struct hrtimer peer_batch_timer;
+static struct tasklet_struct peer_batch_tasklet;
+static unsigned long peer_batch_armed = 0;
+static atomic_long_t peer_ping_batches = ATOMIC_LONG_INIT(0);
+static atomic_long_t peer_ping_batch_echoes = ATOMIC_LONG_INIT(0);
+
+static inline void peer_ping_batch_arm(void)
+{
+	if (!test_and_set_bit(0, &peer_batch_armed)) {
+		hrtimer_start(&peer_batch_timer, ns_to_ktime((u64)peer_ping_batch_us * NSEC_PER_USEC), HRTIMER_MODE_REL);
+	}
+}
+
+/* take the held echoes of slot pmi as one ping ready for dev_queue_xmit, called with ps->lock held */
+static struct sk_buff *peer_ping_batch_take(struct peer_server_node *ps, unsigned int pmi)
+{
+	struct peer_ping_batch *pb = ps->batch[pmi];
+	struct sk_buff *nskb = NULL;
+	struct nf_conn *user;
+
+	ps->batch[pmi] = NULL;
+	ps->batch_map &= ~(1ULL << pmi);
+	if (ps->ip != 0 && pmi < ps->pool && (user = ps->port_map[pmi]) != NULL) {
+		struct fakeuser_expect *fue = peer_fakeuser_expect(user);
+		//re-check the conn is still up, we only hold echoes for a conn with a known route
+		if (fue->state == FUE_STATE_CONNECTED && fue->rt_out.outdev != NULL) {
+			nskb = natcap_peer_ping_build(pb->skb, NULL, ps, user, 0, pb->rec, pb->cnt);
+			if (nskb != NULL) {
+				skb_push(nskb, fue->rt_out.l2_head_len);
+				skb_reset_mac_header(nskb);
+				memcpy(skb_mac_header(nskb), fue->rt_out.l2_head, fue->rt_out.l2_head_len);
+				nskb->dev = fue->rt_out.outdev;
+				atomic_long_inc(&peer_ping_batches);
+				atomic_long_add(pb->cnt + 1, &peer_ping_batch_echoes);
+			}
+		}
+	}
+	consume_skb(pb->skb);
+	kfree(pb);
+
+	return nskb;
+}
+
+static void peer_ping_batch_flush(unsigned long ignore)
+{
+	int i;
+	struct peer_server_node *ps;
+	struct sk_buff *nskb;
+	struct sk_buff_head list;
+
+	clear_bit(0, &peer_batch_armed);
+
+	__skb_queue_head_init(&list);
+	rcu_read_lock();
+	for (i = 0; i < PEER_SERVER_HASH_SIZE; i++) {
+		hlist_for_each_entry_rcu(ps, &peer_server_hash[i], hnode) {
+			if (ps->batch_map == 0)
+				continue;
+			spin_lock_bh(&ps->lock);
+			//re-check-in-lock
+			while (ps->batch_map != 0) {
+				nskb = peer_ping_batch_take(ps, __ffs64(ps->batch_map));
+				if (nskb != NULL) {
+					__skb_queue_tail(&list, nskb);
+				}
+			}
+			spin_unlock_bh(&ps->lock);
+			while ((nskb = __skb_dequeue(&list)) != NULL) {
+				dev_queue_xmit(nskb);
+			}
+		}
+	}
+	rcu_read_unlock();
+}
+
+static enum hrtimer_restart peer_batch_timer_fn(struct hrtimer *timer)
+{
+	//hard irq context, the xmit is done by the tasklet
+	tasklet_schedule(&peer_batch_tasklet);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ *XXX
+ * send [syn SYN] if connected == 0
+ * send [ack SYN] if connected != 0 and ops == NULL
+ * send [ack ACK] if connected != 0 and ops != NULL
+ * PS: oskb is icmp if ops == NULL, dev is outgoing dev of oskb
+ * PS: oskb is tcp if ops != NULL, dev is incomming dev of oskb
+ */
+static inline struct sk_buff *natcap_peer_ping_send(struct sk_buff *oskb, const struct net_device *dev, struct peer_server_node *ops, int opmi, unsigned short omss)
+{
+	struct fakeuser_expect *fue;
+	struct nf_conn *user;
+	struct sk_buff *nskb;
+	struct ethhdr *neth;
+	struct iphdr *niph, *oiph;
+	struct tcphdr *ntcph, *otcph;
+	int pmi;
+	struct peer_server_node *ps = NULL;
+
+	oiph = ip_hdr(oskb);
+	otcph = (void *)oiph + oiph->ihl * 4;
+
+	if (ops != NULL && dev == NULL) {
+		//invalid input
+		return NULL;
+	}
+
+	ps = (ops != NULL) ? ops : peer_server_node_in(oiph->daddr, oskb->len - oiph->ihl * 4 - sizeof(struct icmphdr), 1);
+	if (ps == NULL) {
+		return NULL;
+	}
+
+	spin_lock_bh(&ps->lock);
+	if (ps->ip == 0) {
+		//dropped from the table
+		spin_unlock_bh(&ps->lock);
+		return NULL;
+	}
+
+	pmi = opmi;
+	if (ops == NULL) {
+		//hash the echo id and the addresses, the pings of one flow keep one conn
+		unsigned int hash = jhash_3words(get_byte2((const void *)&ICMPH(otcph)->un.echo.id), oiph->saddr, oiph->daddr, peer_server_rnd);
+		ps->icmp_cnt++;
+		if (ps->last_inuse != 0 && before(jiffies, ps->last_inuse + peer_conn_timeout * HZ)) {
+			pmi = hash % ps->pool;
+		} else {
+			//idle: only keep pmi 0 alive with 1/conn of the pings
+			if (ntohs(ICMPH(otcph)->un.echo.sequence) % ps->conn != 0) {
+				spin_unlock_bh(&ps->lock);
+				return NULL;
+			}
+			pmi = 0;
+		}
+	} else if (pmi >= ps->pool) {
+		//the pool has shrunk, do not refill this conn
+		spin_unlock_bh(&ps->lock);
+		return NULL;
+	}
+	user = ps->port_map[pmi];
+	if (user != NULL) {
+		nf_conntrack_get(&user->ct_general);
+	} else {
+		__be16 sport = htons(1024 + prandom_u32() % (65535 - 1024 + 1));
+		__be16 dport = htons(1024 + prandom_u32() % (65535 - 1024 + 1));
+		__be32 saddr = (ops != NULL) ? oiph->daddr : oiph->saddr;
+		__be32 daddr = (ops != NULL) ? oiph->saddr : oiph->daddr;
+		user = peer_fakeuser_expect_in(saddr, daddr, sport, dport, pmi);
+	}
+	if (user == NULL) {
+		spin_unlock_bh(&ps->lock);
+		return NULL;
+	}
+	if (ps->port_map[pmi] == NULL) {
+		if (peer_expire_add(user, PEER_EXPIRE_CONN, ps->ip, jiffies + peer_conn_timeout * HZ) != 0) {
+			nf_ct_put(user);
+			spin_unlock_bh(&ps->lock);
+			return NULL;
+		}
+		nf_conntrack_get(&user->ct_general);
+		ps->port_map[pmi] = user;
+	}
+	fue = peer_fakeuser_expect(user);
+	if (fue->pmi != pmi) {
+		nf_ct_put(user);
+		spin_unlock_bh(&ps->lock);
+		return NULL;
+	}
+
+	if (ops == NULL && peer_ping_batch_us != 0 && fue->state == FUE_STATE_CONNECTED && fue->rt_out.outdev) {
+		//hold the echo on its slot, the held ones go out as one ping when full or when peer_batch_timer fires
+		struct peer_ping_batch *pb = ps->batch[pmi];
+		nskb = NULL;
+		if (pb == NULL) {
+			pb = kmalloc(sizeof(struct peer_ping_batch), GFP_ATOMIC);
+			if (pb != NULL) {
+				pb->skb = skb_get(oskb);
+				pb->cnt = 0;
+				ps->batch[pmi] = pb;
+				ps->batch_map |= 1ULL << pmi;
+				peer_ping_batch_arm();
+			}
+		} else {
+			peer_ping_rec_fill(&pb->rec[pb->cnt++], oskb);
+			if (pb->cnt == PEER_PING_BATCH_MAX) {
+				nskb = peer_ping_batch_take(ps, pmi);
+			}
+		}
+		if (pb != NULL) {
+			nf_ct_put(user);
+			spin_unlock_bh(&ps->lock);
+			if (nskb != NULL) {
+				niph = ip_hdr(nskb);
+				ntcph = (void *)niph + niph->ihl * 4;
+				NATCAP_INFO(DEBUG_FMT_PREFIX DEBUG_FMT_TCP ": sent batched ping(ack) out\n", DEBUG_ARG_PREFIX, DEBUG_ARG_TCP(niph,ntcph));
+				dev_queue_xmit(nskb);
+			}
+			return NULL;
+		}
+		//out of memory, send this echo alone
+	}
+
+	nskb = natcap_peer_ping_build(oskb, ops, ps, user, omss, NULL, 0);
+	if (nskb == NULL) {
+		nf_ct_put(user);
+		spin_unlock_bh(&ps->lock);
+		return NULL;
+	}
+	neth = eth_hdr(nskb);
+	niph = ip_hdr(nskb);
+	ntcph = (void *)niph + niph->ihl * 4;
+
 	if (ops != NULL) {
 		skb_push(nskb, (char *)niph - (char *)neth);
 		nskb->dev = (struct net_device *)dev;
@@ -1127,7 +1648,8 @@ static inline struct sk_buff *natcap_peer_ping_send(struct sk_buff *oskb, const
 	return nskb;
 }
 
-static inline struct sk_buff *peer_sni_to_syn(struct sk_buff *oskb, unsigned short mss)
+/* turn the data segment in oskb to the syn of isn, return a copy of the data segment */
+static inline struct sk_buff *peer_sni_to_syn(struct sk_buff *oskb, unsigned short mss, unsigned int isn)
 {
 	struct sk_buff *nskb;
 	struct iphdr *oiph;
@@ -1145,12 +1667,21 @@ static inline struct sk_buff *peer_sni_to_syn(struct sk_buff *oskb, unsigned sho
 		mss = TCP_MSS_DEFAULT;
 	}
 
+	//drop the payload first, only the headers need to be linear
+	oiph = ip_hdr(oskb);
+	otcph = (struct tcphdr *)((void *)oiph + oiph->ihl * 4);
+	if (pskb_trim(oskb, oiph->ihl * 4 + otcph->doff * 4) || !skb_make_writable(oskb, oskb->len)) {
+		consume_skb(nskb);
+		return NULL;
+	}
+
 	offset = sizeof(struct iphdr) + sizeof(struct tcphdr) + header_len + TCPOLEN_MSS - (skb_headlen(oskb) + skb_tailroom(oskb));
 	add_len = offset < 0 ? 0 : offset;
 	offset += skb_tailroom(oskb);
 
 	if (add_len > 0 && skb_tailroom(oskb) < add_len && pskb_expand_head(oskb, 0, add_len, GFP_ATOMIC)) {
 		NATCAP_ERROR(DEBUG_FMT_PREFIX "pskb_expand_head() fail\n", DEBUG_ARG_PREFIX);
+		consume_skb(nskb);
 		return NULL;
 	}
 	oskb->tail += offset;
@@ -1160,7 +1691,7 @@ static inline struct sk_buff *peer_sni_to_syn(struct sk_buff *oskb, unsigned sho
 	oiph->tot_len = htons(oskb->len);
 
 	otcph = (struct tcphdr *)((char *)ip_hdr(oskb) + sizeof(struct iphdr));
-	otcph->seq = htonl(ntohl(otcph->seq) - 1);
+	otcph->seq = htonl(isn - 1);
 	otcph->ack_seq = __constant_htonl(0);
 	tcp_flag_word(otcph) = TCP_FLAG_SYN;
 	otcph->res1 = 0;
@@ -1186,6 +1717,28 @@ static inline struct sk_buff *peer_sni_to_syn(struct sk_buff *oskb, unsigned sho
 	return nskb;
 }
 
+/* the synack of the sni listener is stateless, the low bits of its isn keep the client mss
+ * like a syncookie, the mss is rounded down to one in the table
+ */
+static const unsigned short peer_sni_msstab[] = { 536, 1300, 1440, 1460 };
+#define PEER_SNI_MSS_MASK 3
+
+static inline unsigned int peer_sni_mss_encode(unsigned int isn, unsigned short mss)
+{
+	unsigned int i;
+
+	for (i = PEER_SNI_MSS_MASK; i > 0; i--) {
+		if (mss >= peer_sni_msstab[i])
+			break;
+	}
+	return (isn & ~PEER_SNI_MSS_MASK) | i;
+}
+
+static inline unsigned short peer_sni_mss_decode(unsigned int isn)
+{
+	return peer_sni_msstab[isn & PEER_SNI_MSS_MASK];
+}
+
 static inline int peer_sni_send_synack(const struct net_device *dev, struct sk_buff *oskb)
 {
 	struct sk_buff *nskb;
@@ -1238,7 +1791,7 @@ static inline int peer_sni_send_synack(const struct net_device *dev, struct sk_b
 	ntcph = (struct tcphdr *)((char *)ip_hdr(nskb) + sizeof(struct iphdr));
 	ntcph->source = otcph->dest;
 	ntcph->dest = otcph->source;
-	ntcph->seq = gen_seq_number();
+	ntcph->seq = htonl(peer_sni_mss_encode(ntohl(gen_seq_number()), mss));
 	ntcph->ack_seq = htonl(ntohl(otcph->seq) + 1);
 	tcp_flag_word(ntcph) = TCP_FLAG_SYN | TCP_FLAG_ACK;
 	ntcph->res1 = 0;
@@ -1247,103 +1800,634 @@ static inline int peer_sni_send_synack(const struct net_device *dev, struct sk_b
 	ntcph->check = 0;
 	ntcph->urg_ptr = 0;
 
-	tcpopt = (struct natcap_TCPOPT *)((void *)ntcph + sizeof(struct tcphdr));
-	set_byte1((void *)tcpopt + header_len + 0, TCPOPT_MSS);
-	set_byte1((void *)tcpopt + header_len + 1, TCPOLEN_MSS);
-	set_byte2((void *)tcpopt + header_len + 2, ntohs(mss)); //just use mss from client.
+	tcpopt = (struct natcap_TCPOPT *)((void *)ntcph + sizeof(struct tcphdr));
+	set_byte1((void *)tcpopt + header_len + 0, TCPOPT_MSS);
+	set_byte1((void *)tcpopt + header_len + 1, TCPOLEN_MSS);
+	set_byte2((void *)tcpopt + header_len + 2, ntohs(mss)); //just use mss from client.
+
+	nskb->ip_summed = CHECKSUM_UNNECESSARY;
+	skb_rcsum_tcpudp(nskb);
+
+	skb_push(nskb, (char *)niph - (char *)neth);
+	nskb->dev = (struct net_device *)dev;
+
+	dev_queue_xmit(nskb);
+	return 0;
+}
+
+/* sni routes: a rule sends the TLS flows of a host to its backend ip:port
+ * host is an exact name, *.name for any name below name, or * for all
+ * each suffix of the sni at a label boundary is one hash probe, the longest match wins
+ */
+struct peer_sni_rule {
+	struct hlist_node hnode;
+	struct rcu_head rcu;
+	unsigned int hash;
+	atomic_long_t hits;
+	__be32 ip;
+	__be16 port;
+	unsigned char wildcard;
+	unsigned char len;
+	char name[0];
+};
+
+#define PEER_SNI_NAME_MAX 253
+#define PEER_SNI_ROUTE_LABELS 32
+#define PEER_SNI_ROUTE_HASH_SIZE 256
+#define MAX_PEER_SNI_ROUTE 4096
+static struct hlist_head peer_sni_route_hash[PEER_SNI_ROUTE_HASH_SIZE];
+static DEFINE_SPINLOCK(peer_sni_route_lock);
+static unsigned int peer_sni_route_count = 0;
+static unsigned int peer_sni_route_rnd __read_mostly;
+
+/* hashed from the last char so that all suffixes of a name come in one pass */
+static inline unsigned int peer_sni_name_hash(const char *name, int len)
+{
+	unsigned int h = 0;
+
+	while (len-- > 0) {
+		h = h * 31 + tolower(name[len]);
+	}
+	return h;
+}
+
+static inline unsigned int peer_sni_route_hashfn(unsigned int hash, int wildcard)
+{
+	return jhash_2words(hash, wildcard, peer_sni_route_rnd) % PEER_SNI_ROUTE_HASH_SIZE;
+}
+
+/* called with rcu_read_lock or peer_sni_route_lock held */
+static struct peer_sni_rule *peer_sni_route_find(const char *name, int len, unsigned int hash, int wildcard)
+{
+	struct peer_sni_rule *rule;
+
+	hlist_for_each_entry_rcu(rule, &peer_sni_route_hash[peer_sni_route_hashfn(hash, wildcard)], hnode) {
+		if (rule->hash == hash && rule->wildcard == wildcard && rule->len == len &&
+				strncasecmp(rule->name, name, len) == 0) {
+			return rule;
+		}
+	}
+	return NULL;
+}
+
+/* called with rcu_read_lock held */
+static struct peer_sni_rule *peer_sni_route_lookup(const char *name, int len)
+{
+	struct peer_sni_rule *rule;
+	unsigned int hash = 0;
+	unsigned int suffix_hash[PEER_SNI_ROUTE_LABELS];
+	int suffix_off[PEER_SNI_ROUTE_LABELS];
+	int i, n = 0;
+
+	if (len <= 0 || len > PEER_SNI_NAME_MAX)
+		return NULL;
+
+	for (i = len - 1; i >= 0; i--) {
+		if (name[i] == '.' && i + 1 < len && n < PEER_SNI_ROUTE_LABELS) {
+			suffix_hash[n] = hash;
+			suffix_off[n] = i + 1;
+			n++;
+		}
+		hash = hash * 31 + tolower(name[i]);
+	}
+
+	rule = peer_sni_route_find(name, len, hash, 0);
+	while (rule == NULL && n-- > 0) {
+		rule = peer_sni_route_find(name + suffix_off[n], len - suffix_off[n], suffix_hash[n], 1);
+	}
+	if (rule == NULL) {
+		rule = peer_sni_route_find(name, 0, 0, 1);
+	}
+	if (rule != NULL) {
+		atomic_long_inc(&rule->hits);
+	}
+
+	return rule;
+}
+
+static int peer_sni_route_add(const char *host, __be32 ip, __be16 port)
+{
+	int i, len;
+	int wildcard = 0;
+	struct peer_sni_rule *rule, *old;
+
+	if (strcmp(host, "*") == 0) {
+		host += 1;
+		wildcard = 1;
+	} else if (strncmp(host, "*.", 2) == 0) {
+		host += 2;
+		wildcard = 1;
+	}
+	len = strlen(host);
+	if (len > PEER_SNI_NAME_MAX || (len == 0 && !wildcard)) {
+		return -EINVAL;
+	}
+	for (i = 0; i < len; i++) {
+		if (!isalnum(host[i]) && host[i] != '-' && host[i] != '.' && host[i] != '_') {
+			return -EINVAL;
+		}
+	}
+
+	rule = kmalloc(sizeof(struct peer_sni_rule) + len + 1, GFP_KERNEL);
+	if (rule == NULL) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < len; i++) {
+		rule->name[i] = tolower(host[i]);
+	}
+	rule->name[len] = 0;
+	rule->len = len;
+	rule->wildcard = wildcard;
+	rule->hash = peer_sni_name_hash(rule->name, len);
+	atomic_long_set(&rule->hits, 0);
+	rule->ip = ip;
+	rule->port = port;
+
+	spin_lock_bh(&peer_sni_route_lock);
+	old = peer_sni_route_find(rule->name, len, rule->hash, wildcard);
+	if (old != NULL) {
+		atomic_long_set(&rule->hits, atomic_long_read(&old->hits));
+		hlist_replace_rcu(&old->hnode, &rule->hnode);
+		spin_unlock_bh(&peer_sni_route_lock);
+		kfree_rcu(old, rcu);
+		return 0;
+	}
+	if (peer_sni_route_count >= MAX_PEER_SNI_ROUTE) {
+		spin_unlock_bh(&peer_sni_route_lock);
+		kfree(rule);
+		return -ENOSPC;
+	}
+	hlist_add_head_rcu(&rule->hnode, &peer_sni_route_hash[peer_sni_route_hashfn(rule->hash, wildcard)]);
+	peer_sni_route_count++;
+	spin_unlock_bh(&peer_sni_route_lock);
+
+	return 0;
+}
+
+static int peer_sni_route_del(const char *host)
+{
+	int len;
+	int wildcard = 0;
+	struct peer_sni_rule *rule;
+
+	if (strcmp(host, "*") == 0) {
+		host += 1;
+		wildcard = 1;
+	} else if (strncmp(host, "*.", 2) == 0) {
+		host += 2;
+		wildcard = 1;
+	}
+	len = strlen(host);
+	if (len > PEER_SNI_NAME_MAX) {
+		return -EINVAL;
+	}
+
+	spin_lock_bh(&peer_sni_route_lock);
+	rule = peer_sni_route_find(host, len, peer_sni_name_hash(host, len), wildcard);
+	if (rule == NULL) {
+		spin_unlock_bh(&peer_sni_route_lock);
+		return -ENOENT;
+	}
+	hlist_del_rcu(&rule->hnode);
+	peer_sni_route_count--;
+	spin_unlock_bh(&peer_sni_route_lock);
+	kfree_rcu(rule, rcu);
+
+	return 0;
+}
+
+static void peer_sni_route_cleanup(void)
+{
+	int i;
+	struct peer_sni_rule *rule;
+	struct hlist_node *n;
+
+	spin_lock_bh(&peer_sni_route_lock);
+	for (i = 0; i < PEER_SNI_ROUTE_HASH_SIZE; i++) {
+		hlist_for_each_entry_safe(rule, n, &peer_sni_route_hash[i], hnode) {
+			hlist_del_rcu(&rule->hnode);
+			kfree_rcu(rule, rcu);
+		}
+	}
+	peer_sni_route_count = 0;
+	spin_unlock_bh(&peer_sni_route_lock);
+}
+
+/* called with rcu_read_lock held */
+static struct peer_sni_rule *peer_sni_route_get(int idx)
+{
+	int i;
+	struct peer_sni_rule *rule;
+
+	for (i = 0; i < PEER_SNI_ROUTE_HASH_SIZE; i++) {
+		hlist_for_each_entry_rcu(rule, &peer_sni_route_hash[i], hnode) {
+			if (idx-- == 0)
+				return rule;
+		}
+	}
+	return NULL;
+}
+
+/* ClientHello parser fed with the tcp payload in seq order, a piece at a time,
+ * so the sni is found when the hello spans skb frags, tls records or tcp segments
+ */
+#define TLS_HELLO_MAX 16384
+
+#define TLS_HELLO_BAD -1
+#define TLS_HELLO_MORE 0
+#define TLS_HELLO_DONE 1
+
+enum {
+	TLS_HS_TYPE,
+	TLS_HS_LEN,
+	TLS_HS_SID_LEN,
+	TLS_HS_CS_LEN,
+	TLS_HS_CM_LEN,
+	TLS_HS_EXT_LEN,
+	TLS_EXT_TYPE,
+	TLS_EXT_LEN,
+	TLS_SNI_LIST_LEN,
+	TLS_SNI_TYPE,
+	TLS_SNI_LEN,
+	TLS_SNI_NAME,
+	TLS_SKIP,
+};
+
+struct tls_hello_parser {
+	unsigned char state;
+	unsigned char next; //state after TLS_SKIP
+	unsigned char next_need;
+	unsigned char rec_hdr; //bytes of the record header read
+	unsigned short rec_len;
+	unsigned short rec_left; //payload bytes left in the record
+	unsigned int need; //bytes left for the state
+	unsigned int val;
+	unsigned int hs_left; //bytes left in the hello body
+	unsigned int ext_left; //bytes left in the extensions, 0 before TLS_HS_EXT_LEN
+	unsigned short ext_type;
+	unsigned char name_type;
+	unsigned char in_ext;
+	unsigned short sni_len;
+	unsigned char sni[PEER_SNI_NAME_MAX + 1];
+};
+
+static inline void tls_hello_init(struct tls_hello_parser *tp)
+{
+	memset(tp, 0, offsetof(struct tls_hello_parser, sni));
+	tp->state = TLS_HS_TYPE;
+	tp->need = 1;
+}
+
+static inline void tls_hello_skip(struct tls_hello_parser *tp, unsigned int len, int next, int next_need)
+{
+	if (len == 0) {
+		tp->state = next;
+		tp->need = next_need;
+		return;
+	}
+	tp->state = TLS_SKIP;
+	tp->need = len;
+	tp->next = next;
+	tp->next_need = next_need;
+}
+
+/* the field of tp->state is read, tp->val holds it */
+static int tls_hello_next(struct tls_hello_parser *tp)
+{
+	unsigned int val = tp->val;
+
+	tp->val = 0;
+	switch (tp->state) {
+	case TLS_HS_TYPE:
+		if (val != 0x01) //HandShake Type NOT Client Hello
+			return TLS_HELLO_BAD;
+		tp->state = TLS_HS_LEN;
+		tp->need = 3;
+		break;
+	case TLS_HS_LEN:
+		if (val > TLS_HELLO_MAX)
+			return TLS_HELLO_BAD;
+		tp->hs_left = val;
+		tls_hello_skip(tp, 2 + 32, TLS_HS_SID_LEN, 1); //tls_v, random
+		break;
+	case TLS_HS_SID_LEN:
+		tls_hello_skip(tp, val, TLS_HS_CS_LEN, 2);
+		break;
+	case TLS_HS_CS_LEN:
+		tls_hello_skip(tp, val, TLS_HS_CM_LEN, 1);
+		break;
+	case TLS_HS_CM_LEN:
+		tls_hello_skip(tp, val, TLS_HS_EXT_LEN, 2);
+		break;
+	case TLS_HS_EXT_LEN:
+		if (val > tp->hs_left)
+			return TLS_HELLO_BAD;
+		tp->ext_left = val;
+		tp->in_ext = 1;
+		tp->state = TLS_EXT_TYPE;
+		tp->need = 2;
+		break;
+	case TLS_EXT_TYPE:
+		tp->ext_type = val;
+		tp->state = TLS_EXT_LEN;
+		tp->need = 2;
+		break;
+	case TLS_EXT_LEN:
+		if (tp->ext_type == 0) { //server_name
+			tp->state = TLS_SNI_LIST_LEN;
+			tp->need = 2;
+			break;
+		}
+		tls_hello_skip(tp, val, TLS_EXT_TYPE, 2);
+		break;
+	case TLS_SNI_LIST_LEN:
+		tp->state = TLS_SNI_TYPE;
+		tp->need = 1;
+		break;
+	case TLS_SNI_TYPE:
+		tp->name_type = val;
+		tp->state = TLS_SNI_LEN;
+		tp->need = 2;
+		break;
+	case TLS_SNI_LEN:
+		if (tp->name_type != 0) {
+			tls_hello_skip(tp, val, TLS_SNI_TYPE, 1);
+			break;
+		}
+		if (val == 0 || val > PEER_SNI_NAME_MAX)
+			return TLS_HELLO_BAD;
+		tp->sni_len = 0;
+		tp->state = TLS_SNI_NAME;
+		tp->need = val;
+		break;
+	case TLS_SNI_NAME:
+		tp->sni[tp->sni_len] = 0;
+		return TLS_HELLO_DONE;
+	case TLS_SKIP:
+		tp->state = tp->next;
+		tp->need = tp->next_need;
+		break;
+	default:
+		return TLS_HELLO_BAD;
+	}
+
+	return TLS_HELLO_MORE;
+}
+
+/* feed the handshake bytes of one tls record */
+static int tls_hello_feed(struct tls_hello_parser *tp, const unsigned char *data, unsigned int len)
+{
+	int ret;
+	unsigned int i, n;
+
+	while (len > 0) {
+		n = tp->need < len ? tp->need : len;
+		if (tp->state > TLS_HS_LEN && n > tp->hs_left)
+			n = tp->hs_left;
+		if (tp->in_ext && n > tp->ext_left)
+			n = tp->ext_left;
+		if (n == 0) //the field runs out of the hello or of the extensions, no sni
+			return TLS_HELLO_BAD;
+
+		switch (tp->state) {
+		case TLS_SKIP:
+			break;
+		case TLS_SNI_NAME:
+			memcpy(tp->sni + tp->sni_len, data, n);
+			tp->sni_len += n;
+			break;
+		default:
+			for (i = 0; i < n; i++) {
+				tp->val = (tp->val << 8) | data[i];
+			}
+			break;
+		}
+
+		if (tp->state > TLS_HS_LEN)
+			tp->hs_left -= n;
+		if (tp->in_ext)
+			tp->ext_left -= n;
+		tp->need -= n;
+		data += n;
+		len -= n;
+
+		if (tp->need == 0) {
+			ret = tls_hello_next(tp);
+			if (ret != TLS_HELLO_MORE)
+				return ret;
+			//the hello ends without sni, do not wait for the bytes that never come
+			if ((tp->state > TLS_HS_LEN && tp->hs_left == 0) || (tp->in_ext && tp->ext_left == 0))
+				return TLS_HELLO_BAD;
+		}
+	}
+
+	return TLS_HELLO_MORE;
+}
+
+/* feed the tcp payload, the tls record headers are stripped here */
+static int tls_hello_parse(struct tls_hello_parser *tp, const unsigned char *data, unsigned int len)
+{
+	int ret;
+	unsigned int n;
+
+	while (len > 0) {
+		if (tp->rec_left == 0) {
+			switch (tp->rec_hdr) {
+			case 0:
+				if (data[0] != 0x16) //Content Type NOT HandShake
+					return TLS_HELLO_BAD;
+				break;
+			case 3:
+				tp->rec_len = data[0] << 8;
+				break;
+			case 4:
+				tp->rec_len |= data[0];
+				if (tp->rec_len == 0)
+					return TLS_HELLO_BAD;
+				tp->rec_left = tp->rec_len;
+				tp->rec_hdr = 0;
+				data++;
+				len--;
+				continue;
+			}
+			tp->rec_hdr++;
+			data++;
+			len--;
+			continue;
+		}
+
+		n = tp->rec_left < len ? tp->rec_left : len;
+		ret = tls_hello_feed(tp, data, n);
+		if (ret != TLS_HELLO_MORE)
+			return ret;
+		tp->rec_left -= n;
+		data += n;
+		len -= n;
+	}
 
-	nskb->ip_summed = CHECKSUM_UNNECESSARY;
-	skb_rcsum_tcpudp(nskb);
+	return TLS_HELLO_MORE;
+}
 
-	skb_push(nskb, (char *)niph - (char *)neth);
-	nskb->dev = (struct net_device *)dev;
+/* feed len bytes at off of skb, the skb can be non-linear */
+static int tls_hello_parse_skb(struct tls_hello_parser *tp, const struct sk_buff *skb, unsigned int off, unsigned int len)
+{
+	int ret;
+	unsigned int n;
+	unsigned char buf[64];
+	const unsigned char *data;
+
+	while (len > 0) {
+		if (off < skb_headlen(skb)) {
+			n = skb_headlen(skb) - off;
+			if (n > len)
+				n = len;
+			data = skb->data + off;
+		} else {
+			n = len < sizeof(buf) ? len : sizeof(buf);
+			data = skb_header_pointer(skb, off, n, buf);
+			if (data == NULL)
+				return TLS_HELLO_BAD;
+		}
+		ret = tls_hello_parse(tp, data, n);
+		if (ret != TLS_HELLO_MORE)
+			return ret;
+		off += n;
+		len -= n;
+	}
 
-	dev_queue_xmit(nskb);
-	return 0;
+	return TLS_HELLO_MORE;
+}
+
+/* a ClientHello to the sni listener whose sni is not parsed yet, its segments are held
+ * in the peer_cache keyed by the flow until the rest of the hello comes
+ */
+struct peer_hello {
+	struct peer_cache_node pc; //pc.user is NULL
+	struct sk_buff *tail;
+	__be32 saddr;
+	__be32 daddr;
+	__be16 sport;
+	__be16 dport;
+	unsigned int seq; //seq of the first hello byte
+	unsigned int len; //hello bytes parsed
+	unsigned short mss; //client mss from the isn of our synack
+	struct tls_hello_parser tp;
+};
+
+static unsigned int peer_hello_rnd __read_mostly;
+
+static inline struct peer_cache_bucket *peer_hello_bucket(__be32 saddr, __be32 daddr, __be16 sport, __be16 dport)
+{
+	return &peer_cache[jhash_3words(saddr, daddr, ((__force u32)sport << 16) | (__force u32)dport, peer_hello_rnd) % PEER_CACHE_HASH_SIZE];
 }
 
-unsigned char *tls_sni_search(unsigned char *data, int *data_len)
+static struct peer_hello *peer_hello_alloc(struct iphdr *iph, void *l4)
 {
-	unsigned char *p = data;
-	int p_len = *data_len;
-	int i = 0;
-	unsigned short len;
+	struct peer_hello *ph;
 
-	if (p[i + 0] != 0x16) {//Content Type NOT HandShake
+	ph = kmalloc(sizeof(struct peer_hello), GFP_ATOMIC);
+	if (ph == NULL) {
+		atomic_long_inc(&peer_cache_drops);
 		return NULL;
 	}
-	i += 1 + 2; if (i >= p_len) return NULL;
-	len = ntohs(get_byte2(p + i + 0)); //content_len
-	i += 2; if (i >= p_len) return NULL;
-	if (i + len > p_len) return NULL;
+	ph->pc.user = NULL;
+	ph->pc.skb = NULL;
+	ph->pc.truesize = 0;
+	ph->tail = NULL;
+	ph->saddr = iph->saddr;
+	ph->daddr = iph->daddr;
+	ph->sport = TCPH(l4)->source;
+	ph->dport = TCPH(l4)->dest;
+	ph->seq = ntohl(TCPH(l4)->seq);
+	ph->len = 0;
+	ph->mss = peer_sni_mss_decode(ntohl(TCPH(l4)->ack_seq) - 1);
+	tls_hello_init(&ph->tp);
+	atomic_inc(&peer_cache_entries);
+
+	return ph;
+}
 
-	p = p + i;
-	p_len = len;
-	i = 0;
+/* unlink the pending hello of the flow from peer_cache, the caller owns it then */
+static struct peer_hello *peer_hello_take(struct iphdr *iph, void *l4)
+{
+	struct peer_cache_node *pc;
+	struct peer_hello *ph;
+	struct peer_cache_bucket *pb = peer_hello_bucket(iph->saddr, iph->daddr, TCPH(l4)->source, TCPH(l4)->dest);
 
-	if (p[i + 0] != 0x01) { //HanShake Type NOT Client Hello
+	if (list_empty(&pb->head))
 		return NULL;
-	}
-	i += 1; if (i >= p_len) return NULL;
-	len = (p[i + 0] << 8) + ntohs(get_byte2(p + i + 0 + 1)); //hanshake_len
-	i += 1 + 2; if (i >= p_len) return NULL;
-	if (i + len > p_len) return NULL;
 
-	p = p + i;
-	p_len = len;
-	i = 0;
+	spin_lock_bh(&pb->lock);
+	list_for_each_entry(pc, &pb->head, list) {
+		if (pc->user != NULL)
+			continue;
+		ph = container_of(pc, struct peer_hello, pc);
+		if (ph->saddr == iph->saddr && ph->daddr == iph->daddr &&
+				ph->sport == TCPH(l4)->source && ph->dport == TCPH(l4)->dest) {
+			list_del(&pc->list);
+			spin_unlock_bh(&pb->lock);
+			return ph;
+		}
+	}
+	spin_unlock_bh(&pb->lock);
 
-	i += 2 + 32; if (i >= p_len) return NULL; //tls_v, random
-	i += 1 + p[i + 0]; if (i >= p_len) return NULL; //session id
-	i += 2 + ntohs(get_byte2(p + i + 0)); if (i >= p_len) return NULL; //Cipher Suites
-	i += 1 + p[i + 0]; if (i >= p_len) return NULL; //Compression Methods
+	return NULL;
+}
 
-	len = ntohs(get_byte2(p + i + 0)); //ext_len
-	i += 2;
-	if (i + len > p_len) return NULL;
+static void peer_hello_put(struct peer_hello *ph)
+{
+	struct peer_cache_bucket *pb = peer_hello_bucket(ph->saddr, ph->daddr, ph->sport, ph->dport);
 
-	p = p + i;
-	p_len = len;
-	i = 0;
+	ph->pc.jiffies = jiffies;
+	spin_lock_bh(&pb->lock);
+	list_add_tail(&ph->pc.list, &pb->head);
+	spin_unlock_bh(&pb->lock);
+}
 
-	while (i < p_len) {
-		if (get_byte2(p + i + 0) != __constant_htons(0)) {
-			i += 2 + 2 + ntohs(get_byte2(p + i + 0 + 2));
-			continue;
-		}
-		len = ntohs(get_byte2(p + i + 0 + 2)); //sn_len
-		i = i + 2 + 2;
-		if (i + len > p_len) return NULL;
+static inline void peer_hello_free(struct peer_hello *ph)
+{
+	peer_cache_node_free(&ph->pc);
+}
 
-		p = p + i;
-		p_len = len;
-		i = 0;
-		break;
+static int peer_hello_hold(struct peer_hello *ph, struct sk_buff *skb)
+{
+	if ((unsigned int)atomic_add_return(skb->truesize, &peer_cache_mem) > peer_cache_mem_limit) {
+		atomic_sub(skb->truesize, &peer_cache_mem);
+		atomic_long_inc(&peer_cache_drops);
+		return -1;
 	}
-	if (i >= p_len) return NULL;
-
-	len = ntohs(get_byte2(p + i + 0)); //snl_len
-	i += 2;
-	if (i + len > p_len) return NULL;
+	ph->pc.truesize += skb->truesize;
+	skb->next = NULL;
+	if (ph->tail != NULL) {
+		ph->tail->next = skb;
+	} else {
+		ph->pc.skb = skb;
+	}
+	ph->tail = skb;
+	return 0;
+}
 
-	p = p + i;
-	p_len = len;
-	i = 0;
+/* skb is the last segment of the hello of ph, turn it to the syn of the flow
+ * return the held segments followed by a copy of skb, in seq order
+ */
+static struct sk_buff *peer_sni_hello_to_syn(struct sk_buff *skb, struct peer_hello *ph, unsigned short mss)
+{
+	struct sk_buff *cache_skb;
 
-	while (i < p_len) {
-		if (p[i + 0] != 0) {
-			i += 1 + 2 + ntohs(get_byte2(p + i + 0 + 1));
-			continue;
-		}
-		len = ntohs(get_byte2(p + i + 0 + 1));
-		i += 1 + 2;
-		if (i + len > p_len) return NULL;
+	cache_skb = peer_sni_to_syn(skb, mss, ph->seq);
+	if (cache_skb == NULL)
+		return NULL;
 
-		*data_len = len;
-		return (p + i);
+	if (ph->pc.skb != NULL) {
+		ph->tail->next = cache_skb;
+		cache_skb = ph->pc.skb;
+		atomic_sub(ph->pc.truesize, &peer_cache_mem);
+		ph->pc.truesize = 0;
+		ph->pc.skb = NULL;
+		ph->tail = NULL;
 	}
 
-	return NULL;
+	return cache_skb;
 }
 
 static inline void sni_ack_pass_back(struct sk_buff *oskb, struct sk_buff *cache_skb, struct nf_conn *ct, const struct net_device *dev)
@@ -1402,7 +2486,7 @@ static inline void sni_ack_pass_back(struct sk_buff *oskb, struct sk_buff *cache
 	skb_rcsum_tcpudp(nskb);
 	nf_reset(nskb);
 
-	nf_conntrack_in(&init_net, PF_INET, NF_INET_PRE_ROUTING, nskb);
+	nf_conntrack_in(nf_ct_net(ct), PF_INET, NF_INET_PRE_ROUTING, nskb);
 	nf_conntrack_confirm(nskb);
 
 	oiph = ip_hdr(oskb);
@@ -1423,8 +2507,8 @@ static inline void sni_ack_pass_back(struct sk_buff *oskb, struct sk_buff *cache
 }
 
 
-static inline void sni_cache_skb_pass_back(struct sk_buff *oskb, struct sk_buff *cache_skb,
-		struct nf_conn *ct, const struct net_device *dev, enum ip_conntrack_info ctinfo)
+static inline int sni_cache_skb_pass_back_one(struct sk_buff *oskb, struct sk_buff *cache_skb,
+		struct nf_conn *ct, const struct net_device *dev, unsigned int isn)
 {
 	struct sk_buff *nskb;
 	struct ethhdr *neth, *oeth;
@@ -1432,10 +2516,8 @@ static inline void sni_cache_skb_pass_back(struct sk_buff *oskb, struct sk_buff
 	struct tcphdr *ntcph, *otcph;
 	int offset, add_len;
 
-	if (cache_skb == NULL)
-		return;
 	if (!skb_make_writable(cache_skb, ntohs(ip_hdr(cache_skb)->tot_len))) {
-		return;
+		return -1;
 	}
 
 	oeth = (struct ethhdr *)skb_mac_header(oskb);
@@ -1445,7 +2527,7 @@ static inline void sni_cache_skb_pass_back(struct sk_buff *oskb, struct sk_buff
 	nskb = skb_copy_expand(oskb, skb_headroom(oskb), skb_tailroom(oskb) + add_len, GFP_ATOMIC);
 	if (!nskb) {
 		NATCAP_ERROR(DEBUG_FMT_PREFIX "alloc_skb fail\n", DEBUG_ARG_PREFIX);
-		return;
+		return -1;
 	}
 	nskb->tail += offset;
 	nskb->len = ntohs(ip_hdr(cache_skb)->tot_len);
@@ -1461,18 +2543,18 @@ static inline void sni_cache_skb_pass_back(struct sk_buff *oskb, struct sk_buff
 	niph = ip_hdr(nskb);
 	memcpy(niph, oiph, nskb->len);
 
-	ntcph = (struct tcphdr *)((char *)niph + sizeof(struct iphdr));
+	ntcph = (struct tcphdr *)((char *)niph + niph->ihl * 4);
 
 	nskb->ip_summed = CHECKSUM_UNNECESSARY;
 	skb_rcsum_tcpudp(nskb);
 	nf_reset(nskb);
 
-	nf_conntrack_in(&init_net, PF_INET, NF_INET_PRE_ROUTING, nskb);
+	nf_conntrack_in(nf_ct_net(ct), PF_INET, NF_INET_PRE_ROUTING, nskb);
 	nf_conntrack_confirm(nskb);
 
 	oiph = ip_hdr(oskb);
 	otcph = (struct tcphdr *)((void *)oiph + oiph->ihl * 4);
-	ntcph->seq = otcph->ack_seq;
+	ntcph->seq = htonl(ntohl(otcph->ack_seq) + (ntohl(ntcph->seq) - isn));
 	ntcph->ack_seq = htonl(ntohl(otcph->seq) + 1);
 
 	niph->saddr = ct->tuplehash[IP_CT_DIR_REPLY].tuple.dst.u3.ip;
@@ -1485,6 +2567,174 @@ static inline void sni_cache_skb_pass_back(struct sk_buff *oskb, struct sk_buff
 	nskb->dev = (struct net_device *)dev;
 	nf_reset(nskb);
 	dev_queue_xmit(nskb);
+	return 0;
+}
+
+/* pass the cached segments of the hello to the target, each at its offset from the first */
+static inline void sni_cache_skb_pass_back(struct sk_buff *oskb, struct sk_buff *cache_skb,
+		struct nf_conn *ct, const struct net_device *dev, enum ip_conntrack_info ctinfo)
+{
+	struct iphdr *oiph;
+	unsigned int isn;
+
+	if (cache_skb == NULL)
+		return;
+
+	oiph = ip_hdr(cache_skb);
+	isn = ntohl(TCPH((void *)oiph + oiph->ihl * 4)->seq);
+	for (; cache_skb != NULL; cache_skb = cache_skb->next) {
+		if (sni_cache_skb_pass_back_one(oskb, cache_skb, ct, dev, isn) != 0)
+			return;
+	}
+}
+
+/* turn the hello of ph ending in skb to the syn towards ip:port, the hello is cached
+ * until peer_sni_synack_pass_back gets the synack of the backend
+ */
+static unsigned int peer_sni_route_in(struct net *net, u_int8_t pf, struct sk_buff *skb, struct peer_hello *ph, __be32 ip, __be16 port)
+{
+	int ret;
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct;
+	struct natcap_session *ns;
+	struct sk_buff *cache_skb;
+	struct iphdr *iph;
+	void *l4;
+
+	cache_skb = peer_sni_hello_to_syn(skb, ph, ph->mss);
+	iph = ip_hdr(skb);
+	l4 = (void *)iph + iph->ihl * 4;
+	if (cache_skb == NULL) {
+		NATCAP_WARN("(PPI)" DEBUG_TCP_FMT ": tls sni route: peer_sni_hello_to_syn failed\n", DEBUG_TCP_ARG(iph,l4));
+		goto out;
+	}
+
+	ret = nf_conntrack_in(net, pf, NF_INET_PRE_ROUTING, skb);
+	if (ret != NF_ACCEPT) {
+		NATCAP_WARN("(PPI)" DEBUG_TCP_FMT ": tls sni route: nf_conntrack_in fail=%d\n", DEBUG_TCP_ARG(iph,l4), ret);
+		peer_cache_skb_free(cache_skb);
+		goto out;
+	}
+	ct = nf_ct_get(skb, &ctinfo);
+	if (NULL == ct) {
+		NATCAP_WARN("(PPI)" DEBUG_TCP_FMT ": tls sni route: ct is NULL\n", DEBUG_TCP_ARG(iph,l4));
+		peer_cache_skb_free(cache_skb);
+		goto out;
+	}
+	ns = natcap_session_in(ct);
+	if (!ns) {
+		NATCAP_WARN("(PPI)" DEBUG_TCP_FMT ": tls sni route: natcap_session_in failed\n", DEBUG_TCP_ARG(iph,l4));
+		peer_cache_skb_free(cache_skb);
+		goto out;
+	}
+	//without the cached hello the handshake can not be finished
+	if (peer_cache_attach(ct, cache_skb) != 0) {
+		NATCAP_WARN("(PPI)" DEBUG_TCP_FMT ": tls sni route: peer_cache_attach failed\n", DEBUG_TCP_ARG(iph,l4));
+		peer_cache_skb_free(cache_skb);
+		goto out;
+	}
+	if (!(ns->p.status & NS_PEER_SNI_ROUTE)) short_set_bit(NS_PEER_SNI_ROUTE_BIT, &ns->p.status);
+
+	ret = natcap_dnat_setup(ct, ip, port);
+	if (ret != NF_ACCEPT) {
+		NATCAP_ERROR("(PPI)" DEBUG_TCP_FMT ": natcap_dnat_setup failed, backend=%pI4:%u\n", DEBUG_TCP_ARG(iph,l4), &ip, ntohs(port));
+		goto out;
+	}
+	xt_mark_natcap_set(XT_MARK_NATCAP, &skb->mark);
+	if (!(IPS_NATFLOW_FF_STOP & ct->status)) set_bit(IPS_NATFLOW_FF_STOP_BIT, &ct->status);
+	if (!(IPS_NATCAP_BYPASS & ct->status)) set_bit(IPS_NATCAP_BYPASS_BIT, &ct->status);
+
+	return NF_ACCEPT;
+
+out:
+	consume_skb(skb);
+	return NF_STOLEN;
+}
+
+/* skb is the synack of the target of a sni ct, finish the handshake of the target
+ * and pass it the cached hello, the client got its synack from peer_sni_send_synack
+ */
+static void peer_sni_synack_pass_back(struct net *net, struct sk_buff *skb, struct nf_conn *user, const struct net_device *in)
+{
+	int ret;
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct;
+	struct sk_buff *cache_skb;
+	struct iphdr *iph = ip_hdr(skb);
+	void *l4 = (void *)iph + iph->ihl * 4;
+
+	ret = nf_conntrack_in(net, PF_INET, NF_INET_PRE_ROUTING, skb);
+	if (ret != NF_ACCEPT) {
+		NATCAP_WARN("(PPI)" DEBUG_TCP_FMT ": https sni synack, nf_conntrack_in fail=%d\n", DEBUG_TCP_ARG(iph,l4), ret);
+		return;
+	}
+	ct = nf_ct_get(skb, &ctinfo);
+	if (ct == NULL || ct != user) {
+		NATCAP_WARN("(PPI)" DEBUG_TCP_FMT ": https sni synack, ct=%p, user=%p mismatch\n", DEBUG_TCP_ARG(iph,l4), ct, user);
+		return;
+	}
+	ret = nf_conntrack_confirm(skb);
+	if (ret != NF_ACCEPT) {
+		NATCAP_WARN("(PPI)" DEBUG_TCP_FMT ": https sni synack, nf_conntrack_confirm fail=%d\n", DEBUG_TCP_ARG(iph,l4), ret);
+		return;
+	}
+
+	cache_skb = peer_cache_detach(ct);
+	if (cache_skb == NULL) {
+		NATCAP_WARN("(PPI)" DEBUG_TCP_FMT ": https sni synack, peer_cache_detach got NULL\n", DEBUG_TCP_ARG(iph,l4));
+		return;
+	}
+	nf_ct_seqadj_init(ct, ctinfo, ntohl(TCPH((char *)ip_hdr(cache_skb) + sizeof(struct iphdr))->ack_seq) - 1 - ntohl(TCPH(l4)->seq));
+	sni_ack_pass_back(skb, cache_skb, ct, in);
+	sni_cache_skb_pass_back(skb, cache_skb, ct, in, ctinfo);
+	peer_cache_skb_free(cache_skb);
+}
+
+/* rewrite the pong in skb to the ICMP echo reply of one ping, skb must be linear */
+static int natcap_peer_echoreply_fill(struct sk_buff *skb, __be16 id, __be16 sequence, u16 payload_len, const u8 *timeval)
+{
+	struct iphdr *iph = ip_hdr(skb);
+	void *l4;
+	int offset, add_len;
+
+	if (payload_len > ICMP_PAYLOAD_LIMIT)
+		payload_len = ICMP_PAYLOAD_LIMIT;
+
+	offset = iph->ihl * 4 + sizeof(struct icmphdr) + payload_len - (skb_headlen(skb) + skb_tailroom(skb));
+	add_len = offset < 0 ? 0 : offset;
+	offset += skb_tailroom(skb);
+	if (add_len > 0 && pskb_expand_head(skb, 0, add_len, GFP_ATOMIC)) {
+		return -ENOMEM;
+	}
+	skb->tail += offset;
+	skb->len = iph->ihl * 4 + sizeof(struct icmphdr) + payload_len;
+
+	iph = ip_hdr(skb);
+	l4 = (void *)iph + iph->ihl * 4;
+
+	iph->protocol = IPPROTO_ICMP;
+	iph->check = 0;
+	iph->tot_len = htons(skb->len);
+
+	ICMPH(l4)->type = ICMP_ECHOREPLY;
+	ICMPH(l4)->code = 0;
+	ICMPH(l4)->un.echo.id = id;
+	ICMPH(l4)->un.echo.sequence = sequence;
+	ICMPH(l4)->checksum = 0;
+	if (payload_len >= 16) {
+		memcpy(l4 + sizeof(struct icmphdr), timeval, 16);
+		memset(l4 + sizeof(struct icmphdr) + 16, 0, payload_len - 16);
+	} else if (payload_len > 0) {
+		memcpy(l4 + sizeof(struct icmphdr), timeval, payload_len);
+	}
+
+	ip_fast_csum(iph, iph->ihl);
+	ICMPH(l4)->checksum = csum_fold(skb_checksum(skb, iph->ihl * 4, skb->len - iph->ihl * 4, 0));
+	skb->ip_summed = CHECKSUM_UNNECESSARY;
+	//set xmark to pass up
+	xt_mark_natcap_set(XT_MARK_NATCAP, &skb->mark);
+
+	return 0;
 }
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
@@ -1566,8 +2816,11 @@ static unsigned int natcap_peer_pre_in_hook(void *priv,
 		struct nf_conn *ct;
 		struct nf_conntrack_tuple tuple;
 		struct nf_conntrack_tuple_hash *h;
+		struct peer_hello *ph = NULL;
 		unsigned char *data;
 		int data_len;
+		int offset;
+		int ret;
 
 		if (hooknum != NF_INET_PRE_ROUTING || !inet_is_local(in, iph->daddr)) {
 			return NF_ACCEPT;
@@ -1597,17 +2850,62 @@ static unsigned int natcap_peer_pre_in_hook(void *priv,
 			consume_skb(skb);
 			return NF_STOLEN;
 		}
-		if (!skb_make_writable(skb, skb->len)) {
-			return NF_DROP;
+		data_len = ntohs(iph->tot_len) - (iph->ihl * 4 + TCPH(l4)->doff * 4);
+		if (data_len <= 0) {
+			goto sni_out;
 		}
-		iph = ip_hdr(skb);
-		l4 = (void *)iph + iph->ihl * 4;
 
-		data = skb->data + iph->ihl * 4 + TCPH(l4)->doff * 4;
-		data_len = ntohs(iph->tot_len) - (iph->ihl * 4 + TCPH(l4)->doff * 4);
-		data = tls_sni_search(data, &data_len);
+		//the hello may come in more than one segment, hold them until the sni is parsed
+		ph = peer_hello_take(iph, l4);
+		if (ph == NULL) {
+			ph = peer_hello_alloc(iph, l4);
+			if (ph == NULL) {
+				goto sni_out;
+			}
+		}
+		offset = (int)(ph->seq + ph->len - ntohl(TCPH(l4)->seq)); //bytes of this segment parsed already
+		if (offset < 0 || offset >= data_len) {
+			//a hole before this segment or a retransmission, the client sends it again
+			peer_hello_put(ph);
+			ph = NULL;
+			goto sni_out;
+		}
+		ret = tls_hello_parse_skb(&ph->tp, skb, iph->ihl * 4 + TCPH(l4)->doff * 4 + offset, data_len - offset);
+		ph->len += data_len - offset;
+		if (ret == TLS_HELLO_MORE) {
+			if (peer_hello_hold(ph, skb) != 0) {
+				goto sni_out;
+			}
+			peer_hello_put(ph);
+			return NF_STOLEN;
+		}
+		if (ret != TLS_HELLO_DONE) {
+			goto sni_out;
+		}
+		data = ph->tp.sni;
+		data_len = ph->tp.sni_len;
+
+		if (peer_sni_route_count != 0) {
+			__be32 ip = 0;
+			__be16 port = 0;
+			struct peer_sni_rule *rule;
+
+			rcu_read_lock();
+			rule = peer_sni_route_lookup((const char *)data, data_len);
+			if (rule != NULL) {
+				ip = rule->ip;
+				port = rule->port;
+			}
+			rcu_read_unlock();
+			if (ip != 0) {
+				NATCAP_INFO("(PPI)" DEBUG_TCP_FMT ": tls sni: route to %pI4:%u\n", DEBUG_TCP_ARG(iph,l4), &ip, ntohs(port));
+				ret = peer_sni_route_in(net, pf, skb, ph, ip, port);
+				peer_hello_free(ph);
+				return ret;
+			}
+		}
 
-		if (data && data_len > 15 && data[14] == '.') { //m-0b1a29384756.xxx.com
+		if (data_len > 15 && data[14] == '.') { //m-0b1a29384756.xxx.com
 			int n;
 			unsigned int a, b, c, d, e, f;
 			unsigned char client_mac[ETH_ALEN];
@@ -1617,8 +2915,7 @@ static unsigned int natcap_peer_pre_in_hook(void *priv,
 			n = sscanf(data, "m-%02X%02X%02X%02X%02X%02X.", &a, &b, &c, &d, &e, &f);
 			data[data_len] = x;
 			if (n != 6) {
-				consume_skb(skb);
-				return NF_STOLEN;
+				goto sni_out;
 			}
 			client_mac[0] = a;
 			client_mac[1] = b;
@@ -1628,7 +2925,6 @@ static unsigned int natcap_peer_pre_in_hook(void *priv,
 			client_mac[5] = f;
 
 			if (peer_sni_auth) {
-				int ret;
 				unsigned char old_mac[ETH_ALEN];
 				struct ethhdr *eth = eth_hdr(skb);
 				memcpy(old_mac, eth->h_source, ETH_ALEN);
@@ -1636,6 +2932,7 @@ static unsigned int natcap_peer_pre_in_hook(void *priv,
 				ret = IP_SET_test_src_mac(state, in, out, skb, "snilist");
 				memcpy(eth->h_source, old_mac, ETH_ALEN);
 				if (ret <= 0) {
+					peer_hello_free(ph);
 					return NF_DROP;
 				}
 			}
@@ -1653,10 +2950,7 @@ static unsigned int natcap_peer_pre_in_hook(void *priv,
 			h = nf_conntrack_find_get(net, &nf_ct_zone_dflt, &tuple);
 #endif
 			if (h) {
-				int i;
-				int ret;
 				struct tuple server;
-				unsigned long mindiff = peer_port_map_timeout * HZ;
 				struct sk_buff *cache_skb;
 				struct peer_tuple *pt = NULL;
 				struct natcap_session *ns;
@@ -1668,12 +2962,7 @@ static unsigned int natcap_peer_pre_in_hook(void *priv,
 				}
 
 				ue = peer_user_expect(user);
-				for (i = 0; i < MAX_PEER_TUPLE; i++) {
-					if (ue->tuple[i].connected && ue->tuple[i].sip != 0 && mindiff > uintdiff(jiffies, ue->tuple[i].last_active)) {
-						pt = &ue->tuple[i];
-						mindiff = uintdiff(jiffies, ue->tuple[i].last_active);
-					}
-				}
+				pt = peer_user_tuple_pick(ue);
 				if (pt == NULL) {
 					NATCAP_WARN("(PPI)" DEBUG_TCP_FMT ": no available port mapping for user[%02X:%02X:%02X:%02X:%02X:%02X]\n",
 							DEBUG_TCP_ARG(iph,l4),
@@ -1713,12 +3002,11 @@ static unsigned int natcap_peer_pre_in_hook(void *priv,
 					goto sni_out;
 				}
 
-				cache_skb = peer_sni_to_syn(skb, pt->mss);
+				cache_skb = peer_sni_hello_to_syn(skb, ph, pt->mss);
 				if (cache_skb == NULL) {
-					NATCAP_WARN("(PPI)" DEBUG_TCP_FMT ": tls sni: peer_sni_to_syn failed\n", DEBUG_TCP_ARG(iph,l4));
+					NATCAP_WARN("(PPI)" DEBUG_TCP_FMT ": tls sni: peer_sni_hello_to_syn failed\n", DEBUG_TCP_ARG(iph,l4));
 					spin_unlock_bh(&ue->lock);
 					nf_ct_put(user);
-					consume_skb(cache_skb);
 					goto sni_out;
 				}
 				iph = ip_hdr(cache_skb);
@@ -1729,7 +3017,7 @@ static unsigned int natcap_peer_pre_in_hook(void *priv,
 					NATCAP_WARN("(PPI)" DEBUG_TCP_FMT ": tls sni: nf_conntrack_in fail=%d\n", DEBUG_TCP_ARG(iph,l4), ret);
 					spin_unlock_bh(&ue->lock);
 					nf_ct_put(user);
-					consume_skb(cache_skb);
+					peer_cache_skb_free(cache_skb);
 					goto sni_out;
 				}
 				ct = nf_ct_get(skb, &ctinfo);
@@ -1737,7 +3025,7 @@ static unsigned int natcap_peer_pre_in_hook(void *priv,
 					NATCAP_WARN("(PPI)" DEBUG_TCP_FMT ": tls sni: ct is NULL\n", DEBUG_TCP_ARG(iph,l4));
 					spin_unlock_bh(&ue->lock);
 					nf_ct_put(user);
-					consume_skb(cache_skb);
+					peer_cache_skb_free(cache_skb);
 					goto sni_out;
 				}
 				ns = natcap_session_in(ct);
@@ -1745,12 +3033,12 @@ static unsigned int natcap_peer_pre_in_hook(void *priv,
 					NATCAP_WARN("(PPI)" DEBUG_TCP_FMT ": tls sni: natcap_session_in failed\n", DEBUG_TCP_ARG(iph,l4));
 					spin_unlock_bh(&ue->lock);
 					nf_ct_put(user);
-					consume_skb(cache_skb);
+					peer_cache_skb_free(cache_skb);
 					goto sni_out;
 				}
 				if (peer_cache_attach(ct, cache_skb) != 0) {
 					NATCAP_WARN("(PPI)" DEBUG_TCP_FMT ": tls sni: peer_cache_attach failed\n", DEBUG_TCP_ARG(iph,l4));
-					consume_skb(cache_skb);
+					peer_cache_skb_free(cache_skb);
 				}
 
 				server.ip = pt->sip;
@@ -1793,6 +3081,7 @@ static unsigned int natcap_peer_pre_in_hook(void *priv,
 				}
 
 				nf_ct_put(user);
+				peer_hello_free(ph);
 
 				return NF_ACCEPT;
 			}
@@ -1800,10 +3089,43 @@ static unsigned int natcap_peer_pre_in_hook(void *priv,
 		//got ack and payload is 0, drop ignore
 		//got ack with payload > 0, parse sni host, redirect to target(send syn), cache this pkt(wait for synack)
 sni_out:
+		if (ph != NULL) {
+			peer_hello_free(ph);
+		}
 		consume_skb(skb);
 		return NF_STOLEN;
 	}
 
+	if (TCPH(l4)->syn && TCPH(l4)->ack && hooknum == NF_INET_PRE_ROUTING && peer_sni_route_count != 0) {
+		//the synack of a sni route backend
+		struct nf_conntrack_tuple tuple;
+		struct nf_conntrack_tuple_hash *h;
+		memset(&tuple, 0, sizeof(tuple));
+		tuple.src.u3.ip = iph->saddr;
+		tuple.src.u.udp.port = TCPH(l4)->source;
+		tuple.dst.u3.ip = iph->daddr;
+		tuple.dst.u.udp.port = TCPH(l4)->dest;
+		tuple.src.l3num = PF_INET;
+		tuple.dst.protonum = IPPROTO_TCP;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
+		h = nf_conntrack_find_get(net, NF_CT_DEFAULT_ZONE, &tuple);
+#else
+		h = nf_conntrack_find_get(net, &nf_ct_zone_dflt, &tuple);
+#endif
+		if (h) {
+			struct nf_conn *user = nf_ct_tuplehash_to_ctrack(h);
+			struct natcap_session *ns = natcap_session_get(user);
+			if (ns && (ns->p.status & NS_PEER_SNI_ROUTE) && ns->p.cache_index != 0 && NF_CT_DIRECTION(h) == IP_CT_DIR_REPLY) {
+				NATCAP_INFO("(PPI)" DEBUG_TCP_FMT ": got sni route synack\n", DEBUG_TCP_ARG(iph,l4));
+				peer_sni_synack_pass_back(net, skb, user, in);
+				consume_skb(skb);
+				nf_ct_put(user);
+				return NF_STOLEN;
+			}
+			nf_ct_put(user);
+		}
+	}
+
 	tcpopt = natcap_peer_decode_header(TCPH(l4));
 	if (tcpopt == NULL) {
 		return NF_ACCEPT;
@@ -1902,7 +3224,6 @@ sni_out:
 
 				//pass up to icmp
 				do {
-					int offset, add_len;
 					u8 timeval[16] = { };
 					__be16 id = get_byte2((const void *)&tcpopt->peer.data.icmp_id);
 					__be16 sequence = get_byte2((const void *)&tcpopt->peer.data.icmp_sequence);
@@ -1919,43 +3240,42 @@ sni_out:
 							16 + ALIGN(sizeof(struct natcap_TCPOPT_header) + sizeof(struct natcap_TCPOPT_peer), sizeof(unsigned int))) {
 						memcpy(timeval, tcpopt->peer.data.timeval, 16);
 					}
-					if (payload_len > ICMP_PAYLOAD_LIMIT)
-						payload_len = ICMP_PAYLOAD_LIMIT;
-
-					offset = iph->ihl * 4 + sizeof(struct icmphdr) + payload_len - (skb_headlen(skb) + skb_tailroom(skb));
-					add_len = offset < 0 ? 0 : offset;
-					offset += skb_tailroom(skb);
-					if (add_len > 0 && pskb_expand_head(skb, 0, add_len, GFP_ATOMIC)) {
-						NATCAP_ERROR("(PPI)" DEBUG_TCP_FMT ": pskb_expand_head failed add_len=%u\n", DEBUG_TCP_ARG(iph,l4), add_len);
-						goto h_out;
-					}
-					skb->tail += offset;
-					skb->len = iph->ihl * 4 + sizeof(struct icmphdr) + payload_len;
-
-					iph = ip_hdr(skb);
-					l4 = (void *)iph + iph->ihl * 4;
-
-					iph->protocol = IPPROTO_ICMP;
-					iph->check = 0;
-					iph->tot_len = htons(skb->len);
-
-					ICMPH(l4)->type = ICMP_ECHOREPLY;
-					ICMPH(l4)->code = 0;
-					ICMPH(l4)->un.echo.id = id;
-					ICMPH(l4)->un.echo.sequence = sequence;
-					ICMPH(l4)->checksum = 0;
-					if (payload_len >= 16) {
-						memcpy(l4 + sizeof(struct icmphdr), timeval, 16);
-						memset(l4 + sizeof(struct icmphdr) + 16, 0, payload_len - 16);
-					} else if (payload_len > 0) {
-						memcpy(l4 + sizeof(struct icmphdr), timeval, payload_len);
+
+					if (NATCAP_TCPOPT_TYPE(tcpopt->header.type) == NATCAP_TCPOPT_TYPE_PEER_BATCH) {
+						//one echo reply for each coalesced record, before skb itself is rewritten
+						struct natcap_peer_ping_rec rec;
+						struct sk_buff *nskb;
+						unsigned int rec_off = iph->ihl * 4 + TCPH(l4)->doff * 4;
+						unsigned int rec_cnt = 0;
+
+						while (rec_off + sizeof(struct natcap_peer_ping_rec) <= skb->len && rec_cnt < PEER_PING_BATCH_MAX) {
+							if (skb_copy_bits(skb, rec_off, &rec, sizeof(struct natcap_peer_ping_rec)) != 0)
+								break;
+							if (ntohs(get_byte2((const void *)&rec.len)) < sizeof(struct natcap_peer_ping_rec))
+								break;
+							rec_off += ntohs(get_byte2((const void *)&rec.len));
+							rec_cnt++;
+
+							nskb = skb_copy(skb, GFP_ATOMIC);
+							if (nskb == NULL) {
+								NATCAP_ERROR("(PPI)" DEBUG_TCP_FMT ": alloc_skb fail\n", DEBUG_TCP_ARG(iph,l4));
+								break;
+							}
+							if (natcap_peer_echoreply_fill(nskb, get_byte2((const void *)&rec.icmp_id), get_byte2((const void *)&rec.icmp_sequence),
+										ntohs(get_byte2((const void *)&rec.icmp_payload_len)), rec.timeval) != 0) {
+								consume_skb(nskb);
+								break;
+							}
+							NF_OKFN(nskb);
+						}
+						NATCAP_DEBUG("(PPI)" DEBUG_TCP_FMT ": got pong(ack) with %u coalesced echoes\n", DEBUG_TCP_ARG(iph,l4), rec_cnt);
 					}
 
-					ip_fast_csum(iph, iph->ihl);
-					ICMPH(l4)->checksum = csum_fold(skb_checksum(skb, iph->ihl * 4, skb->len - iph->ihl * 4, 0));
-					skb->ip_summed = CHECKSUM_UNNECESSARY;
-					//set xmark to pass up
-					xt_mark_natcap_set(XT_MARK_NATCAP, &skb->mark);
+					if (natcap_peer_echoreply_fill(skb, id, sequence, payload_len, timeval) != 0) {
+						NATCAP_ERROR("(PPI)" DEBUG_TCP_FMT ": pskb_expand_head failed\n", DEBUG_TCP_ARG(iph,l4));
+						consume_skb(skb);
+						return NF_STOLEN;
+					}
 				} while (0);
 				return NF_ACCEPT;
 			}
@@ -2069,38 +3389,8 @@ syn_out:
 					if (ns->p.remote_mss)
 						natcap_tcpmss_set(skb, TCPH(l4), ns->p.remote_mss);
 					if (ns->p.cache_index != 0) {
-						int ret;
-						enum ip_conntrack_info ctinfo;
-						struct nf_conn *ct;
-						struct sk_buff *cache_skb;
-
 						NATCAP_INFO("(PPI)" DEBUG_TCP_FMT ": FACK https sni\n", DEBUG_TCP_ARG(iph,l4));
-						ret = nf_conntrack_in(&init_net, PF_INET, NF_INET_PRE_ROUTING, skb);
-						if (ret != NF_ACCEPT) {
-							NATCAP_WARN("(PPI)" DEBUG_TCP_FMT ": FACK https sni, nf_conntrack_in fail=%d\n", DEBUG_TCP_ARG(iph,l4), ret);
-							goto sni_skip;
-						}
-						ct = nf_ct_get(skb, &ctinfo);
-						if (ct == NULL || ct != user) {
-							NATCAP_WARN("(PPI)" DEBUG_TCP_FMT ": FACK https sni, ct=%p, user=%p mismatch\n", DEBUG_TCP_ARG(iph,l4), ct, user);
-							goto sni_skip;
-						}
-						ret = nf_conntrack_confirm(skb);
-						if (ret != NF_ACCEPT) {
-							NATCAP_WARN("(PPI)" DEBUG_TCP_FMT ": FACK https sni, nf_conntrack_confirm fail=%d\n", DEBUG_TCP_ARG(iph,l4), ret);
-							goto sni_skip;
-						}
-
-						cache_skb = peer_cache_detach(ct);
-						if (cache_skb == NULL) {
-							NATCAP_WARN("(PPI)" DEBUG_TCP_FMT ": FACK https sni, peer_cache_detach got NULL\n", DEBUG_TCP_ARG(iph,l4));
-							goto sni_skip;
-						}
-						nf_ct_seqadj_init(ct, ctinfo, ntohl(TCPH((char *)ip_hdr(cache_skb) + sizeof(struct iphdr))->ack_seq) - 1 - ntohl(TCPH(l4)->seq));
-						sni_ack_pass_back(skb, cache_skb, ct, in);
-						sni_cache_skb_pass_back(skb, cache_skb, ct, in, ctinfo);
-						consume_skb(cache_skb);
-					sni_skip:
+						peer_sni_synack_pass_back(net, skb, user, in);
 						consume_skb(skb);
 						nf_ct_put(user);
 						return NF_STOLEN;
@@ -2470,6 +3760,7 @@ static unsigned int natcap_peer_dnat_hook(void *priv,
 			goto h_bypass;
 		}
 		ps->last_inuse = jiffies;
+		ps->use_cnt++;
 		mss = fue->mss;
 		nf_ct_put(ps->port_map[pmi]);
 		ps->port_map[pmi] = NULL;
@@ -2516,8 +3807,6 @@ h_out:
 knock:
 		user = get_peer_user(port);
 		if (user) {
-			int i;
-			unsigned long mindiff = peer_port_map_timeout * HZ;
 			struct peer_tuple *pt = NULL;
 			struct natcap_session *ns;
 			struct user_expect *ue = peer_user_expect(user);
@@ -2534,12 +3823,7 @@ knock:
 				return NF_ACCEPT;
 			}
 
-			for (i = 0; i < MAX_PEER_TUPLE; i++) {
-				if (ue->tuple[i].connected && ue->tuple[i].sip != 0 && mindiff > uintdiff(jiffies, ue->tuple[i].last_active)) {
-					pt = &ue->tuple[i];
-					mindiff = uintdiff(jiffies, ue->tuple[i].last_active);
-				}
-			}
+			pt = peer_user_tuple_pick(ue);
 
 			if (pt == NULL) {
 				NATCAP_WARN("(PD)" DEBUG_TCP_FMT ": no available port mapping for user[%02X:%02X:%02X:%02X:%02X:%02X]\n",
@@ -2913,10 +4197,18 @@ const char *natcap_peer_dev_name = "natcap_peer_ctl";
 static struct class *natcap_peer_class;
 static struct device *natcap_peer_dev;
 
+/* called with rcu_read_lock held */
 static inline struct peer_server_node *peer_server_node_get(int idx)
 {
-	if (idx < MAX_PEER_SERVER) {
-		return &(peer_server[idx]);
+	int i;
+	struct peer_server_node *ps;
+
+	for (i = 0; i < PEER_SERVER_HASH_SIZE; i++) {
+		hlist_for_each_entry_rcu(ps, &peer_server_hash[i], hnode) {
+			if (idx-- == 0) {
+				return ps;
+			}
+		}
 	}
 	return NULL;
 }
@@ -2934,18 +4226,28 @@ static void *natcap_peer_start(struct seq_file *m, loff_t *pos)
 				"#    local_target=%pI4:%u\n"
 				"#    peer_conn_timeout=%us\n"
 				"#    peer_port_map_timeout=%us\n"
+				"#    peer_user_tuples=%u\n"
 				"#    KN=%pI4:%u MAC=%02X:%02X:%02X:%02X:%02X:%02X LP=%u\n"
 				"#    peer_sni_listen=%pI4:%u\n"
 				"#    peer_sni_auth=%u\n"
+				"#    peer_sni_route: rules=%u\n"
+				"#    peer_cache_mem_limit=%u\n"
+				"#    peer_ping_batch_us=%u batches=%ld echoes=%ld\n"
+				"#    peer_cache: entries=%u mem=%u drops=%ld expired=%ld\n"
 				"#\n"
 				"\n",
 				&peer_local_ip, ntohs(peer_local_port),
 				peer_conn_timeout, peer_port_map_timeout,
+				peer_user_tuples,
 				&peer_knock_ip, ntohs(peer_knock_port),
 				peer_knock_mac[0], peer_knock_mac[1], peer_knock_mac[2], peer_knock_mac[3], peer_knock_mac[4], peer_knock_mac[5],
 				ntohs(peer_knock_local_port),
 				&peer_sni_ip, ntohs(peer_sni_port),
-				peer_sni_auth
+				peer_sni_auth,
+				peer_sni_route_count,
+				peer_cache_mem_limit,
+				peer_ping_batch_us, atomic_long_read(&peer_ping_batches), atomic_long_read(&peer_ping_batch_echoes),
+				atomic_read(&peer_cache_entries), atomic_read(&peer_cache_mem), atomic_long_read(&peer_cache_drops), atomic_long_read(&peer_cache_expired)
 				);
 		natcap_peer_ctl_buffer[n] = 0;
 		return natcap_peer_ctl_buffer;
@@ -2953,28 +4255,38 @@ static void *natcap_peer_start(struct seq_file *m, loff_t *pos)
 		unsigned char client_mac[ETH_ALEN];
 		struct nf_conn *user;
 		struct user_expect *ue;
-		struct peer_server_node *ps = peer_server_node_get((*pos) - 1);
+		struct peer_server_node *ps;
+
+		rcu_read_lock();
+		ps = (*pos) <= MAX_PEER_SERVER ? peer_server_node_get((*pos) - 1) : NULL;
 		if (ps) {
+			int i;
 			spin_lock_bh(&ps->lock);
 			natcap_peer_ctl_buffer[0] = 0;
 			n = snprintf(natcap_peer_ctl_buffer,
 					PAGE_SIZE - 1,
-					"N[%pI4:%u] [AS %ds]\n"
-					"    conn[%u:%u,%u:%u,%u:%u,%u:%u,%u:%u,%u:%u,%u:%u,%u:%u]\n",
+					"N[%pI4:%u] [AS %ds] pool=%u icmp=%u/s use=%u/s\n"
+					"    conn[",
 					&ps->ip, ntohs(ps->map_port), ps->last_active != 0 ? (uintdiff(ps->last_active, jiffies) + HZ / 2) / HZ : (-1),
-					ntohs(peer_fakeuser_sport(ps->port_map[0])), ntohs(peer_fakeuser_dport(ps->port_map[0])),
-					ntohs(peer_fakeuser_sport(ps->port_map[1])), ntohs(peer_fakeuser_dport(ps->port_map[1])),
-					ntohs(peer_fakeuser_sport(ps->port_map[2])), ntohs(peer_fakeuser_dport(ps->port_map[2])),
-					ntohs(peer_fakeuser_sport(ps->port_map[3])), ntohs(peer_fakeuser_dport(ps->port_map[3])),
-					ntohs(peer_fakeuser_sport(ps->port_map[4])), ntohs(peer_fakeuser_dport(ps->port_map[4])),
-					ntohs(peer_fakeuser_sport(ps->port_map[5])), ntohs(peer_fakeuser_dport(ps->port_map[5])),
-					ntohs(peer_fakeuser_sport(ps->port_map[6])), ntohs(peer_fakeuser_dport(ps->port_map[6])),
-					ntohs(peer_fakeuser_sport(ps->port_map[7])), ntohs(peer_fakeuser_dport(ps->port_map[7]))
+					ps->pool, ps->icmp_rate / 16, ps->use_rate / 16
 					);
+			for (i = 0; i < ps->pool; i++) {
+				n += snprintf(natcap_peer_ctl_buffer + n,
+						PAGE_SIZE - 1 - n,
+						"%s%u:%u", i == 0 ? "" : ",",
+						ntohs(peer_fakeuser_sport(ps->port_map[i])), ntohs(peer_fakeuser_dport(ps->port_map[i]))
+						);
+			}
+			n += snprintf(natcap_peer_ctl_buffer + n, PAGE_SIZE - 1 - n, "]\n");
 			spin_unlock_bh(&ps->lock);
+			rcu_read_unlock();
 			natcap_peer_ctl_buffer[n] = 0;
 			return natcap_peer_ctl_buffer;
 		}
+		rcu_read_unlock();
+		if ((*pos) <= MAX_PEER_SERVER) {
+			(*pos) = MAX_PEER_SERVER + 1;
+		}
 
 		while ((*pos) - MAX_PEER_SERVER < MAX_PEER_PORT_MAP) {
 			user = get_peer_user((*pos) - MAX_PEER_SERVER);
@@ -2998,6 +4310,25 @@ static void *natcap_peer_start(struct seq_file *m, loff_t *pos)
 			natcap_peer_ctl_buffer[n] = 0;
 			return natcap_peer_ctl_buffer;
 		}
+
+		if ((*pos) - MAX_PEER_SERVER - MAX_PEER_PORT_MAP < MAX_PEER_SNI_ROUTE) {
+			struct peer_sni_rule *rule;
+
+			rcu_read_lock();
+			rule = peer_sni_route_get((*pos) - MAX_PEER_SERVER - MAX_PEER_PORT_MAP);
+			if (rule != NULL) {
+				n = snprintf(natcap_peer_ctl_buffer,
+						PAGE_SIZE - 1,
+						"R[%s%s] -> %pI4:%u hits=%ld\n",
+						rule->wildcard ? (rule->len ? "*." : "*") : "", rule->name,
+						&rule->ip, ntohs(rule->port), atomic_long_read(&rule->hits)
+						);
+				rcu_read_unlock();
+				natcap_peer_ctl_buffer[n] = 0;
+				return natcap_peer_ctl_buffer;
+			}
+			rcu_read_unlock();
+		}
 	}
 
 	return NULL;
@@ -3100,6 +4431,28 @@ static ssize_t natcap_peer_write(struct file *file, const char __user *buf, size
 			peer_port_map_timeout = d;
 			goto done;
 		}
+	} else if (strncmp(data, "peer_user_tuples=", 17) == 0) {
+		unsigned int d;
+		n = sscanf(data, "peer_user_tuples=%u", &d);
+		//a power of 2, the users created after this get d slots
+		if (n == 1 && d >= PEER_TUPLE_PROBE && d <= PEER_USER_TUPLES_MAX && (d & (d - 1)) == 0) {
+			peer_user_tuples = d;
+			goto done;
+		}
+	} else if (strncmp(data, "peer_cache_mem_limit=", 21) == 0) {
+		unsigned int d;
+		n = sscanf(data, "peer_cache_mem_limit=%u", &d);
+		if (n == 1) {
+			peer_cache_mem_limit = d;
+			goto done;
+		}
+	} else if (strncmp(data, "peer_ping_batch_us=", 19) == 0) {
+		unsigned int d;
+		n = sscanf(data, "peer_ping_batch_us=%u", &d);
+		if (n == 1 && d <= 1000000) {
+			peer_ping_batch_us = d;
+			goto done;
+		}
 	} else if (strncmp(data, "KN=", 3) == 0) {
 		unsigned int a, b, c, d, e, f;
 		unsigned int x0, x1, x2, x3, x4, x5;
@@ -3144,6 +4497,28 @@ static ssize_t natcap_peer_write(struct file *file, const char __user *buf, size
 			peer_sni_port = htons(e);
 			goto done;
 		}
+	} else if (strncmp(data, "peer_sni_route=", 15) == 0) {
+		char host[MAX_IOCTL_LEN];
+		unsigned int a, b, c, d, e;
+		n = sscanf(data, "peer_sni_route=%255s %u.%u.%u.%u:%u", host, &a, &b, &c, &d, &e);
+		if ( (n == 6 && e <= 0xffff && e != 0) &&
+				(((a & 0xff) == a) &&
+				 ((b & 0xff) == b) &&
+				 ((c & 0xff) == c) &&
+				 ((d & 0xff) == d)) ) {
+			err = peer_sni_route_add(host, htonl((a<<24)|(b<<16)|(c<<8)|(d<<0)), htons(e));
+			if (err == 0)
+				goto done;
+			NATCAP_println("peer_sni_route_add() failed ret=%d", err);
+		}
+	} else if (strncmp(data, "peer_sni_route_del=", 19) == 0) {
+		err = peer_sni_route_del(data + 19);
+		if (err == 0)
+			goto done;
+		NATCAP_println("peer_sni_route_del() failed ret=%d", err);
+	} else if (strncmp(data, "peer_sni_route_clean", 20) == 0) {
+		peer_sni_route_cleanup();
+		goto done;
 	} else if (strncmp(data, "peer_sni_auth=", 14) == 0) {
 		unsigned int d;
 		n = sscanf(data, "peer_sni_auth=%u", &d);
@@ -3217,21 +4592,25 @@ static int peer_netdev_event(struct notifier_block *this, unsigned long event, v
 	if (event != NETDEV_UNREGISTER)
 		return NOTIFY_DONE;
 
-	for (i = 0; i < MAX_PEER_SERVER; i++) {
-		struct peer_server_node *ps = &peer_server[i];
-		spin_lock_bh(&ps->lock);
-		for (j = 0; j < MAX_PEER_CONN; j++) {
-			user = ps->port_map[j];
-			if (user != NULL) {
-				struct fakeuser_expect *fue = peer_fakeuser_expect(user);
-				if (fue->rt_out.outdev == dev) {
-					peer_server[i].port_map[j] = NULL;
-					nf_ct_put(user);
+	rcu_read_lock();
+	for (i = 0; i < PEER_SERVER_HASH_SIZE; i++) {
+		struct peer_server_node *ps;
+		hlist_for_each_entry_rcu(ps, &peer_server_hash[i], hnode) {
+			spin_lock_bh(&ps->lock);
+			for (j = 0; j < MAX_PEER_CONN; j++) {
+				user = ps->port_map[j];
+				if (user != NULL) {
+					struct fakeuser_expect *fue = peer_fakeuser_expect(user);
+					if (fue->rt_out.outdev == dev) {
+						ps->port_map[j] = NULL;
+						nf_ct_put(user);
+					}
 				}
 			}
+			spin_unlock_bh(&ps->lock);
 		}
-		spin_unlock_bh(&ps->lock);
 	}
+	rcu_read_unlock();
 
 	NATCAP_WARN("catch unregister event for dev=%s\n", dev ? dev->name : "(null)");
 
@@ -3255,18 +4634,26 @@ int natcap_peer_init(void)
 	}
 
 	peer_cache_init();
-	memset(peer_server, 0, sizeof(peer_server));
-	for (i = 0; i < MAX_PEER_SERVER; i++) {
-		spin_lock_init(&peer_server[i].lock);
+	get_random_bytes(&peer_hello_rnd, sizeof(peer_hello_rnd));
+	get_random_bytes(&peer_tuple_rnd, sizeof(peer_tuple_rnd));
+	for (i = 0; i < PEER_SERVER_HASH_SIZE; i++) {
+		INIT_HLIST_HEAD(&peer_server_hash[i]);
 	}
-	for (i = 0; i < NR_CPUS; i++) {
-		peer_user_uskbs[i] = NULL;
+	peer_server_count = 0;
+	get_random_bytes(&peer_server_rnd, sizeof(peer_server_rnd));
+	for (i = 0; i < PEER_SNI_ROUTE_HASH_SIZE; i++) {
+		INIT_HLIST_HEAD(&peer_sni_route_hash[i]);
 	}
+	get_random_bytes(&peer_sni_route_rnd, sizeof(peer_sni_route_rnd));
 	peer_port_map = vmalloc(sizeof(struct nf_conn *) * MAX_PEER_PORT_MAP);
 	if (peer_port_map == NULL) {
 		return -ENOMEM;
 	}
 	memset(peer_port_map, 0, sizeof(struct nf_conn *) * MAX_PEER_PORT_MAP);
+	peer_wheel_init();
+	hrtimer_init(&peer_batch_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	peer_batch_timer.function = peer_batch_timer_fn;
+	tasklet_init(&peer_batch_tasklet, peer_ping_batch_flush, 0);
 
 	register_netdevice_notifier(&peer_netdev_notifier);
 
@@ -3353,37 +4740,31 @@ void natcap_peer_exit(void)
 	nf_unregister_hooks(peer_hooks, ARRAY_SIZE(peer_hooks));
 
 	peer_timer_exit();
+	hrtimer_cancel(&peer_batch_timer);
+	tasklet_kill(&peer_batch_tasklet);
 
 	unregister_netdevice_notifier(&peer_netdev_notifier);
 
-	spin_lock_bh(&peer_port_map_lock);
 	for (i = 0; i < MAX_PEER_PORT_MAP; i++) {
-		if (peer_port_map[i] != NULL) {
-			nf_ct_put(peer_port_map[i]);
-			peer_port_map[i] = NULL;
+		struct nf_conn *user = xchg(peer_port_slot(i), NULL);
+		if (user != NULL) {
+			nf_ct_put(user);
 		}
 	}
-	spin_unlock_bh(&peer_port_map_lock);
 	vfree(peer_port_map);
 
-	for (i = 0; i < NR_CPUS; i++) {
-		if (peer_user_uskbs[i]) {
-			kfree(peer_user_uskbs[i]);
-			peer_user_uskbs[i] = NULL;
-		}
-	}
+	peer_wheel_cleanup();
 
-	for (i = 0; i < MAX_PEER_SERVER; i++) {
-		int j;
-		spin_lock_bh(&peer_server[i].lock);
-		for (j = 0; j < MAX_PEER_CONN; j++) {
-			if (peer_server[i].port_map[j]) {
-				nf_ct_put(peer_server[i].port_map[j]);
-				peer_server[i].port_map[j] = NULL;
-			}
+	spin_lock_bh(&peer_server_lock);
+	for (i = 0; i < PEER_SERVER_HASH_SIZE; i++) {
+		struct peer_server_node *ps;
+		struct hlist_node *n;
+		hlist_for_each_entry_safe(ps, n, &peer_server_hash[i], hnode) {
+			peer_server_node_free(ps);
 		}
-		spin_unlock_bh(&peer_server[i].lock);
 	}
+	spin_unlock_bh(&peer_server_lock);
 
 	peer_cache_cleanup();
+	peer_sni_route_cleanup();
 }
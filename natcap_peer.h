@@ -23,7 +23,17 @@
 
 #define __ALIGN_64BITS 8
 
+/* ICMP echoes held for one port_map slot behind the carrier skb, see peer_ping_batch_us */
+struct peer_ping_batch {
+	struct sk_buff *skb;
+	unsigned short cnt;
+#define PEER_PING_BATCH_MAX 16
+	struct natcap_peer_ping_rec rec[PEER_PING_BATCH_MAX];
+};
+
 struct peer_server_node {
+	struct hlist_node hnode;
+	struct rcu_head rcu;
 	spinlock_t  lock;
 #define PEER_SUBTYPE_SSYN_BIT 0
 #define PEER_SUBTYPE_SSYN (1 << PEER_SUBTYPE_SSYN_BIT)
@@ -35,8 +45,20 @@ struct peer_server_node {
 	unsigned short conn;
 	unsigned int last_active;
 	unsigned int last_inuse;
-#define MAX_PEER_CONN 8
+	/* conns in use are port_map[0, pool), resized by the measured rates */
+	unsigned short pool;
+	unsigned int rate_stamp;
+	unsigned int icmp_cnt;
+	unsigned int use_cnt;
+	/* in 1/16 per second */
+	unsigned int icmp_rate;
+	unsigned int use_rate;
+#define MIN_PEER_CONN 8
+#define MAX_PEER_CONN 64
 	struct nf_conn *port_map[MAX_PEER_CONN];
+	/* held echoes per port_map slot, bit pmi of batch_map is set while batch[pmi] is */
+	u64 batch_map;
+	struct peer_ping_batch *batch[MAX_PEER_CONN];
 };
 
 struct natcap_route {
@@ -85,8 +107,8 @@ struct user_expect {
 	__be32 ip;
 	__be16 map_port;
 	unsigned short status;
-#define MAX_PEER_TUPLE 8
-	struct peer_tuple tuple[MAX_PEER_TUPLE];
+	unsigned int tuple_mask; //slots of tuple[] - 1, see peer_user_tuples
+	struct peer_tuple tuple[0];
 };
 
 static inline struct user_expect *peer_user_expect(struct nf_conn *ct)
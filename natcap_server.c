@@ -26,6 +26,12 @@
 #include <linux/if_ether.h>
 #include <linux/netfilter.h>
 #include <linux/inetdevice.h>
+#include <linux/jhash.h>
+#include <linux/ktime.h>
+#include <linux/random.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <net/netfilter/nf_conntrack.h>
 #include <net/netfilter/nf_conntrack_core.h>
 #include <net/netfilter/nf_conntrack_zones.h>
@@ -37,36 +43,266 @@
 #include "natcap.h"
 #include "natcap_common.h"
 #include "natcap_server.h"
+#include "natcap_dns.h"
 
 #define MAX_DNS_SERVER_NODE 32
-static __be32 dns_server_node[MAX_DNS_SERVER_NODE];
-static int dns_server_number = 0;
-static void dns_server_node_random_select(__be32 *ip)
+/* queries of the resolvers sampled for the rtt, a query whose slot is taken is not sampled */
+unsigned int dns_server_pending_num = 256;
+module_param(dns_server_pending_num, int, 0);
+MODULE_PARM_DESC(dns_server_pending_num, "Pending DNS queries sampled per resolver default=256");
+/* slots checked for a timeout on each query */
+#define DNS_SERVER_EXPIRE_STEP 8
+/* a query without answer after this long counts as a timeout */
+#define DNS_SERVER_TIMEOUT_US 2000000
+/* one pick in this many goes to a random node, so a degraded node gets measured again */
+#define DNS_SERVER_EXPLORE 32
+
+/* a query is known by the client address and port and the DNS id, a ct can be freed and reused */
+struct dns_server_pending {
+	__be32 saddr;
+	__be16 sport;
+	unsigned short id;
+	unsigned int stamp;
+	unsigned int used;
+};
+
+struct dns_server_node {
+	struct rcu_head rcu;
+	spinlock_t lock;
+	__be32 ip;
+	unsigned int srtt; /* EWMA rtt in us */
+	unsigned int timeout_rate; /* EWMA of the timeout rate in 1/1024 */
+	unsigned int queries;
+	unsigned int timeouts;
+	unsigned int pending_num;
+	unsigned int expire_idx;
+	struct dns_server_pending pending[0];
+};
+
+/* the nodes are published with rcu, dns_server_lock only serializes add and clean
+ * the queries and answers of the hot path take the lock of their own node
+ */
+static DEFINE_SPINLOCK(dns_server_lock);
+static struct dns_server_node __rcu *dns_server_node[MAX_DNS_SERVER_NODE];
+static atomic_t dns_server_number = ATOMIC_INIT(0);
+static unsigned int dns_server_rnd __read_mostly;
+
+static inline unsigned int dns_server_now(void)
+{
+	return (unsigned int)ktime_to_us(ktime_get());
+}
+
+/* expected latency of a query: a timeout costs as much as the timeout itself */
+static inline unsigned int dns_server_node_score(const struct dns_server_node *node)
+{
+	return node->srtt + node->timeout_rate * (DNS_SERVER_TIMEOUT_US / 1024);
+}
+
+/* called with node->lock held */
+static inline void dns_server_node_timeout_update(struct dns_server_node *node, int timeout)
+{
+	int rate = node->timeout_rate;
+
+	rate += ((timeout ? 1024 : 0) - rate) / 16;
+	node->timeout_rate = rate;
+}
+
+/* count the pending query of the slot as a timeout when it ran out of time, called with node->lock held */
+static inline int dns_server_pending_expire(struct dns_server_node *node, struct dns_server_pending *pd, unsigned int now)
+{
+	if (pd->used && now - pd->stamp >= DNS_SERVER_TIMEOUT_US) {
+		pd->used = 0;
+		node->timeouts++;
+		dns_server_node_timeout_update(node, 1);
+	}
+	return pd->used;
+}
+
+/* check a few slots on each call, called with node->lock held */
+static void dns_server_node_expire(struct dns_server_node *node, unsigned int now)
+{
+	int i;
+
+	for (i = 0; i < DNS_SERVER_EXPIRE_STEP; i++) {
+		dns_server_pending_expire(node, &node->pending[node->expire_idx], now);
+		node->expire_idx = (node->expire_idx + 1) % node->pending_num;
+	}
+}
+
+static inline struct dns_server_pending *dns_server_pending_slot(struct dns_server_node *node, const struct nf_conn *ct, unsigned short id)
+{
+	const struct nf_conntrack_tuple *t = &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+
+	return &node->pending[jhash_3words((__force u32)t->src.u3.ip, (__force u32)t->src.u.all, id, dns_server_rnd) % node->pending_num];
+}
+
+/* called with rcu_read_lock held */
+static struct dns_server_node *dns_server_node_get(unsigned int idx, unsigned int now)
+{
+	struct dns_server_node *node = rcu_dereference(dns_server_node[idx]);
+
+	if (node != NULL) {
+		spin_lock_bh(&node->lock);
+		dns_server_node_expire(node, now);
+		spin_unlock_bh(&node->lock);
+	}
+	return node;
+}
+
+/* power of two choices on the score, an unmeasured node scores 0 and gets probed */
+static void dns_server_node_select(__be32 *ip)
+{
+	unsigned int a, b;
+	unsigned int n = atomic_read(&dns_server_number);
+	unsigned int now = dns_server_now();
+	struct dns_server_node *na, *nb;
+
+	if (n == 0) {
+		return;
+	}
+
+	rcu_read_lock();
+	a = prandom_u32() % n;
+	na = dns_server_node_get(a, now);
+	if (n > 1 && prandom_u32() % DNS_SERVER_EXPLORE != 0) {
+		b = prandom_u32() % (n - 1);
+		if (b >= a) {
+			b++;
+		}
+		nb = dns_server_node_get(b, now);
+		if (na == NULL || (nb != NULL && dns_server_node_score(nb) < dns_server_node_score(na))) {
+			na = nb;
+		}
+	}
+	if (na != NULL && na->ip != 0) {
+		*ip = na->ip;
+	}
+	rcu_read_unlock();
+}
+
+/* called with rcu_read_lock held */
+static struct dns_server_node *dns_server_node_find(__be32 ip)
 {
-	unsigned int idx = dns_server_number;
-	if (idx > 0) {
-		idx = (jiffies % idx) % MAX_DNS_SERVER_NODE;
-		idx = dns_server_node[idx];
-		if (idx != 0) {
-			*ip = idx;
+	int i;
+	int n = atomic_read(&dns_server_number);
+	struct dns_server_node *node;
+
+	for (i = 0; i < n; i++) {
+		node = rcu_dereference(dns_server_node[i]);
+		if (node != NULL && node->ip == ip) {
+			return node;
+		}
+	}
+	return NULL;
+}
+
+/* a query from the client is going to the resolver at @ip */
+static void dns_server_node_query(const struct nf_conn *ct, __be32 ip, unsigned short id)
+{
+	unsigned int now = dns_server_now();
+	struct dns_server_node *node;
+	struct dns_server_pending *pd;
+
+	rcu_read_lock();
+	node = dns_server_node_find(ip);
+	if (node == NULL) {
+		goto out;
+	}
+	spin_lock_bh(&node->lock);
+	node->queries++;
+	dns_server_node_expire(node, now);
+	pd = dns_server_pending_slot(node, ct, id);
+	if (!dns_server_pending_expire(node, pd, now)) {
+		pd->saddr = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip;
+		pd->sport = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.all;
+		pd->id = id;
+		pd->stamp = now;
+		pd->used = 1;
+	}
+	spin_unlock_bh(&node->lock);
+out:
+	rcu_read_unlock();
+}
+
+/* the answer from the resolver at @ip is going back to the client */
+static void dns_server_node_answer(const struct nf_conn *ct, __be32 ip, unsigned short id)
+{
+	int rtt;
+	struct dns_server_node *node;
+	struct dns_server_pending *pd;
+
+	rcu_read_lock();
+	node = dns_server_node_find(ip);
+	if (node == NULL) {
+		goto out;
+	}
+	spin_lock_bh(&node->lock);
+	pd = dns_server_pending_slot(node, ct, id);
+	if (pd->used && pd->id == id &&
+			pd->saddr == ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip &&
+			pd->sport == ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.all) {
+		pd->used = 0;
+		rtt = dns_server_now() - pd->stamp;
+		if (rtt >= 0 && rtt < DNS_SERVER_TIMEOUT_US) {
+			if (node->srtt == 0) {
+				node->srtt = rtt;
+			} else {
+				node->srtt += (rtt - (int)node->srtt) / 8;
+			}
+			dns_server_node_timeout_update(node, 0);
 		}
 	}
+	spin_unlock_bh(&node->lock);
+out:
+	rcu_read_unlock();
 }
 
 /* called from user write */
 int dns_server_node_add(__be32 ip)
 {
-	if (dns_server_number < MAX_DNS_SERVER_NODE) {
-		dns_server_node[dns_server_number] = ip;
-		dns_server_number++;
-		return 0;
+	int ret = -ENOMEM;
+	unsigned int num = dns_server_pending_num ? dns_server_pending_num : 1;
+	struct dns_server_node *node;
+
+	node = kzalloc(sizeof(struct dns_server_node) + num * sizeof(struct dns_server_pending), GFP_KERNEL);
+	if (node == NULL) {
+		return -ENOMEM;
 	}
-	return -ENOMEM;
+	spin_lock_init(&node->lock);
+	node->ip = ip;
+	node->pending_num = num;
+
+	spin_lock_bh(&dns_server_lock);
+	if (atomic_read(&dns_server_number) < MAX_DNS_SERVER_NODE) {
+		rcu_assign_pointer(dns_server_node[atomic_read(&dns_server_number)], node);
+		//the slot is visible before the number that covers it
+		smp_wmb();
+		atomic_inc(&dns_server_number);
+		node = NULL;
+		ret = 0;
+	}
+	spin_unlock_bh(&dns_server_lock);
+
+	if (node != NULL) {
+		kfree(node);
+	}
+	return ret;
 }
 void dns_server_node_clean(void)
 {
-	dns_server_number = 0;
-	memset(dns_server_node, 0, sizeof(__be32) * MAX_DNS_SERVER_NODE);
+	int i;
+	struct dns_server_node *node;
+
+	spin_lock_bh(&dns_server_lock);
+	atomic_set(&dns_server_number, 0);
+	for (i = 0; i < MAX_DNS_SERVER_NODE; i++) {
+		node = rcu_dereference_protected(dns_server_node[i], lockdep_is_held(&dns_server_lock));
+		if (node != NULL) {
+			RCU_INIT_POINTER(dns_server_node[i], NULL);
+			kfree_rcu(node, rcu);
+		}
+	}
+	spin_unlock_bh(&dns_server_lock);
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
@@ -1140,7 +1376,7 @@ static unsigned int natcap_server_pre_ct_in_hook(void *priv,
 			if (!(IPS_NATCAP & ct->status) && !test_and_set_bit(IPS_NATCAP_BIT, &ct->status)) { /* first time in*/
 				//XXX overwrite DNS server
 				if (server.port == __constant_htons(53)) {
-					dns_server_node_random_select(&server.ip);
+					dns_server_node_select(&server.ip);
 				}
 				NATCAP_INFO("(SPCI)" DEBUG_UDP_FMT ": new connection, after decode target=" TUPLE_FMT "\n", DEBUG_UDP_ARG(iph,l4), TUPLE_ARG(&server));
 				if (natcap_dnat_setup(ct, server.ip, server.port) != NF_ACCEPT) {
@@ -1188,6 +1424,23 @@ static unsigned int natcap_server_pre_ct_in_hook(void *priv,
 				skb_rcsum_tcpudp(skb);
 			}
 
+			if (ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u.all == __constant_htons(53)) {
+				struct natcap_dns_parser dp;
+				struct natcap_dns_question q;
+				struct natcap_dns_scratch *scratch;
+
+				if (natcap_dns_parser_init(&dp, skb, iph->ihl * 4 + sizeof(struct udphdr)) == 0 && !(dp.flags & 0x8000)) {
+					dns_server_node_query(ct, ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u3.ip, dp.id);
+					if (IS_NATCAP_DEBUG() && dp.qdcount > 0 && natcap_dns_parse_question(&dp, &q) == 0) {
+						scratch = natcap_dns_scratch_get();
+						if (natcap_dns_name_read(&dp, q.name_pos, scratch->name, sizeof(scratch->name)) >= 0) {
+							NATCAP_DEBUG("(SPCI)" DEBUG_UDP_FMT ": id=0x%04x, qname=%s, qtype=%d\n", DEBUG_UDP_ARG(iph,l4), dp.id, scratch->name, q.qtype);
+						}
+						natcap_dns_scratch_put();
+					}
+				}
+			}
+
 			flow_total_rx_bytes += skb->len;
 			xt_mark_natcap_set(XT_MARK_NATCAP, &skb->mark);
 			if (!(IPS_NATFLOW_FF_STOP & ct->status)) set_bit(IPS_NATFLOW_FF_STOP_BIT, &ct->status);
@@ -1388,6 +1641,13 @@ static unsigned int natcap_server_post_out_hook(void *priv,
 		return NF_STOLEN;
 	} else if (iph->protocol == IPPROTO_UDP) {
 		NATCAP_DEBUG("(SPO)" DEBUG_UDP_FMT ": pass data reply\n", DEBUG_UDP_ARG(iph,l4));
+		if (ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u.all == __constant_htons(53)) {
+			struct natcap_dns_parser dp;
+
+			if (natcap_dns_parser_init(&dp, skb, iph->ihl * 4 + sizeof(struct udphdr)) == 0 && (dp.flags & 0x8000)) {
+				dns_server_node_answer(ct, ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u3.ip, dp.id);
+			}
+		}
 		if ((NS_NATCAP_ENC & ns->n.status)) {
 			if (!skb_make_writable(skb, skb->len)) {
 				NATCAP_ERROR("(SPO)" DEBUG_UDP_FMT ": natcap_udp_encode() failed\n", DEBUG_UDP_ARG(iph,l4));
@@ -1776,6 +2036,8 @@ int natcap_server_init(void)
 
 	need_conntrack();
 
+	get_random_bytes(&dns_server_rnd, sizeof(dns_server_rnd));
+
 	ret = nf_register_sockopt(&so_natcap_dst);
 	if (ret < 0) {
 		NATCAP_ERROR("Unable to register netfilter socket option\n");
@@ -1808,4 +2070,7 @@ void natcap_server_exit(void)
 	}
 
 	nf_unregister_sockopt(&so_natcap_dst);
+
+	dns_server_node_clean();
+	rcu_barrier();
 }
@@ -1,3 +1,6 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
@@ -11,6 +14,7 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <math.h>
+#include <poll.h>
 
 #include <netdb.h>
 #include <errno.h>
@@ -18,7 +22,9 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/un.h>
+#include <sys/resource.h>
 
 #include <ifaddrs.h>
 #include <net/if.h>
@@ -38,15 +44,34 @@
 #define MAXCONN 1024
 #endif
 
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+#ifndef TCP_FASTOPEN
+#define TCP_FASTOPEN 23
+#endif
+
+#ifndef TCP_FASTOPEN_CONNECT
+#define TCP_FASTOPEN_CONNECT 30
+#endif
+
+#ifndef TCPI_OPT_SYN_DATA
+#define TCPI_OPT_SYN_DATA 32
+#endif
+
+#define TFO_QLEN 256
+
 static void signal_cb(EV_P_ ev_signal *w, int revents);
 static void accept_cb(EV_P_ ev_io *w, int revents);
+static void accept_fd(EV_P_ listen_ctx_t *listener, int serverfd);
 static void server_send_cb(EV_P_ ev_io *w, int revents);
 static void server_recv_cb(EV_P_ ev_io *w, int revents);
 static void remote_recv_cb(EV_P_ ev_io *w, int revents);
 static void remote_send_cb(EV_P_ ev_io *w, int revents);
 static void server_timeout_cb(EV_P_ ev_timer *watcher, int revents);
 
-static remote_t *new_remote(int fd);
+static remote_t *new_remote(int fd, server_t *server);
 static server_t *new_server(int fd, listen_ctx_t *listener);
 #ifdef NATCAP_CLIENT_MODE
 static remote_t *connect_to_remote(EV_P_ struct addrinfo *res, server_t *server);
@@ -56,12 +81,31 @@ static remote_t *connect_to_remote(EV_P_ struct addrinfo *res, struct sockaddr *
 
 static void free_remote(remote_t *remote);
 static void close_and_free_remote(EV_P_ remote_t *remote);
+static void tfo_timer_cb(EV_P_ ev_timer *w, int revents);
 static void free_server(server_t *server);
 static void close_and_free_server(EV_P_ server_t *server);
+#ifdef NATCAPD_IOURING
+static void uring_conn_close(EV_P_ conn_t *conn);
+static void uring_conn_release(EV_P_ uring_ctx_t *u, conn_t *conn);
+#endif
 
 int ito = 0;
 int verbose = 0;
 int reuse_port = 0;
+int splice_enabled = 1;
+int pipe_size = PIPE_SIZE;
+int mem_budget = MEM_BUDGET;
+int tfo_enabled = 0;
+int drain_timeout = DRAIN_TIMEOUT;
+char *metrics_path = NULL;
+#ifdef NATCAP_CLIENT_MODE
+int warm_pool_size = 0;
+int warm_server_num = 0;
+struct sockaddr_in warm_servers[MAX_REMOTE_NUM];
+#endif
+#ifdef NATCAPD_IOURING
+int uring_enabled = 0;
+#endif
 
 static int set_reuseport(int socket)
 {
@@ -69,15 +113,113 @@ static int set_reuseport(int socket)
 	return setsockopt(socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
 }
 
-static int remote_conn = 0;
-static int server_conn = 0;
+#ifndef NATCAPD_EV_BACKEND
+#define NATCAPD_EV_BACKEND "auto"
+#endif
+
+static const struct {
+	const char *name;
+	unsigned int flag;
+} ev_backend_list[] = {
+	{ "auto", EVFLAG_AUTO },
+	{ "select", EVBACKEND_SELECT },
+	{ "poll", EVBACKEND_POLL },
+	{ "epoll", EVBACKEND_EPOLL },
+#ifdef EVBACKEND_LINUXAIO
+	{ "linuxaio", EVBACKEND_LINUXAIO },
+#endif
+#ifdef EVBACKEND_IOURING
+	{ "iouring", EVBACKEND_IOURING },
+#endif
+};
+
+static const char *ev_backend_name(unsigned int flag)
+{
+	for (int i = 0; i < sizeof(ev_backend_list) / sizeof(ev_backend_list[0]); i++) {
+		if (ev_backend_list[i].flag == flag) {
+			return ev_backend_list[i].name;
+		}
+	}
+	return "unknown";
+}
+
+static int ev_backend_parse(const char *name, unsigned int *flag)
+{
+	for (int i = 0; i < sizeof(ev_backend_list) / sizeof(ev_backend_list[0]); i++) {
+		if (strcmp(ev_backend_list[i].name, name) == 0) {
+			*flag = ev_backend_list[i].flag;
+			return 0;
+		}
+	}
+	return -1;
+}
 
-uint64_t tx                  = 0;
-uint64_t rx                  = 0;
+static unsigned int ev_backend_flag = EVFLAG_AUTO;
+static int worker_num = 1;
+static int worker_affinity = 0;
+static worker_t *workers = NULL;
+static __thread worker_t *worker_self = NULL;
 
 static struct ev_signal sigint_watcher;
 static struct ev_signal sigterm_watcher;
 static struct ev_signal sigchld_watcher;
+static struct ev_signal sigusr1_watcher;
+static struct ev_signal sigusr2_watcher;
+static struct ev_timer drain_watcher;
+static ev_tstamp drain_deadline;
+static struct ev_io metrics_watcher;
+
+/* upper bounds in microseconds */
+static const unsigned int connect_hist_bounds[CONNECT_HIST_NUM - 1] = {
+	1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000, 5000000
+};
+static const unsigned int loop_hist_bounds[LOOP_HIST_NUM - 1] = {
+	50, 100, 500, 1000, 5000, 10000, 50000
+};
+
+static void hist_add(uint64_t *hist, const unsigned int *bounds, int num, unsigned int usec)
+{
+	int i;
+
+	for (i = 0; i < num - 1; i++) {
+		if (usec <= bounds[i]) {
+			break;
+		}
+	}
+	hist[i]++;
+}
+
+/* a TFO connect is only seen done at the first response, so it has its own histogram */
+static void connect_done(EV_P_ remote_t *remote)
+{
+	worker_stats_t *st = &worker_self->stats;
+
+	if (remote->connect_start > 0) {
+		unsigned int usec = (ev_now(EV_A) - remote->connect_start) * 1000000;
+		if (remote->tfo != TFO_NONE) {
+			hist_add(st->tfo_response_hist, connect_hist_bounds, CONNECT_HIST_NUM, usec);
+			st->tfo_response_usec += usec;
+		} else {
+			hist_add(st->connect_hist, connect_hist_bounds, CONNECT_HIST_NUM, usec);
+			st->connect_usec += usec;
+		}
+		remote->connect_start = 0;
+	}
+}
+
+static void connect_error(int err)
+{
+	worker_self->stats.connect_errors[(err > 0 && err < ERRNO_NUM) ? err : 0]++;
+}
+
+/* an error on a TFO socket before its first response is the connect failing */
+static void tfo_connect_error(remote_t *remote, int err)
+{
+	if (remote->tfo != TFO_NONE && remote->connect_start > 0) {
+		connect_error(err);
+		remote->connect_start = 0;
+	}
+}
 
 int setnonblocking(int fd)
 {
@@ -88,6 +230,321 @@ int setnonblocking(int fd)
 	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
+/*
+ * per worker freelists: conn_t objects and buffer data by size class.
+ * a connection never leaves its worker, so no locking is needed.
+ */
+typedef struct pool_node {
+	struct pool_node *next;
+} pool_node_t;
+
+static __thread pool_node_t *conn_pool = NULL;
+static __thread int conn_pool_num = 0;
+static __thread pool_node_t *buf_pool[BUF_CLASS_NUM];
+static __thread int buf_pool_num[BUF_CLASS_NUM];
+
+static conn_t *conn_alloc(void)
+{
+	conn_t *conn;
+
+	if (conn_pool != NULL) {
+		conn = (conn_t *)conn_pool;
+		conn_pool = conn_pool->next;
+		conn_pool_num--;
+	} else if (posix_memalign((void **)&conn, 64, sizeof(conn_t)) != 0) {
+		return NULL;
+	}
+	memset(conn, 0, sizeof(conn_t));
+	return conn;
+}
+
+static void conn_put(conn_t *conn)
+{
+	if (--conn->refs > 0) {
+		return;
+	}
+	if (conn_pool_num < CONN_POOL_MAX) {
+		pool_node_t *node = (pool_node_t *)conn;
+		node->next = conn_pool;
+		conn_pool = node;
+		conn_pool_num++;
+	} else {
+		free(conn);
+	}
+}
+
+static unsigned char *buf_data_get(int cls)
+{
+	void *data;
+
+	if (buf_pool[cls] != NULL) {
+		data = buf_pool[cls];
+		buf_pool[cls] = buf_pool[cls]->next;
+		buf_pool_num[cls]--;
+		return data;
+	}
+	if (posix_memalign(&data, 64, BUF_CLASS_SIZE(cls)) != 0) {
+		return NULL;
+	}
+	return data;
+}
+
+static void buf_data_put(unsigned char *data, int cls)
+{
+	if (buf_pool_num[cls] < BUF_POOL_MAX) {
+		pool_node_t *node = (pool_node_t *)data;
+		node->next = buf_pool[cls];
+		buf_pool[cls] = node;
+		buf_pool_num[cls]++;
+	} else {
+		free(data);
+	}
+}
+
+/*
+ * memory budget: every worker owns an even share of it. over the share
+ * the reads are paused and the accepts are left in the listen backlog,
+ * they are resumed once the usage drops below 7/8 of the share.
+ */
+static void mem_wait_unlink(conn_t *conn)
+{
+	if (conn->wait_prev != NULL) {
+		conn->wait_prev->wait_next = conn->wait_next;
+	} else {
+		worker_self->wait_list = conn->wait_next;
+	}
+	if (conn->wait_next != NULL) {
+		conn->wait_next->wait_prev = conn->wait_prev;
+	}
+	conn->wait_prev = conn->wait_next = NULL;
+}
+
+static void mem_wait_link(conn_t *conn, int flag)
+{
+	if (conn->wait == 0) {
+		conn->wait_prev = NULL;
+		conn->wait_next = worker_self->wait_list;
+		if (conn->wait_next != NULL) {
+			conn->wait_next->wait_prev = conn;
+		}
+		worker_self->wait_list = conn;
+	}
+	conn->wait |= flag;
+	worker_self->stats.mem_pauses++;
+}
+
+static void mem_wait(EV_P_ conn_t *conn, int flag, ev_io *w)
+{
+	ev_io_stop(EV_A_ w);
+	mem_wait_link(conn, flag);
+}
+
+static void mem_wait_clear(conn_t *conn, int flag)
+{
+	if (conn->wait & flag) {
+		conn->wait &= ~flag;
+		if (conn->wait == 0) {
+			mem_wait_unlink(conn);
+		}
+	}
+}
+
+static void mem_resume(worker_t *worker)
+{
+	conn_t *conn;
+
+	while ((conn = worker->wait_list) != NULL) {
+		mem_wait_unlink(conn);
+		if (conn->wait & CONN_WAIT_SERVER) {
+			ev_io_start(worker->loop, &conn->server_recv_ctx.io);
+		}
+		if (conn->wait & CONN_WAIT_REMOTE) {
+			ev_io_start(worker->loop, &conn->remote_recv_ctx.io);
+		}
+		conn->wait = 0;
+	}
+	if (worker->accept_paused && !worker->draining) {
+		for (int i = 0; i < worker->listen_num; i++) {
+			ev_io_start(worker->loop, &worker->listen_ctx_list[i].io);
+		}
+		worker->accept_paused = 0;
+	}
+}
+
+static int mem_exhausted(void)
+{
+	return worker_self->mem_budget != 0 && worker_self->stats.mem_used >= worker_self->mem_budget;
+}
+
+static void mem_charge(size_t n)
+{
+	worker_self->stats.mem_used += n;
+}
+
+static void mem_uncharge(size_t n)
+{
+	worker_t *worker = worker_self;
+
+	worker->stats.mem_used -= n;
+	if ((worker->wait_list != NULL || worker->accept_paused) &&
+			worker->stats.mem_used <= worker->mem_budget - worker->mem_budget / 8) {
+		mem_resume(worker);
+	}
+}
+
+static int buf_pipe_size(buffer_t *buf)
+{
+	if (buf->cls == BUF_CLASS_MAX) {
+		return pipe_size;
+	}
+	return min(PIPE_CLASS_SIZE(buf->cls), pipe_size);
+}
+
+static void buf_pipe_open(buffer_t *buf)
+{
+	buf->pipefd[0] = buf->pipefd[1] = -1;
+	if (!splice_enabled) {
+		return;
+	}
+#ifdef NATCAPD_IOURING
+	if (worker_self->uring != NULL) {
+		// the provided buffers of the ring take the place of the pipes
+		return;
+	}
+#endif
+	if (pipe2(buf->pipefd, O_NONBLOCK | O_CLOEXEC) == -1) {
+		// out of fds, stay on the copy path
+		buf->pipefd[0] = buf->pipefd[1] = -1;
+		return;
+	}
+	fcntl(buf->pipefd[1], F_SETPIPE_SZ, buf_pipe_size(buf));
+}
+
+static void buf_pipe_close(buffer_t *buf)
+{
+	if (buf->pipefd[0] != -1) {
+		close(buf->pipefd[0]);
+		close(buf->pipefd[1]);
+		buf->pipefd[0] = buf->pipefd[1] = -1;
+	}
+}
+
+static void buf_init(buffer_t *buf)
+{
+	buf->len = 0;
+	buf->idx = 0;
+	buf->cls = BUF_CLASS_DEFAULT;
+	buf->grow = 0;
+	buf->data = NULL;
+	buf_pipe_open(buf);
+}
+
+/* give the data back to the pool, the next recv takes a chunk of the adapted class */
+static void buf_data_release(buffer_t *buf)
+{
+	buf_data_put(buf->data, buf->cls);
+	buf->data = NULL;
+	mem_uncharge(BUF_CLASS_SIZE(buf->cls));
+	buf->cls += buf->grow;
+	buf->grow = 0;
+}
+
+static void buf_release(buffer_t *buf)
+{
+	if (buf->pipefd[0] != -1 && buf->len > 0) {
+		mem_uncharge(buf->len);
+	}
+	buf_pipe_close(buf);
+	if (buf->data != NULL) {
+		buf_data_release(buf);
+	}
+}
+
+/* only called with an empty buffer, the data stay in buf until buf_send() */
+static ssize_t buf_recv(int fd, buffer_t *buf)
+{
+	ssize_t r;
+
+	if (buf->pipefd[0] != -1) {
+		int size = buf_pipe_size(buf);
+
+		r = splice(fd, NULL, buf->pipefd[1], NULL, size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (r == -1 && (errno == EINVAL || errno == ENOSYS)) {
+			// splice not supported for this fd, nothing was moved
+			buf_pipe_close(buf);
+		} else {
+			if (r > 0) {
+				buf->len = r;
+				buf->idx = 0;
+				mem_charge(r);
+				// same rule as the copy path, applied once the pipe is empty
+				if (r == size && size < pipe_size) {
+					buf->grow = 1;
+				} else if (r <= size / 4 && buf->cls > 0) {
+					buf->grow = -1;
+				} else {
+					buf->grow = 0;
+				}
+			}
+			return r;
+		}
+	}
+
+	if (buf->data == NULL) {
+		buf->data = buf_data_get(buf->cls);
+		if (buf->data == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		mem_charge(BUF_CLASS_SIZE(buf->cls));
+	}
+	r = recv(fd, buf->data, BUF_CLASS_SIZE(buf->cls), 0);
+	if (r > 0) {
+		buf->len = r;
+		buf->idx = 0;
+		// a full read asks for a bigger class, a small one for a smaller class
+		if (r == BUF_CLASS_SIZE(buf->cls) && buf->cls < BUF_CLASS_MAX) {
+			buf->grow = 1;
+		} else if (r <= BUF_CLASS_SIZE(buf->cls) / 4 && buf->cls > 0) {
+			buf->grow = -1;
+		} else {
+			buf->grow = 0;
+		}
+	}
+	return r;
+}
+
+static ssize_t buf_send(int fd, buffer_t *buf)
+{
+	ssize_t s;
+
+	if (buf->pipefd[0] != -1) {
+		s = splice(buf->pipefd[0], NULL, fd, NULL, buf->len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (s > 0) {
+			buf->len -= s;
+			buf->idx += s;
+			mem_uncharge(s);
+			if (buf->len == 0 && buf->grow != 0) {
+				buf->cls += buf->grow;
+				buf->grow = 0;
+				fcntl(buf->pipefd[1], F_SETPIPE_SZ, buf_pipe_size(buf));
+			}
+		}
+		return s;
+	}
+
+	s = send(fd, buf->data + buf->idx, buf->len, 0);
+	if (s > 0) {
+		buf->len -= s;
+		buf->idx += s;
+		if (buf->len == 0) {
+			// drained, an idle connection holds no data
+			buf_data_release(buf);
+		}
+	}
+	return s;
+}
+
 int create_and_bind(const char *host, const char *port)
 {
 	struct addrinfo hints;
@@ -145,6 +602,12 @@ int create_and_bind(const char *host, const char *port)
 		s = bind(listen_sock, rp->ai_addr, rp->ai_addrlen);
 		if (s == 0) {
 			/* We managed to bind successfully! */
+			if (tfo_enabled) {
+				int qlen = TFO_QLEN;
+				if (setsockopt(listen_sock, SOL_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) != 0) {
+					perror("setsockopt TCP_FASTOPEN");
+				}
+			}
 			break;
 		} else {
 			perror("bind");
@@ -211,19 +674,44 @@ static remote_t *connect_to_remote(EV_P_ struct addrinfo *res, struct sockaddr *
 
 	// setup remote socks
 
+#ifdef NATCAPD_IOURING
+	if (worker_self->uring != NULL) {
+		// the connect sqe goes out with the ones of this loop iteration, keep
+		// the socket blocking so that the ring retries it on poll
+		conn_t *conn = container_of(server, conn_t, server);
+		remote_t *remote = new_remote(sockfd, server);
+		memcpy(&conn->dest, res->ai_addr, res->ai_addrlen);
+		remote->connect_start = ev_now(EV_A);
+		return remote;
+	}
+#endif
+
 	if (setnonblocking(sockfd) == -1)
 		perror("setnonblocking");
 
-	remote_t *remote = new_remote(sockfd);
+	remote_t *remote = new_remote(sockfd, server);
+
+	if (tfo_enabled && setsockopt(sockfd, SOL_TCP, TCP_FASTOPEN_CONNECT, &opt, sizeof(opt)) == 0) {
+		// connect() returns at once, the first payload is copied into the SYN
+		remote->tfo = TFO_DEFER;
+		buf_pipe_close(remote->buf);
+	}
 
+	remote->connect_start = ev_now(EV_A);
 	int r = connect(sockfd, res->ai_addr, res->ai_addrlen);
 
 	if (r == -1 && errno != EINPROGRESS) {
+		connect_error(errno);
 		perror("connect");
 		close_and_free_remote(EV_A_ remote);
 		return NULL;
 	}
 
+	if (remote->tfo == TFO_DEFER) {
+		ev_timer_init(&remote->tfo_timer, tfo_timer_cb, TFO_DEFER_TIMEOUT, 0);
+		ev_timer_start(EV_A_ & remote->tfo_timer);
+	}
+
 	return remote;
 }
 
@@ -265,6 +753,196 @@ static int get_original_destaddr(int fd, struct sockaddr_storage *destaddr)
 }
 #endif
 
+#ifdef NATCAP_CLIENT_MODE
+/*
+ * warm pool: warm_pool_size connected sockets are kept for each upstream
+ * server given by -r, split between the workers. an accept to one of them
+ * takes a socket that has done its handshake, the timer refills the slot.
+ */
+static int warm_server_parse(const char *str, struct sockaddr_in *addr)
+{
+	char host[INET_ADDRSTRLEN];
+	const char *port = strrchr(str, ':');
+
+	if (port == NULL || port - str >= sizeof(host) || atoi(port + 1) <= 0 || atoi(port + 1) > 65535) {
+		return -1;
+	}
+	memcpy(host, str, port - str);
+	host[port - str] = 0;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons(atoi(port + 1));
+	return inet_pton(AF_INET, host, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+static void warm_fd_close(EV_P_ warm_fd_t *wfd)
+{
+	ev_io_stop(EV_A_ & wfd->io);
+	close(wfd->fd);
+	wfd->fd = -1;
+	wfd->dest->num--;
+}
+
+static void warm_io_cb(EV_P_ ev_io *w, int revents)
+{
+	warm_fd_t *wfd = (warm_fd_t *)w;
+
+	if (!wfd->connected) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(wfd->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+			warm_fd_close(EV_A_ wfd);
+			return;
+		}
+		wfd->connected = 1;
+		wfd->stamp = ev_now(EV_A);
+		// watch the idle socket for the peer closing it
+		ev_io_stop(EV_A_ & wfd->io);
+		ev_io_set(&wfd->io, wfd->fd, EV_READ);
+		ev_io_start(EV_A_ & wfd->io);
+		return;
+	}
+
+	char c;
+	ssize_t r = recv(wfd->fd, &c, 1, MSG_PEEK);
+	if (r == 0 || (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+		warm_fd_close(EV_A_ wfd);
+	} else if (r > 0) {
+		// the peer talks first, the data wait for the client
+		ev_io_stop(EV_A_ & wfd->io);
+	}
+}
+
+static void warm_fill(EV_P_ warm_dest_t *dest)
+{
+	for (int i = 0; i < dest->quota && dest->num < dest->quota; i++) {
+		warm_fd_t *wfd = &dest->fds[i];
+		if (wfd->fd != -1) {
+			continue;
+		}
+
+		int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (fd == -1) {
+			return;
+		}
+		int opt = 1;
+		setsockopt(fd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
+#ifdef SO_NOSIGPIPE
+		setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
+#endif
+		setnonblocking(fd);
+		if (connect(fd, (struct sockaddr *)&dest->addr, sizeof(dest->addr)) == -1 && errno != EINPROGRESS) {
+			close(fd);
+			return;
+		}
+
+		wfd->fd = fd;
+		wfd->connected = 0;
+		wfd->stamp = ev_now(EV_A);
+		wfd->dest = dest;
+		ev_io_init(&wfd->io, warm_io_cb, fd, EV_WRITE);
+		ev_io_start(EV_A_ & wfd->io);
+		dest->num++;
+	}
+}
+
+static void warm_dest_drop(EV_P_ warm_dest_t *dest)
+{
+	for (int i = 0; i < WARM_POOL_MAX; i++) {
+		if (dest->fds[i].fd != -1) {
+			warm_fd_close(EV_A_ & dest->fds[i]);
+		}
+	}
+}
+
+/* NULL unless addr is one of the -r servers */
+static warm_dest_t *warm_dest_find(const struct sockaddr_in *addr)
+{
+	for (int i = 0; i < warm_server_num; i++) {
+		warm_dest_t *dest = &worker_self->warm_dests[i];
+		if (dest->addr.sin_addr.s_addr == addr->sin_addr.s_addr && dest->addr.sin_port == addr->sin_port) {
+			return dest;
+		}
+	}
+	return NULL;
+}
+
+static int warm_take(EV_P_ warm_dest_t *dest)
+{
+	for (int i = 0; i < WARM_POOL_MAX; i++) {
+		warm_fd_t *wfd = &dest->fds[i];
+		if (wfd->fd != -1 && wfd->connected) {
+			int fd = wfd->fd;
+			ev_io_stop(EV_A_ & wfd->io);
+			wfd->fd = -1;
+			dest->num--;
+			return fd;
+		}
+	}
+	return -1;
+}
+
+static void warm_timer_cb(EV_P_ ev_timer *w, int revents)
+{
+	ev_tstamp now = ev_now(EV_A);
+
+	for (int i = 0; i < warm_server_num; i++) {
+		warm_dest_t *dest = &worker_self->warm_dests[i];
+		// the peers drop idle connections, renew them before that
+		for (int j = 0; j < WARM_POOL_MAX; j++) {
+			if (dest->fds[j].fd != -1 && now - dest->fds[j].stamp > WARM_IDLE_TIMEOUT) {
+				warm_fd_close(EV_A_ & dest->fds[j]);
+			}
+		}
+		warm_fill(EV_A_ dest);
+	}
+}
+
+static void warm_init(worker_t *worker)
+{
+	worker->warm_dests = calloc(warm_server_num, sizeof(warm_dest_t));
+	if (worker->warm_dests == NULL) {
+		FATAL("calloc() error");
+	}
+	for (int i = 0; i < warm_server_num; i++) {
+		warm_dest_t *dest = &worker->warm_dests[i];
+		dest->addr = warm_servers[i];
+		// the remainder goes to the first workers
+		dest->quota = warm_pool_size / worker_num + (worker->id < warm_pool_size % worker_num);
+		dest->quota = min(dest->quota, WARM_POOL_MAX);
+		for (int j = 0; j < WARM_POOL_MAX; j++) {
+			dest->fds[j].fd = -1;
+		}
+	}
+	// the first run fills the pool as soon as the loop starts
+	ev_timer_init(&worker->warm_timer, warm_timer_cb, 0., WARM_CHECK_INTERVAL);
+	ev_timer_start(worker->loop, &worker->warm_timer);
+}
+
+static void warm_cleanup(worker_t *worker)
+{
+	ev_timer_stop(worker->loop, &worker->warm_timer);
+	for (int i = 0; i < warm_server_num; i++) {
+		warm_dest_drop(worker->loop, &worker->warm_dests[i]);
+	}
+	free(worker->warm_dests);
+}
+#endif
+
+/* tell whether the data in the SYN were taken on this connection */
+static int tfo_syn_data(int fd)
+{
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+
+	memset(&info, 0, sizeof(info));
+	if (getsockopt(fd, SOL_TCP, TCP_INFO, &info, &len) != 0) {
+		return 0;
+	}
+	return !!(info.tcpi_options & TCPI_OPT_SYN_DATA);
+}
+
 static void server_recv_cb(EV_P_ ev_io *w, int revents)
 {
 	server_ctx_t *server_recv_ctx = (server_ctx_t *)w;
@@ -277,7 +955,18 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
 		return;
 	}
 
-	ssize_t r = recv(server->fd, remote->buf->data, BUF_SIZE, 0);
+	if (mem_exhausted()) {
+		mem_wait(EV_A_ container_of(server, conn_t, server), CONN_WAIT_SERVER, w);
+		return;
+	}
+
+	if (remote->tfo == TFO_SENT && remote->buf->len == 0) {
+		// the SYN payload is out, relay the rest by splice
+		buf_pipe_open(remote->buf);
+		remote->tfo = TFO_DONE;
+	}
+
+	ssize_t r = buf_recv(server->fd, remote->buf);
 	if (r == 0) {
 		// connection closed
 		if (verbose) {
@@ -298,27 +987,24 @@ static void server_recv_cb(EV_P_ ev_io *w, int revents)
 			return;
 		}
 	}
-	tx += r;
-	remote->buf->len = r;
+	worker_self->stats.tx += r;
 
 	if (server->stage == STAGE_STREAM) {
 		ev_timer_again(EV_A_ & server->recv_ctx->watcher);
 
-		int s = send(remote->fd, remote->buf->data, remote->buf->len, 0);
+		ssize_t s = buf_send(remote->fd, remote->buf);
 		if (s == -1) {
 			if (errno == EAGAIN || errno == EWOULDBLOCK) {
 				// no data, wait for send
-				remote->buf->idx = 0;
 				ev_io_stop(EV_A_ & server_recv_ctx->io);
 				ev_io_start(EV_A_ & remote->send_ctx->io);
 			} else {
+				tfo_connect_error(remote, errno);
 				perror("server_recv_send");
 				close_and_free_remote(EV_A_ remote);
 				close_and_free_server(EV_A_ server);
 			}
-		} else if (s < remote->buf->len) {
-			remote->buf->len -= s;
-			remote->buf->idx  = s;
+		} else if (remote->buf->len > 0) {
 			ev_io_stop(EV_A_ & server_recv_ctx->io);
 			ev_io_start(EV_A_ & remote->send_ctx->io);
 		}
@@ -353,7 +1039,7 @@ static void server_send_cb(EV_P_ ev_io *w, int revents)
 		return;
 	} else {
 		// has data to send
-		ssize_t s = send(server->fd, server->buf->data + server->buf->idx, server->buf->len, 0);
+		ssize_t s = buf_send(server->fd, server->buf);
 		if (s == -1) {
 			if (errno != EAGAIN && errno != EWOULDBLOCK) {
 				perror("server_send_send");
@@ -361,10 +1047,8 @@ static void server_send_cb(EV_P_ ev_io *w, int revents)
 				close_and_free_server(EV_A_ server);
 			}
 			return;
-		} else if (s < server->buf->len) {
-			// partly sent, move memory, wait for the next time to send
-			server->buf->len -= s;
-			server->buf->idx += s;
+		} else if (server->buf->len > 0) {
+			// partly sent, wait for the next time to send
 			return;
 		} else {
 			// all sent out, wait for reading
@@ -385,8 +1069,18 @@ static void server_timeout_cb(EV_P_ ev_timer *watcher, int revents)
 	if (verbose) {
 		printf("TCP connection timeout\n");
 	}
+	worker_self->stats.timeouts++;
 
-	close_and_free_remote(EV_A_ remote);
+#ifdef NATCAPD_IOURING
+	if (worker_self->uring != NULL) {
+		conn_t *conn = container_of(server, conn_t, server);
+		uring_conn_close(EV_A_ conn);
+		uring_conn_release(EV_A_ worker_self->uring, conn);
+		return;
+	}
+#endif
+
+	close_and_free_remote(EV_A_ remote);
 	close_and_free_server(EV_A_ server);
 }
 
@@ -404,7 +1098,12 @@ static void remote_recv_cb(EV_P_ ev_io *w, int revents)
 
 	ev_timer_again(EV_A_ & server->recv_ctx->watcher);
 
-	ssize_t r = recv(remote->fd, server->buf->data, BUF_SIZE, 0);
+	if (mem_exhausted()) {
+		mem_wait(EV_A_ container_of(remote, conn_t, remote), CONN_WAIT_REMOTE, w);
+		return;
+	}
+
+	ssize_t r = buf_recv(remote->fd, server->buf);
 	if (r == 0) {
 		// connection closed
 		if (verbose) {
@@ -420,19 +1119,18 @@ static void remote_recv_cb(EV_P_ ev_io *w, int revents)
 			return;
 		} else {
 			//perror("remote recv");
+			tfo_connect_error(remote, errno);
 			close_and_free_remote(EV_A_ remote);
 			close_and_free_server(EV_A_ server);
 			return;
 		}
 	}
-	rx += r;
-	server->buf->len = r;
+	worker_self->stats.rx += r;
 
-	int s = send(server->fd, server->buf->data, server->buf->len, 0);
+	ssize_t s = buf_send(server->fd, server->buf);
 	if (s == -1) {
 		if (errno == EAGAIN || errno == EWOULDBLOCK) {
 			// no data, wait for send
-			server->buf->idx = 0;
 			ev_io_stop(EV_A_ & remote_recv_ctx->io);
 			ev_io_start(EV_A_ & server->send_ctx->io);
 		} else {
@@ -441,9 +1139,7 @@ static void remote_recv_cb(EV_P_ ev_io *w, int revents)
 			close_and_free_server(EV_A_ server);
 			return;
 		}
-	} else if (s < server->buf->len) {
-		server->buf->len -= s;
-		server->buf->idx  = s;
+	} else if (server->buf->len > 0) {
 		ev_io_stop(EV_A_ & remote_recv_ctx->io);
 		ev_io_start(EV_A_ & server->send_ctx->io);
 	}
@@ -454,7 +1150,42 @@ static void remote_recv_cb(EV_P_ ev_io *w, int revents)
 		setsockopt(server->fd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
 		setsockopt(remote->fd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
 		remote->recv_ctx->connected = 1;
+		if (remote->tfo != TFO_NONE) {
+			// the SYN left with the first payload, count the time to the first response
+			connect_done(EV_A_ remote);
+			if (tfo_syn_data(remote->fd)) {
+				worker_self->stats.tfo_hits++;
+			} else {
+				worker_self->stats.tfo_fallbacks++;
+			}
+		}
+	}
+}
+
+/* no client data came for the SYN, the destination may speak first: connect without data */
+static void tfo_timer_cb(EV_P_ ev_timer *w, int revents)
+{
+	remote_t *remote = container_of(w, remote_t, tfo_timer);
+	server_t *server = remote->server;
+
+	if (remote->tfo != TFO_DEFER) {
+		return;
 	}
+	// a zero length send makes the deferred connect send its SYN
+	if (send(remote->fd, NULL, 0, MSG_NOSIGNAL) == -1 && errno != EINPROGRESS && errno != EAGAIN && errno != EWOULDBLOCK) {
+		connect_error(errno);
+		perror("remote_tfo_connect");
+		close_and_free_remote(EV_A_ remote);
+		close_and_free_server(EV_A_ server);
+		return;
+	}
+	// from here on it is a plain connect, seen done when the socket gets writable
+	remote->tfo = TFO_NONE;
+	remote->connect_start = ev_now(EV_A);
+	if (remote->buf->len == 0) {
+		buf_pipe_open(remote->buf);
+	}
+	ev_io_start(EV_A_ & remote->send_ctx->io);
 }
 
 static void remote_send_cb(EV_P_ ev_io *w, int revents)
@@ -469,6 +1200,35 @@ static void remote_send_cb(EV_P_ ev_io *w, int revents)
 		return;
 	}
 
+	if (remote->tfo == TFO_DEFER) {
+		if (remote->buf->len == 0) {
+			// wait for the first payload, it goes out in the SYN
+			ev_io_stop(EV_A_ & remote_send_ctx->io);
+			ev_io_start(EV_A_ & server->recv_ctx->io);
+			return;
+		}
+		ssize_t s = buf_send(remote->fd, remote->buf);
+		if (s == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINPROGRESS) {
+			connect_error(errno);
+			perror("remote_send_fastopen");
+			close_and_free_remote(EV_A_ remote);
+			close_and_free_server(EV_A_ server);
+			return;
+		}
+		// on EINPROGRESS there is no cookie yet, the data follow the handshake
+		ev_timer_stop(EV_A_ & remote->tfo_timer);
+		remote->tfo = TFO_SENT;
+		remote->connect_start = ev_now(EV_A);
+		remote_send_ctx->connected = 1;
+		server->stage = STAGE_STREAM;
+		ev_io_start(EV_A_ & remote->recv_ctx->io);
+		if (remote->buf->len == 0) {
+			ev_io_stop(EV_A_ & remote_send_ctx->io);
+			ev_io_start(EV_A_ & server->recv_ctx->io);
+		}
+		return;
+	}
+
 	if (!remote_send_ctx->connected) {
 		struct sockaddr_storage addr;
 		socklen_t len = sizeof(struct sockaddr_storage);
@@ -478,6 +1238,7 @@ static void remote_send_cb(EV_P_ ev_io *w, int revents)
 			if (verbose) {
 				printf("remote connected\n");
 			}
+			connect_done(EV_A_ remote);
 			remote_send_ctx->connected = 1;
 			if (server->stage != STAGE_STREAM) {
 				server->stage = STAGE_STREAM;
@@ -490,6 +1251,10 @@ static void remote_send_cb(EV_P_ ev_io *w, int revents)
 				return;
 			}
 		} else {
+			int err = 0;
+			socklen_t errlen = sizeof(err);
+			getsockopt(remote->fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+			connect_error(err);
 			perror("remote_send_getpeername");
 			// not connected
 			close_and_free_remote(EV_A_ remote);
@@ -508,19 +1273,18 @@ static void remote_send_cb(EV_P_ ev_io *w, int revents)
 		return;
 	} else {
 		// has data to send
-		ssize_t s = send(remote->fd, remote->buf->data + remote->buf->idx, remote->buf->len, 0);
+		ssize_t s = buf_send(remote->fd, remote->buf);
 		if (s == -1) {
 			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				tfo_connect_error(remote, errno);
 				perror("remote_send_send");
 				// close and free
 				close_and_free_remote(EV_A_ remote);
 				close_and_free_server(EV_A_ server);
 				return;
 			}
-		} else if (s < remote->buf->len) {
-			// partly sent, move memory, wait for the next time to send
-			remote->buf->len -= s;
-			remote->buf->idx += s;
+		} else if (remote->buf->len > 0) {
+			// partly sent, wait for the next time to send
 		} else {
 			// all sent out, wait for reading
 			remote->buf->len = 0;
@@ -535,20 +1299,21 @@ static void remote_send_cb(EV_P_ ev_io *w, int revents)
 	}
 }
 
-static remote_t *new_remote(int fd)
+static remote_t *new_remote(int fd, server_t *server)
 {
-	if (verbose) {
-		remote_conn++;
-	}
+	conn_t *conn = container_of(server, conn_t, server);
+
+	worker_self->stats.remote_conn++;
+	worker_self->stats.remote_total++;
 
-	remote_t *remote = malloc(sizeof(remote_t));
+	remote_t *remote = &conn->remote;
 	memset(remote, 0, sizeof(remote_t));
+	conn->refs++;
 
-	remote->recv_ctx = malloc(sizeof(remote_ctx_t));
-	remote->send_ctx = malloc(sizeof(remote_ctx_t));
-	remote->buf = malloc(sizeof(buffer_t));
-	remote->buf->len = 0;
-	remote->buf->idx = 0;
+	remote->recv_ctx = &conn->remote_recv_ctx;
+	remote->send_ctx = &conn->remote_send_ctx;
+	remote->buf = &conn->remote_buf;
+	buf_init(remote->buf);
 	memset(remote->recv_ctx, 0, sizeof(remote_ctx_t));
 	memset(remote->send_ctx, 0, sizeof(remote_ctx_t));
 	remote->fd                  = fd;
@@ -570,11 +1335,9 @@ static void free_remote(remote_t *remote)
 		remote->server->remote = NULL;
 	}
 	if (remote->buf != NULL) {
-		free(remote->buf);
+		buf_release(remote->buf);
 	}
-	free(remote->recv_ctx);
-	free(remote->send_ctx);
-	free(remote);
+	conn_put(container_of(remote, conn_t, remote));
 }
 
 static void close_and_free_remote(EV_P_ remote_t *remote)
@@ -582,33 +1345,34 @@ static void close_and_free_remote(EV_P_ remote_t *remote)
 	if (remote != NULL) {
 		ev_io_stop(EV_A_ & remote->send_ctx->io);
 		ev_io_stop(EV_A_ & remote->recv_ctx->io);
+		ev_timer_stop(EV_A_ & remote->tfo_timer);
+		mem_wait_clear(container_of(remote, conn_t, remote), CONN_WAIT_REMOTE);
 		close(remote->fd);
 		free_remote(remote);
+		worker_self->stats.remote_conn--;
 		if (verbose) {
-			remote_conn--;
-			printf("current remote connection: %d\n", remote_conn);
+			printf("[%d] current remote connection: %d\n", worker_self->id, worker_self->stats.remote_conn);
 		}
 	}
 }
 
 static server_t *new_server(int fd, listen_ctx_t *listener)
 {
-	if (verbose) {
-		server_conn++;
+	conn_t *conn = conn_alloc();
+	if (conn == NULL) {
+		return NULL;
 	}
 
-	server_t *server;
-	server = malloc(sizeof(server_t));
+	worker_self->stats.server_conn++;
+	worker_self->stats.server_total++;
 
-	memset(server, 0, sizeof(server_t));
+	server_t *server = &conn->server;
+	conn->refs = 1;
 
-	server->recv_ctx   = malloc(sizeof(server_ctx_t));
-	server->send_ctx   = malloc(sizeof(server_ctx_t));
-	memset(server->recv_ctx, 0, sizeof(server_ctx_t));
-	memset(server->send_ctx, 0, sizeof(server_ctx_t));
-	server->buf = malloc(sizeof(buffer_t));
-	server->buf->len = 0;
-	server->buf->idx = 0;
+	server->recv_ctx   = &conn->server_recv_ctx;
+	server->send_ctx   = &conn->server_send_ctx;
+	server->buf        = &conn->server_buf;
+	buf_init(server->buf);
 	server->fd                  = fd;
 	server->recv_ctx->server    = server;
 	server->recv_ctx->connected = 0;
@@ -635,12 +1399,9 @@ static void free_server(server_t *server)
 		server->remote->server = NULL;
 	}
 	if (server->buf != NULL) {
-		free(server->buf);
+		buf_release(server->buf);
 	}
-
-	free(server->recv_ctx);
-	free(server->send_ctx);
-	free(server);
+	conn_put(container_of(server, conn_t, server));
 }
 
 static void close_and_free_server(EV_P_ server_t *server)
@@ -649,13 +1410,702 @@ static void close_and_free_server(EV_P_ server_t *server)
 		ev_io_stop(EV_A_ & server->send_ctx->io);
 		ev_io_stop(EV_A_ & server->recv_ctx->io);
 		ev_timer_stop(EV_A_ & server->recv_ctx->watcher);
+		mem_wait_clear(container_of(server, conn_t, server), CONN_WAIT_SERVER);
 		close(server->fd);
 		free_server(server);
+		worker_self->stats.server_conn--;
+		if (verbose) {
+			printf("[%d] current server connection: %d\n", worker_self->id, worker_self->stats.server_conn);
+		}
+	}
+}
+
+#ifdef NATCAPD_IOURING
+/*
+ * io_uring relay: a recv picks a provided buffer of the worker ring and its
+ * completion queues the send of that buffer linked with the next recv, so
+ * one direction has a single recv or send in flight and holds a buffer only
+ * between the two. the sqes of a loop iteration go out with one submit from
+ * the prepare watcher, libev keeps the timers and wakes on the ring fd.
+ */
+static int uring_fixed(uring_ctx_t *u, int fd)
+{
+	return fd < u->files_num ? IOSQE_FIXED_FILE : 0;
+}
+
+static int uring_register(uring_ctx_t *u, int fd)
+{
+	if (fd >= u->files_num) {
+		return 0;
+	}
+	return io_uring_register_files_update(&u->ring, fd, &fd, 1) == 1 ? 0 : -1;
+}
+
+static void uring_unregister(uring_ctx_t *u, int fd)
+{
+	int none = -1;
+
+	if (fd >= 0 && fd < u->files_num) {
+		io_uring_register_files_update(&u->ring, fd, &none, 1);
+	}
+}
+
+static int uring_submit(uring_ctx_t *u)
+{
+	int ret = io_uring_submit(&u->ring);
+
+	// -EBUSY: the cq overflowed, the sqes stay queued until it is reaped
+	if (ret < 0 && ret != -EBUSY && ret != -EAGAIN && ret != -EINTR && verbose) {
+		printf("uring submit: %s\n", strerror(-ret));
+	}
+	return ret;
+}
+
+/* get n sqes in a row, a link must not be split by a submit
+ * NULL when the sq stays full, the op goes to the retry list then
+ */
+static struct io_uring_sqe *uring_sqe(uring_ctx_t *u, unsigned int n)
+{
+	if (io_uring_sq_space_left(&u->ring) < n) {
+		uring_submit(u);
+		if (io_uring_sq_space_left(&u->ring) < n) {
+			return NULL;
+		}
+	}
+	return io_uring_get_sqe(&u->ring);
+}
+
+static void uring_prep_recv(uring_ctx_t *u, struct io_uring_sqe *sqe, conn_t *conn, int op)
+{
+	int fd = op == URING_OP_SRV_RECV ? conn->server.fd : conn->remote.fd;
+
+	io_uring_prep_recv(sqe, fd, NULL, URING_BUF_SIZE, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT | uring_fixed(u, fd);
+	sqe->buf_group = URING_BGID;
+	io_uring_sqe_set_data64(sqe, (uintptr_t)conn | op);
+}
+
+/* put the op of @data into the sq, -1 if there is no room */
+static int uring_issue(uring_ctx_t *u, uint64_t data)
+{
+	int op = data & URING_OP_MASK;
+	void *ptr = (void *)(uintptr_t)(data & ~(uint64_t)URING_OP_MASK);
+	listen_ctx_t *listener = ptr;
+	conn_t *conn = ptr;
+	struct io_uring_sqe *sqe;
+	buffer_t *buf;
+	int out;
+
+	sqe = uring_sqe(u, op == URING_OP_SRV_SEND || op == URING_OP_RMT_SEND ? 2 : 1);
+	if (sqe == NULL) {
+		return -1;
+	}
+
+	switch (op) {
+	case URING_OP_ACCEPT:
+		io_uring_prep_multishot_accept(sqe, listener->fd, NULL, NULL, 0);
+		break;
+	case URING_OP_CANCEL:
+		io_uring_prep_cancel64(sqe, (uintptr_t)listener | URING_OP_ACCEPT, 0);
+		break;
+	case URING_OP_CONNECT:
+		io_uring_prep_connect(sqe, conn->remote.fd, (struct sockaddr *)&conn->dest, sizeof(struct sockaddr_in));
+		sqe->flags |= uring_fixed(u, conn->remote.fd);
+		break;
+	case URING_OP_SRV_RECV:
+	case URING_OP_RMT_RECV:
+		uring_prep_recv(u, sqe, conn, op);
+		return 0;
+	case URING_OP_SRV_SEND:
+	case URING_OP_RMT_SEND:
+		// the next recv starts once the whole buffer is out, a failed send cancels it
+		out = op == URING_OP_SRV_SEND ? conn->remote.fd : conn->server.fd;
+		buf = op == URING_OP_SRV_SEND ? &conn->remote_buf : &conn->server_buf;
+		io_uring_prep_send(sqe, out, buf->data, buf->len, MSG_WAITALL);
+		sqe->flags |= IOSQE_IO_LINK | uring_fixed(u, out);
+		io_uring_sqe_set_data64(sqe, data);
+		uring_prep_recv(u, io_uring_get_sqe(&u->ring), conn, op - 1);
+		return 0;
+	}
+	io_uring_sqe_set_data64(sqe, data);
+	return 0;
+}
+
+/* the references of the op are taken by the caller, a retried op keeps them */
+static void uring_queue(uring_ctx_t *u, void *ptr, int op)
+{
+	uint64_t data = (uintptr_t)ptr | op;
+
+	if (u->retry_num == 0 && uring_issue(u, data) == 0) {
+		return;
+	}
+	if (u->retry_num == u->retry_size) {
+		unsigned int size = u->retry_size ? u->retry_size * 2 : 256;
+		uint64_t *retry = realloc(u->retry, size * sizeof(uint64_t));
+		if (retry == NULL) {
+			FATAL("realloc() error");
+		}
+		u->retry = retry;
+		u->retry_size = size;
+	}
+	u->retry[u->retry_num++] = data;
+}
+
+/* issue the ops that found the sq full, in order */
+static void uring_retry(uring_ctx_t *u)
+{
+	unsigned int i;
+
+	for (i = 0; i < u->retry_num; i++) {
+		if (uring_issue(u, u->retry[i]) != 0) {
+			break;
+		}
+	}
+	if (i > 0) {
+		u->retry_num -= i;
+		memmove(u->retry, u->retry + i, u->retry_num * sizeof(uint64_t));
+	}
+}
+
+static void uring_accept_arm(uring_ctx_t *u, listen_ctx_t *listener)
+{
+	uring_queue(u, listener, URING_OP_ACCEPT);
+}
+
+static void uring_accept_cancel(uring_ctx_t *u, listen_ctx_t *listener)
+{
+	uring_queue(u, listener, URING_OP_CANCEL);
+	uring_submit(u);
+}
+
+static void uring_recv(uring_ctx_t *u, conn_t *conn, int op)
+{
+	conn->inflight++;
+	uring_queue(u, conn, op);
+}
+
+/* hand the buffer back to the ring, a recv paused on an empty ring takes it */
+static void uring_buf_put(uring_ctx_t *u, buffer_t *buf)
+{
+	conn_t *conn;
+
+	io_uring_buf_ring_add(u->br, u->bufs + (size_t)buf->bid * URING_BUF_SIZE, URING_BUF_SIZE,
+			buf->bid, io_uring_buf_ring_mask(u->buf_num), 0);
+	io_uring_buf_ring_advance(u->br, 1);
+	buf->data = NULL;
+	buf->len = 0;
+	buf->idx = 0;
+	worker_self->stats.mem_used -= URING_BUF_SIZE;
+
+	conn = worker_self->wait_list;
+	if (conn != NULL) {
+		int flag = (conn->wait & CONN_WAIT_SERVER) ? CONN_WAIT_SERVER : CONN_WAIT_REMOTE;
+		mem_wait_clear(conn, flag);
+		uring_recv(u, conn, flag == CONN_WAIT_SERVER ? URING_OP_SRV_RECV : URING_OP_RMT_RECV);
+	}
+}
+
+/* shut the sockets down, the pending recvs and sends complete and drop their references */
+static void uring_conn_close(EV_P_ conn_t *conn)
+{
+	if (conn->closing) {
+		return;
+	}
+	conn->closing = 1;
+	ev_timer_stop(EV_A_ & conn->server_recv_ctx.watcher);
+	mem_wait_clear(conn, CONN_WAIT_SERVER | CONN_WAIT_REMOTE);
+	shutdown(conn->server.fd, SHUT_RDWR);
+	if (conn->server.remote != NULL) {
+		shutdown(conn->remote.fd, SHUT_RDWR);
+	}
+}
+
+static void uring_conn_release(EV_P_ uring_ctx_t *u, conn_t *conn)
+{
+	server_t *server = &conn->server;
+
+	if (!conn->closing || conn->inflight > 0) {
+		return;
+	}
+	if (server->remote != NULL) {
+		uring_unregister(u, server->remote->fd);
+		close_and_free_remote(EV_A_ server->remote);
+	}
+	uring_unregister(u, server->fd);
+	close_and_free_server(EV_A_ server);
+}
+
+static void uring_stream(uring_ctx_t *u, conn_t *conn)
+{
+	conn->server.stage = STAGE_STREAM;
+	uring_recv(u, conn, URING_OP_SRV_RECV);
+	uring_recv(u, conn, URING_OP_RMT_RECV);
+}
+
+/* the connection got its remote, move it onto the ring */
+static void uring_start(EV_P_ uring_ctx_t *u, conn_t *conn)
+{
+	server_t *server = &conn->server;
+	remote_t *remote = server->remote;
+
+	if (uring_register(u, server->fd) != 0 || uring_register(u, remote->fd) != 0) {
+		uring_unregister(u, server->fd);
+		uring_unregister(u, remote->fd);
+		close_and_free_remote(EV_A_ remote);
+		close_and_free_server(EV_A_ server);
+		return;
+	}
+
+	if (remote->connect_start > 0) {
+		conn->inflight++;
+		uring_queue(u, conn, URING_OP_CONNECT);
+	} else {
+		// a warm socket has done its handshake
+		uring_stream(u, conn);
+	}
+}
+
+static void uring_connect_done(EV_P_ uring_ctx_t *u, conn_t *conn, int res)
+{
+	if (conn->closing) {
+		return;
+	}
+	if (res < 0) {
+		connect_error(-res);
+		uring_conn_close(EV_A_ conn);
+		return;
+	}
+	connect_done(EV_A_ & conn->remote);
+	conn->remote_send_ctx.connected = 1;
+	uring_stream(u, conn);
+}
+
+static void uring_recv_done(EV_P_ uring_ctx_t *u, conn_t *conn, int op, struct io_uring_cqe *cqe)
+{
+	buffer_t *buf = op == URING_OP_SRV_RECV ? &conn->remote_buf : &conn->server_buf;
+
+	if (cqe->res > 0) {
+		buf->bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		buf->data = u->bufs + (size_t)buf->bid * URING_BUF_SIZE;
+		buf->len = cqe->res;
+		buf->idx = 0;
+		worker_self->stats.mem_used += URING_BUF_SIZE;
+	}
+
+	if (conn->closing) {
+		if (buf->data != NULL) {
+			uring_buf_put(u, buf);
+		}
+		return;
+	}
+	if (cqe->res == -ENOBUFS) {
+		// the ring is the memory budget, wait for a buffer to come back
+		mem_wait_link(conn, op == URING_OP_SRV_RECV ? CONN_WAIT_SERVER : CONN_WAIT_REMOTE);
+		return;
+	}
+	if (cqe->res <= 0) {
+		uring_conn_close(EV_A_ conn);
+		return;
+	}
+
+	if (op == URING_OP_SRV_RECV) {
+		worker_self->stats.tx += cqe->res;
+	} else {
+		worker_self->stats.rx += cqe->res;
+		// Disable TCP_NODELAY after the first response are sent
+		if (!conn->remote_recv_ctx.connected) {
+			int opt = 0;
+			setsockopt(conn->server.fd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
+			setsockopt(conn->remote.fd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
+			conn->remote_recv_ctx.connected = 1;
+		}
+	}
+	ev_timer_again(EV_A_ & conn->server_recv_ctx.watcher);
+
+	// the send and its linked recv
+	conn->inflight += 2;
+	uring_queue(u, conn, op + 1);
+}
+
+static void uring_send_done(EV_P_ uring_ctx_t *u, conn_t *conn, int op, int res)
+{
+	buffer_t *buf = op == URING_OP_SRV_SEND ? &conn->remote_buf : &conn->server_buf;
+	int len = buf->len;
+
+	uring_buf_put(u, buf);
+	if (res != len && !conn->closing) {
+		if (res < 0 && verbose) {
+			printf("uring send: %s\n", strerror(-res));
+		}
+		uring_conn_close(EV_A_ conn);
+	}
+}
+
+static void uring_cqe(EV_P_ uring_ctx_t *u, struct io_uring_cqe *cqe)
+{
+	uint64_t data = io_uring_cqe_get_data64(cqe);
+	int op = data & URING_OP_MASK;
+	void *ptr = (void *)(uintptr_t)(data & ~(uint64_t)URING_OP_MASK);
+	conn_t *conn = ptr;
+
+	switch (op) {
+	case URING_OP_ACCEPT:
+		if (cqe->res >= 0) {
+			accept_fd(EV_A_ (listen_ctx_t *)ptr, cqe->res);
+		} else if (cqe->res != -ECANCELED && verbose) {
+			printf("uring accept: %s\n", strerror(-cqe->res));
+		}
+		if (!(cqe->flags & IORING_CQE_F_MORE) && !worker_self->draining) {
+			uring_accept_arm(u, (listen_ctx_t *)ptr);
+		}
+		return;
+	case URING_OP_CONNECT:
+		conn->inflight--;
+		uring_connect_done(EV_A_ u, conn, cqe->res);
+		break;
+	case URING_OP_SRV_RECV:
+	case URING_OP_RMT_RECV:
+		conn->inflight--;
+		uring_recv_done(EV_A_ u, conn, op, cqe);
+		break;
+	case URING_OP_SRV_SEND:
+	case URING_OP_RMT_SEND:
+		conn->inflight--;
+		uring_send_done(EV_A_ u, conn, op, cqe->res);
+		break;
+	default:
+		// cancel requests
+		return;
+	}
+	uring_conn_release(EV_A_ u, conn);
+}
+
+static void uring_cb(EV_P_ ev_io *w, int revents)
+{
+	uring_ctx_t *u = container_of(w, uring_ctx_t, io);
+	struct io_uring_cqe *cqe;
+	unsigned int head, n = 0;
+
+	io_uring_for_each_cqe(&u->ring, head, cqe) {
+		uring_cqe(EV_A_ u, cqe);
+		n++;
+	}
+	io_uring_cq_advance(&u->ring, n);
+	uring_retry(u);
+}
+
+static void uring_prepare_cb(EV_P_ ev_prepare *w, int revents)
+{
+	uring_ctx_t *u = container_of(w, uring_ctx_t, prepare);
+
+	if (io_uring_sq_ready(&u->ring) > 0 && uring_submit(u) == -EBUSY) {
+		// make room in the cq, the completions queue more sqes and submit again
+		uring_cb(EV_A_ & u->io, EV_READ);
+		uring_submit(u);
+	}
+	if (u->retry_num > 0) {
+		uring_retry(u);
+		if (io_uring_sq_ready(&u->ring) > 0) {
+			uring_submit(u);
+		}
+	}
+}
+
+/* the ring buffers are the memory budget of the worker, NULL if the kernel lacks io_uring */
+static uring_ctx_t *uring_init(worker_t *worker)
+{
+	uring_ctx_t *u;
+	struct rlimit rl;
+	unsigned int num;
+	int ret;
+
+	u = calloc(1, sizeof(uring_ctx_t));
+	if (u == NULL) {
+		return NULL;
+	}
+	if (io_uring_queue_init(URING_ENTRIES, &u->ring, 0) != 0) {
+		free(u);
+		return NULL;
+	}
+
+	num = worker->mem_budget != 0 ? worker->mem_budget / URING_BUF_SIZE : URING_BUF_DEFAULT;
+	num = max(min(num, URING_BUF_MAX), URING_BUF_MIN);
+	while (num & (num - 1)) {
+		num &= num - 1;
+	}
+	u->buf_num = num;
+	if (posix_memalign((void **)&u->bufs, 4096, (size_t)num * URING_BUF_SIZE) != 0) {
+		goto err_ring;
+	}
+	u->br = io_uring_setup_buf_ring(&u->ring, num, URING_BGID, 0, &ret);
+	if (u->br == NULL) {
+		goto err_bufs;
+	}
+	for (unsigned int i = 0; i < num; i++) {
+		io_uring_buf_ring_add(u->br, u->bufs + (size_t)i * URING_BUF_SIZE, URING_BUF_SIZE,
+				i, io_uring_buf_ring_mask(num), i);
+	}
+	io_uring_buf_ring_advance(u->br, num);
+	// the ring bounds the buffers, the libev budget checks stay off
+	worker->mem_budget = 0;
+
+	// fixed files are kept at the slot of their fd number, larger fds go unregistered
+	u->files_num = URING_FILES_MAX;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < URING_FILES_MAX) {
+		u->files_num = rl.rlim_cur;
+	}
+	if (io_uring_register_files_sparse(&u->ring, u->files_num) != 0) {
+		u->files_num = 0;
+	}
+
+	ev_io_init(&u->io, uring_cb, u->ring.ring_fd, EV_READ);
+	ev_io_start(worker->loop, &u->io);
+	ev_prepare_init(&u->prepare, uring_prepare_cb);
+	ev_prepare_start(worker->loop, &u->prepare);
+	return u;
+
+err_bufs:
+	free(u->bufs);
+err_ring:
+	io_uring_queue_exit(&u->ring);
+	free(u);
+	return NULL;
+}
+
+static void uring_exit(worker_t *worker)
+{
+	uring_ctx_t *u = worker->uring;
+
+	ev_io_stop(worker->loop, &u->io);
+	ev_prepare_stop(worker->loop, &u->prepare);
+	io_uring_free_buf_ring(&u->ring, u->br, u->buf_num, URING_BGID);
+	io_uring_queue_exit(&u->ring);
+	free(u->bufs);
+	free(u->retry);
+	free(u);
+	worker->uring = NULL;
+}
+#endif
+
+static void stats_report(FILE *fp)
+{
+	worker_stats_t sum;
+
+	memset(&sum, 0, sizeof(sum));
+	for (int i = 0; i < worker_num; i++) {
+		worker_stats_t *st = &workers[i].stats;
+		fprintf(fp, "worker[%d] cpu=%d server_conn=%d remote_conn=%d server_total=%llu remote_total=%llu tx=%llu rx=%llu mem_used=%llu mem_pauses=%llu\n",
+				i, workers[i].cpu, st->server_conn, st->remote_conn,
+				(unsigned long long)st->server_total, (unsigned long long)st->remote_total,
+				(unsigned long long)st->tx, (unsigned long long)st->rx,
+				(unsigned long long)st->mem_used, (unsigned long long)st->mem_pauses);
+		if (tfo_enabled) {
+			fprintf(fp, "worker[%d] tfo_accepts=%llu tfo_hits=%llu tfo_fallbacks=%llu\n",
+					i, (unsigned long long)st->tfo_accepts,
+					(unsigned long long)st->tfo_hits, (unsigned long long)st->tfo_fallbacks);
+		}
+#ifdef NATCAP_CLIENT_MODE
+		if (warm_pool_size > 0) {
+			fprintf(fp, "worker[%d] warm_hits=%llu warm_misses=%llu\n",
+					i, (unsigned long long)st->warm_hits, (unsigned long long)st->warm_misses);
+		}
+#endif
+		sum.server_conn += st->server_conn;
+		sum.remote_conn += st->remote_conn;
+		sum.server_total += st->server_total;
+		sum.remote_total += st->remote_total;
+		sum.tx += st->tx;
+		sum.rx += st->rx;
+		sum.mem_used += st->mem_used;
+		sum.mem_pauses += st->mem_pauses;
+		sum.warm_hits += st->warm_hits;
+		sum.warm_misses += st->warm_misses;
+		sum.tfo_accepts += st->tfo_accepts;
+		sum.tfo_hits += st->tfo_hits;
+		sum.tfo_fallbacks += st->tfo_fallbacks;
+	}
+	fprintf(fp, "total server_conn=%d remote_conn=%d server_total=%llu remote_total=%llu tx=%llu rx=%llu mem_used=%llu mem_pauses=%llu\n",
+			sum.server_conn, sum.remote_conn,
+			(unsigned long long)sum.server_total, (unsigned long long)sum.remote_total,
+			(unsigned long long)sum.tx, (unsigned long long)sum.rx,
+			(unsigned long long)sum.mem_used, (unsigned long long)sum.mem_pauses);
+	if (tfo_enabled) {
+		fprintf(fp, "total tfo_accepts=%llu tfo_hits=%llu tfo_fallbacks=%llu\n",
+				(unsigned long long)sum.tfo_accepts,
+				(unsigned long long)sum.tfo_hits, (unsigned long long)sum.tfo_fallbacks);
+	}
+#ifdef NATCAP_CLIENT_MODE
+	if (warm_pool_size > 0) {
+		fprintf(fp, "total warm_hits=%llu warm_misses=%llu\n",
+				(unsigned long long)sum.warm_hits, (unsigned long long)sum.warm_misses);
+	}
+#endif
+	fflush(fp);
+}
+
+static void metrics_hist(FILE *fp, const char *name, int id, const uint64_t *hist,
+		const unsigned int *bounds, int num, uint64_t usec)
+{
+	uint64_t count = 0;
+
+	for (int i = 0; i < num; i++) {
+		count += hist[i];
+		if (i < num - 1) {
+			fprintf(fp, "natcapd_%s_seconds_bucket{worker=\"%d\",le=\"%g\"} %llu\n",
+					name, id, bounds[i] / 1000000.0, (unsigned long long)count);
+		} else {
+			fprintf(fp, "natcapd_%s_seconds_bucket{worker=\"%d\",le=\"+Inf\"} %llu\n",
+					name, id, (unsigned long long)count);
+		}
+	}
+	fprintf(fp, "natcapd_%s_seconds_sum{worker=\"%d\"} %g\n", name, id, usec / 1000000.0);
+	fprintf(fp, "natcapd_%s_seconds_count{worker=\"%d\"} %llu\n", name, id, (unsigned long long)count);
+}
+
+/* text exposition of the worker stats, read without locking */
+static void metrics_report(FILE *fp)
+{
+	for (int i = 0; i < worker_num; i++) {
+		worker_stats_t *st = &workers[i].stats;
+		const struct {
+			const char *name;
+			unsigned long long val;
+		} list[] = {
+			{ "server_conn", st->server_conn },
+			{ "remote_conn", st->remote_conn },
+			{ "server_total", st->server_total },
+			{ "remote_total", st->remote_total },
+			{ "tx_bytes", st->tx },
+			{ "rx_bytes", st->rx },
+			{ "timeouts", st->timeouts },
+			{ "mem_used_bytes", st->mem_used },
+			{ "mem_pauses", st->mem_pauses },
+			{ "warm_hits", st->warm_hits },
+			{ "warm_misses", st->warm_misses },
+			{ "tfo_accepts", st->tfo_accepts },
+			{ "tfo_hits", st->tfo_hits },
+			{ "tfo_fallbacks", st->tfo_fallbacks },
+		};
+
+		for (int j = 0; j < sizeof(list) / sizeof(list[0]); j++) {
+			fprintf(fp, "natcapd_%s{worker=\"%d\"} %llu\n", list[j].name, i, list[j].val);
+		}
+		for (int e = 0; e < ERRNO_NUM; e++) {
+			if (st->connect_errors[e] != 0) {
+				fprintf(fp, "natcapd_connect_errors{worker=\"%d\",errno=\"%d\"} %llu\n",
+						i, e, (unsigned long long)st->connect_errors[e]);
+			}
+		}
+		metrics_hist(fp, "connect", i, st->connect_hist, connect_hist_bounds, CONNECT_HIST_NUM, st->connect_usec);
+		if (tfo_enabled) {
+			metrics_hist(fp, "tfo_response", i, st->tfo_response_hist, connect_hist_bounds, CONNECT_HIST_NUM, st->tfo_response_usec);
+		}
+		metrics_hist(fp, "loop", i, st->loop_hist, loop_hist_bounds, LOOP_HIST_NUM, st->loop_usec);
+	}
+	fflush(fp);
+}
+
+/* served by the main loop, the workers only pay for the counters */
+static void metrics_accept_cb(EV_P_ ev_io *w, int revents)
+{
+	int fd = accept(w->fd, NULL, NULL);
+	if (fd == -1) {
+		return;
+	}
+
+	struct timeval tv = { 1, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	FILE *fp = fdopen(fd, "w");
+	if (fp == NULL) {
+		close(fd);
+		return;
+	}
+	metrics_report(fp);
+	fclose(fp);
+}
+
+static int metrics_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		return -1;
+	}
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1) {
+		close(fd);
+		return -1;
+	}
+	setnonblocking(fd);
+	return fd;
+}
+
+static void metrics_close(int do_unlink)
+{
+	if (metrics_path == NULL || !ev_is_active(&metrics_watcher)) {
+		return;
+	}
+	ev_io_stop(EV_DEFAULT, &metrics_watcher);
+	close(metrics_watcher.fd);
+	if (do_unlink) {
+		unlink(metrics_path);
+	}
+}
+
+static void natcapd_stop(EV_P)
+{
+	ev_signal_stop(EV_DEFAULT, &sigint_watcher);
+	ev_signal_stop(EV_DEFAULT, &sigterm_watcher);
+	ev_signal_stop(EV_DEFAULT, &sigchld_watcher);
+	ev_signal_stop(EV_DEFAULT, &sigusr1_watcher);
+	ev_signal_stop(EV_DEFAULT, &sigusr2_watcher);
+	ev_timer_stop(EV_DEFAULT, &drain_watcher);
+	for (int i = 0; i < worker_num; i++) {
+		ev_async_send(workers[i].loop, &workers[i].stop_watcher);
+	}
+	ev_unloop(EV_A_ EVUNLOOP_ALL);
+}
+
+/* exit once the accepted connections are gone or the deadline is reached */
+static void drain_cb(EV_P_ ev_timer *w, int revents)
+{
+	int conn = 0;
+
+	for (int i = 0; i < worker_num; i++) {
+		conn += workers[i].stats.server_conn;
+	}
+	if (conn == 0 || ev_now(EV_A) >= drain_deadline) {
+		printf("drain finished, %d connection(s) left\n", conn);
+		natcapd_stop(EV_A);
+	}
+}
+
+/* a closed listener of a reuseport group hands its queued connections to another one
+ * of the group instead of resetting them, linux 5.14 and later
+ */
+static void tcp_migrate_req_enable(void)
+{
+	int fd = open("/proc/sys/net/ipv4/tcp_migrate_req", O_WRONLY);
+
+	if (fd == -1) {
 		if (verbose) {
-			server_conn--;
-			printf("current server connection: %d\n", server_conn);
+			perror("tcp_migrate_req");
 		}
+		return;
 	}
+	if (write(fd, "1", 1) != 1 && verbose) {
+		perror("tcp_migrate_req");
+	}
+	close(fd);
 }
 
 static void signal_cb(EV_P_ ev_signal *w, int revents)
@@ -664,25 +2114,154 @@ static void signal_cb(EV_P_ ev_signal *w, int revents)
 		switch (w->signum) {
 		case SIGCHLD:
 			return;
+		case SIGUSR1:
+			stats_report(stdout);
+			return;
+		case SIGUSR2:
+			// reload: a new instance shares the port by SO_REUSEPORT, hand the accepts over to it
+			if (!ev_is_active(&drain_watcher)) {
+				printf("stop accepting, drain the connections in %d seconds\n", drain_timeout);
+				// the path belongs to the new instance now
+				metrics_close(0);
+				tcp_migrate_req_enable();
+				for (int i = 0; i < worker_num; i++) {
+					ev_async_send(workers[i].loop, &workers[i].drain_watcher);
+				}
+				drain_deadline = ev_now(EV_A) + drain_timeout;
+				ev_timer_start(EV_A_ & drain_watcher);
+			}
+			return;
 		case SIGINT:
 		case SIGTERM:
-			ev_signal_stop(EV_DEFAULT, &sigint_watcher);
-			ev_signal_stop(EV_DEFAULT, &sigterm_watcher);
-			ev_signal_stop(EV_DEFAULT, &sigchld_watcher);
-			ev_unloop(EV_A_ EVUNLOOP_ALL);
+			natcapd_stop(EV_A);
 		}
 	}
 }
 
+static void worker_stop_cb(EV_P_ ev_async *w, int revents)
+{
+	ev_unloop(EV_A_ EVUNLOOP_ALL);
+}
+
+/* the loop iteration latency is the time from poll returning to the next poll */
+static void worker_check_cb(EV_P_ ev_check *w, int revents)
+{
+	worker_t *worker = container_of(w, worker_t, check_watcher);
+	worker->wake_stamp = ev_time();
+}
+
+static void worker_prepare_cb(EV_P_ ev_prepare *w, int revents)
+{
+	worker_t *worker = container_of(w, worker_t, prepare_watcher);
+
+	if (worker->wake_stamp > 0) {
+		unsigned int usec = (ev_time() - worker->wake_stamp) * 1000000;
+		hist_add(worker->stats.loop_hist, loop_hist_bounds, LOOP_HIST_NUM, usec);
+		worker->stats.loop_usec += usec;
+		worker->wake_stamp = 0;
+	}
+}
+
+static int listen_pending(int fd)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+static void worker_drain_cb(EV_P_ ev_async *w, int revents)
+{
+	worker_t *worker = container_of(w, worker_t, drain_watcher);
+
+	worker->draining = 1;
+	for (int i = 0; i < worker->listen_num; i++) {
+		listen_ctx_t *listen_ctx = &worker->listen_ctx_list[i];
+
+#ifdef NATCAPD_IOURING
+		if (worker->uring != NULL) {
+			uring_accept_cancel(worker->uring, listen_ctx);
+		}
+#endif
+		ev_io_stop(EV_A_ & listen_ctx->io);
+		// take all that is queued, over the memory budget if need be; what comes in
+		// until the close is migrated to the new instance by tcp_migrate_req
+		while (listen_pending(listen_ctx->fd)) {
+			int serverfd = accept(listen_ctx->fd, NULL, NULL);
+			if (serverfd == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if (errno != EAGAIN && errno != EWOULDBLOCK) {
+					perror("accept");
+				}
+				break;
+			}
+			accept_fd(EV_A_ listen_ctx, serverfd);
+		}
+		close(listen_ctx->fd);
+		listen_ctx->fd = -1;
+	}
+}
+
+static void *worker_thread(void *arg)
+{
+	worker_t *worker = (worker_t *)arg;
+	sigset_t set;
+
+	/* signals are handled by the main thread */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGCHLD);
+	sigaddset(&set, SIGUSR1);
+	sigaddset(&set, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	worker_self = worker;
+
+	if (worker->cpu >= 0) {
+		cpu_set_t cpuset;
+		CPU_ZERO(&cpuset);
+		CPU_SET(worker->cpu, &cpuset);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) != 0) {
+			printf("worker[%d] failed to pin to cpu %d\n", worker->id, worker->cpu);
+		}
+	}
+
+	ev_run(worker->loop, 0);
+
+	return NULL;
+}
+
 static void accept_cb(EV_P_ ev_io *w, int revents)
 {
 	listen_ctx_t *listener = (listen_ctx_t *)w;
+
+	if (mem_exhausted()) {
+		// leave the new connections in the backlog until memory is back
+		worker_t *worker = listener->worker;
+		for (int i = 0; i < worker->listen_num; i++) {
+			ev_io_stop(EV_A_ & worker->listen_ctx_list[i].io);
+		}
+		worker->accept_paused = 1;
+		worker->stats.mem_pauses++;
+		return;
+	}
+
 	int serverfd           = accept(listener->fd, NULL, NULL);
 	if (serverfd == -1) {
 		perror("accept");
 		return;
 	}
 
+	accept_fd(EV_A_ listener, serverfd);
+}
+
+static void accept_fd(EV_P_ listen_ctx_t *listener, int serverfd)
+{
 	int opt = 1;
 	setsockopt(serverfd, SOL_TCP, TCP_NODELAY, &opt, sizeof(opt));
 #ifdef SO_NOSIGPIPE
@@ -690,11 +2269,20 @@ static void accept_cb(EV_P_ ev_io *w, int revents)
 #endif
 	setnonblocking(serverfd);
 
+	if (tfo_enabled && tfo_syn_data(serverfd)) {
+		worker_self->stats.tfo_accepts++;
+	}
+
 	if (verbose) {
 		printf("accept a connection\n");
 	}
 
 	server_t *server = new_server(serverfd, listener);
+	if (server == NULL) {
+		printf("out of memory\n");
+		close(serverfd);
+		return;
+	}
 	//ev_io_start(EV_A_ & server->recv_ctx->io);
 	ev_timer_start(EV_A_ & server->recv_ctx->watcher);
 
@@ -723,7 +2311,21 @@ static void accept_cb(EV_P_ ev_io *w, int revents)
 		info.ai_addr     = (struct sockaddr *)addr;
 
 #ifdef NATCAP_CLIENT_MODE
-		remote_t *remote = connect_to_remote(EV_A_ & info, server);
+		remote_t *remote = NULL;
+		warm_dest_t *dest = NULL;
+		if (worker_self->warm_dests != NULL && (dest = warm_dest_find(addr)) != NULL) {
+			int fd = warm_take(EV_A_ dest);
+			if (fd != -1) {
+				// remote_send_cb sees it connected at the first writable event
+				remote = new_remote(fd, server);
+				worker_self->stats.warm_hits++;
+			} else {
+				worker_self->stats.warm_misses++;
+			}
+		}
+		if (remote == NULL) {
+			remote = connect_to_remote(EV_A_ & info, server);
+		}
 #else
 		if (ito != 0) {
 			if (get_original_destaddr(server->fd, &bind_storage) != 0) {
@@ -743,6 +2345,12 @@ static void accept_cb(EV_P_ ev_io *w, int revents)
 		} else {
 			server->remote = remote;
 			remote->server = server;
+#ifdef NATCAPD_IOURING
+			if (worker_self->uring != NULL) {
+				uring_start(EV_A_ worker_self->uring, container_of(server, conn_t, server));
+				return;
+			}
+#endif
 			//ev_io_start(EV_A_ & remote->recv_ctx->io);
 			ev_io_start(EV_A_ & remote->send_ctx->io);
 		}
@@ -761,6 +2369,31 @@ void usage()
 	printf("       [-I]                       Bind input as output interface\n");
 #endif
 	printf("       [-t <timeout>]             Socket timeout in seconds.\n");
+	printf("       [-w <workers>]             Worker threads, 0 for one per cpu (default 1).\n");
+	printf("       [-p <pipe_size>]           Max splice pipe size in bytes, 0 to relay by copy (default %d).\n", PIPE_SIZE);
+	printf("       [-b <backend>]             Event backend: auto, select, poll, epoll"
+#ifdef EVBACKEND_LINUXAIO
+			", linuxaio"
+#endif
+#ifdef EVBACKEND_IOURING
+			", iouring"
+#endif
+#ifdef NATCAPD_IOURING
+			", uring"
+#endif
+			" (default %s).\n", NATCAPD_EV_BACKEND);
+#ifdef NATCAPD_IOURING
+	printf("                                  uring relays the data through io_uring, libev keeps the timers.\n");
+#endif
+	printf("       [-m <mbytes>]              Memory budget of the relay buffers in MB, 0 for unlimited (default %d).\n", MEM_BUDGET);
+#ifdef NATCAP_CLIENT_MODE
+	printf("       [-k <num>]                 Pre-connected sockets kept per -r server, split between the workers (default 0).\n");
+	printf("       [-r <ip:port>]             Upstream server the -k sockets are kept for, repeatable.\n");
+#endif
+	printf("       [-f]                       TCP Fast Open on the listener and the connects.\n");
+	printf("       [-d <seconds>]             Time to drain the connections after SIGUSR2 (default %d).\n", DRAIN_TIMEOUT);
+	printf("       [-u <path>]                Unix socket serving the metrics.\n");
+	printf("       [-a]                       Pin workers to cpus and steer connections by SO_INCOMING_CPU.\n");
 	printf("       [-v]                       Verbose mode.\n");
 	printf("       [-h, --help]               Print this message.\n");
 	printf("\n");
@@ -775,12 +2408,14 @@ int main(int argc, char **argv)
 	int server_num = 0;
 	const char *server_host[MAX_REMOTE_NUM];
 
+	char *backend = NATCAPD_EV_BACKEND;
+
 	opterr = 0;
 
 #ifdef NATCAP_CLIENT_MODE
-	while ((c = getopt_long(argc, argv, "s:l:t:hv", NULL, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "s:l:t:w:p:b:m:k:r:d:u:fahv", NULL, NULL)) != -1) {
 #else
-	while ((c = getopt_long(argc, argv, "s:l:It:hv", NULL, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "s:l:It:w:p:b:m:d:u:fahv", NULL, NULL)) != -1) {
 #endif
 		switch (c) {
 			case 's':
@@ -795,10 +2430,61 @@ int main(int argc, char **argv)
 			case 'I':
 				ito = 1;
 				break;
+#else
+			case 'k':
+				warm_pool_size = atoi(optarg);
+				if (warm_pool_size < 0) {
+					warm_pool_size = 0;
+				}
+				if (warm_pool_size > WARM_POOL_MAX * MAX_WORKER_NUM) {
+					warm_pool_size = WARM_POOL_MAX * MAX_WORKER_NUM;
+				}
+				break;
+			case 'r':
+				if (warm_server_num < MAX_REMOTE_NUM) {
+					if (warm_server_parse(optarg, &warm_servers[warm_server_num]) != 0) {
+						printf("invalid server: %s\n", optarg);
+						opterr = 1;
+						break;
+					}
+					warm_server_num++;
+				}
+				break;
 #endif
 			case 't':
 				timeout = optarg;
 				break;
+			case 'w':
+				worker_num = atoi(optarg);
+				break;
+			case 'a':
+				worker_affinity = 1;
+				break;
+			case 'f':
+				tfo_enabled = 1;
+				break;
+			case 'd':
+				drain_timeout = atoi(optarg);
+				break;
+			case 'u':
+				metrics_path = optarg;
+				break;
+			case 'b':
+				backend = optarg;
+				break;
+			case 'p':
+				pipe_size = atoi(optarg);
+				if (pipe_size <= 0) {
+					splice_enabled = 0;
+					pipe_size = PIPE_SIZE;
+				}
+				break;
+			case 'm':
+				mem_budget = atoi(optarg);
+				if (mem_budget < 0) {
+					mem_budget = 0;
+				}
+				break;
 			case 'v':
 				verbose = 1;
 				break;
@@ -825,6 +2511,42 @@ int main(int argc, char **argv)
 		timeout = "60";
 	}
 
+#ifdef NATCAP_CLIENT_MODE
+	if (warm_pool_size > 0 && warm_server_num == 0) {
+		printf("no -r server given, the warm pool is off\n");
+	}
+#endif
+
+#ifdef NATCAPD_IOURING
+	if (strcmp(backend, "uring") == 0) {
+		uring_enabled = 1;
+		backend = "auto";
+	}
+#endif
+	if (ev_backend_parse(backend, &ev_backend_flag) != 0) {
+		printf("unknown event backend: %s\n", backend);
+		usage();
+		exit(EXIT_FAILURE);
+	}
+	if (ev_backend_flag != EVFLAG_AUTO && !(ev_supported_backends() & ev_backend_flag)) {
+		printf("event backend %s is not supported here, fall back to auto\n", backend);
+		ev_backend_flag = EVFLAG_AUTO;
+	}
+
+	int cpu_num = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpu_num < 1) {
+		cpu_num = 1;
+	}
+	if (worker_num <= 0) {
+		worker_num = cpu_num;
+	}
+	if (worker_num > MAX_WORKER_NUM) {
+		worker_num = MAX_WORKER_NUM;
+	}
+	// every worker owns a listener of the same address, and a reloaded
+	// instance binds next to the draining one
+	reuse_port = 1;
+
 	// ignore SIGPIPE
 	signal(SIGPIPE, SIG_IGN);
 	signal(SIGABRT, SIG_IGN);
@@ -832,61 +2554,174 @@ int main(int argc, char **argv)
 	ev_signal_init(&sigint_watcher, signal_cb, SIGINT);
 	ev_signal_init(&sigterm_watcher, signal_cb, SIGTERM);
 	ev_signal_init(&sigchld_watcher, signal_cb, SIGCHLD);
+	ev_signal_init(&sigusr1_watcher, signal_cb, SIGUSR1);
+	ev_signal_init(&sigusr2_watcher, signal_cb, SIGUSR2);
+	ev_timer_init(&drain_watcher, drain_cb, 1, 1);
 	ev_signal_start(EV_DEFAULT, &sigint_watcher);
 	ev_signal_start(EV_DEFAULT, &sigterm_watcher);
 	ev_signal_start(EV_DEFAULT, &sigchld_watcher);
+	ev_signal_start(EV_DEFAULT, &sigusr1_watcher);
+	ev_signal_start(EV_DEFAULT, &sigusr2_watcher);
 
 	// initialize ev loop
 	struct ev_loop *loop = EV_DEFAULT;
 
-	// initialize listen context
-	listen_ctx_t listen_ctx_list[server_num];
+	workers = calloc(worker_num, sizeof(worker_t));
+	if (workers == NULL) {
+		FATAL("calloc() error");
+	}
 
-	// bind to each interface
-	for (int i = 0; i < server_num; i++) {
-		const char *host = server_host[i];
+	for (int w = 0; w < worker_num; w++) {
+		worker_t *worker = &workers[w];
 
-		// Bind to port
-		int listenfd;
-		listenfd = create_and_bind(host, server_port);
-		if (listenfd == -1) {
-			FATAL("bind() error");
+		worker->id = w;
+		worker->cpu = worker_affinity ? w % cpu_num : -1;
+		worker->mem_budget = ((uint64_t)mem_budget << 20) / worker_num;
+		worker->loop = ev_loop_new(ev_backend_flag);
+		if (worker->loop == NULL && ev_backend_flag != EVFLAG_AUTO) {
+			printf("worker[%d] failed to init event backend %s, fall back to auto\n", w, backend);
+			worker->loop = ev_loop_new(EVFLAG_AUTO);
 		}
-		if (listen(listenfd, MAXCONN) == -1) {
-			FATAL("listen() error");
+		if (worker->loop == NULL) {
+			FATAL("ev_loop_new() error");
 		}
-		setnonblocking(listenfd);
-		listen_ctx_t *listen_ctx = &listen_ctx_list[i];
+#ifdef NATCAPD_IOURING
+		if (uring_enabled) {
+			worker->uring = uring_init(worker);
+			if (worker->uring == NULL) {
+				printf("worker[%d] failed to set up io_uring, relay by libev\n", w);
+			}
+		}
+#endif
+		ev_async_init(&worker->stop_watcher, worker_stop_cb);
+		ev_async_start(worker->loop, &worker->stop_watcher);
+		ev_async_init(&worker->drain_watcher, worker_drain_cb);
+		ev_async_start(worker->loop, &worker->drain_watcher);
+		if (metrics_path != NULL) {
+			ev_prepare_init(&worker->prepare_watcher, worker_prepare_cb);
+			ev_prepare_start(worker->loop, &worker->prepare_watcher);
+			ev_check_init(&worker->check_watcher, worker_check_cb);
+			ev_check_start(worker->loop, &worker->check_watcher);
+		}
+#ifdef NATCAP_CLIENT_MODE
+		if (warm_pool_size > 0 && warm_server_num > 0) {
+			warm_init(worker);
+		}
+#endif
 
-		// Setup proxy context
-		listen_ctx->timeout = atoi(timeout);
-		listen_ctx->fd      = listenfd;
-		listen_ctx->loop    = loop;
+		// initialize listen context
+		worker->listen_num = server_num;
+		worker->listen_ctx_list = calloc(server_num, sizeof(listen_ctx_t));
+		if (worker->listen_ctx_list == NULL) {
+			FATAL("calloc() error");
+		}
 
-		ev_io_init(&listen_ctx->io, accept_cb, listenfd, EV_READ);
-		ev_io_start(loop, &listen_ctx->io);
+		// bind to each interface
+		for (int i = 0; i < server_num; i++) {
+			const char *host = server_host[i];
 
-		printf("tcp server listening at %s:%s\n", host ? host : "0.0.0.0", server_port);
+			// Bind to port
+			int listenfd;
+			listenfd = create_and_bind(host, server_port);
+			if (listenfd == -1) {
+				FATAL("bind() error");
+			}
+			if (worker->cpu >= 0) {
+				// prefer the connections received by the rx queue of this cpu
+				setsockopt(listenfd, SOL_SOCKET, SO_INCOMING_CPU, &worker->cpu, sizeof(worker->cpu));
+			}
+			if (listen(listenfd, MAXCONN) == -1) {
+				FATAL("listen() error");
+			}
+			setnonblocking(listenfd);
+			listen_ctx_t *listen_ctx = &worker->listen_ctx_list[i];
+
+			// Setup proxy context
+			listen_ctx->timeout = atoi(timeout);
+			listen_ctx->fd      = listenfd;
+			listen_ctx->loop    = worker->loop;
+			listen_ctx->worker  = worker;
+
+			ev_io_init(&listen_ctx->io, accept_cb, listenfd, EV_READ);
+#ifdef NATCAPD_IOURING
+			if (worker->uring != NULL) {
+				uring_accept_arm(worker->uring, listen_ctx);
+			} else
+#endif
+			ev_io_start(worker->loop, &listen_ctx->io);
+
+			if (w == 0) {
+				printf("tcp server listening at %s:%s\n", host ? host : "0.0.0.0", server_port);
+			}
+		}
+	}
+	printf("%d worker(s) started, event backend %s\n", worker_num, ev_backend_name(ev_backend(workers[0].loop)));
+#ifdef NATCAPD_IOURING
+	if (workers[0].uring != NULL) {
+		printf("relay by io_uring, %u buffers of %d bytes per worker, %d fixed files\n",
+				workers[0].uring->buf_num, URING_BUF_SIZE, workers[0].uring->files_num);
 	}
+#endif
 
+	if (metrics_path != NULL) {
+		int metrics_fd = metrics_listen(metrics_path);
+		if (metrics_fd == -1) {
+			perror("metrics");
+			FATAL("metrics_listen() error");
+		}
+		ev_io_init(&metrics_watcher, metrics_accept_cb, metrics_fd, EV_READ);
+		ev_io_start(loop, &metrics_watcher);
+		printf("metrics at %s\n", metrics_path);
+	}
 
 	if (geteuid() == 0) {
 		printf("running from root user\n");
 	}
 
+	for (int w = 0; w < worker_num; w++) {
+		if (pthread_create(&workers[w].tid, NULL, worker_thread, &workers[w]) != 0) {
+			FATAL("pthread_create() error");
+		}
+	}
+
 	// start ev loop
 	ev_run(loop, 0);
 
+	for (int w = 0; w < worker_num; w++) {
+		pthread_join(workers[w].tid, NULL);
+	}
+
 	if (verbose) {
+		stats_report(stdout);
 		printf("closed gracefully\n");
 	}
 
 	// Clean up
-	for (int i = 0; i < server_num; i++) {
-		listen_ctx_t *listen_ctx = &listen_ctx_list[i];
-		ev_io_stop(loop, &listen_ctx->io);
-		close(listen_ctx->fd);
+	metrics_close(1);
+	for (int w = 0; w < worker_num; w++) {
+		worker_t *worker = &workers[w];
+		for (int i = 0; i < worker->listen_num; i++) {
+			listen_ctx_t *listen_ctx = &worker->listen_ctx_list[i];
+			if (listen_ctx->fd == -1) {
+				continue;
+			}
+			ev_io_stop(worker->loop, &listen_ctx->io);
+			close(listen_ctx->fd);
+		}
+		free(worker->listen_ctx_list);
+#ifdef NATCAP_CLIENT_MODE
+		if (worker->warm_dests != NULL) {
+			warm_cleanup(worker);
+		}
+#endif
+#ifdef NATCAPD_IOURING
+		if (worker->uring != NULL) {
+			uring_exit(worker);
+		}
+#endif
+		ev_loop_destroy(worker->loop);
 	}
+	free(workers);
 
 	return 0;
 }
@@ -2,22 +2,151 @@
 #define _NATCAPD_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <time.h>
+#include <netinet/in.h>
 #include <ev.h>
 #include "natcap.h"
 
 typedef struct {
 	int idx;
 	int len;
-#define BUF_SIZE 2048
-	unsigned char data[BUF_SIZE];
+	int cls; /* size class of data, or of the pipe */
+	int grow; /* class step applied when data go back to the pool */
+	int pipefd[2]; /* splice pipe, -1 on the copy path */
+	unsigned char *data; /* pooled, only taken on the copy path */
+#ifdef NATCAPD_IOURING
+	int bid; /* provided buffer of the ring held by data */
+#endif
 } buffer_t;
 
+/* buffer size classes, a buffer starts at the smallest and grows with the throughput */
+#define BUF_CLASS_NUM 4
+#define BUF_CLASS_DEFAULT 0
+#define BUF_CLASS_MAX (BUF_CLASS_NUM - 1)
+#define BUF_CLASS_SIZE(cls) (512 << ((cls) * 2))
+/* splice pipes take the same classes in pages, the last one is the -p size */
+#define PIPE_CLASS_SIZE(cls) (4096 << ((cls) * 2))
+
+/* histogram buckets, the last one takes everything above the bounds */
+#define CONNECT_HIST_NUM 12
+#define LOOP_HIST_NUM 8
+#define ERRNO_NUM 256
+
+typedef struct worker_stats {
+	uint64_t tx;
+	uint64_t rx;
+	uint64_t server_total;
+	uint64_t remote_total;
+	uint64_t mem_used; /* relay bytes held in buffers and pipes */
+	uint64_t mem_pauses;
+	uint64_t warm_hits;
+	uint64_t warm_misses;
+	uint64_t tfo_accepts; /* accepted with data in the SYN */
+	uint64_t tfo_hits; /* data in our SYN acked by the destination */
+	uint64_t tfo_fallbacks;
+	uint64_t timeouts;
+	uint64_t connect_usec; /* sum of connect_hist */
+	uint64_t connect_hist[CONNECT_HIST_NUM];
+	uint64_t tfo_response_usec; /* sum of tfo_response_hist */
+	uint64_t tfo_response_hist[CONNECT_HIST_NUM]; /* SYN with data to the first response */
+	uint64_t connect_errors[ERRNO_NUM];
+	uint64_t loop_usec; /* sum of loop_hist */
+	uint64_t loop_hist[LOOP_HIST_NUM];
+	int server_conn;
+	int remote_conn;
+} worker_stats_t;
+
+#ifdef NATCAPD_IOURING
+#include <liburing.h>
+
+#define URING_ENTRIES 4096
+#define URING_BGID 0
+#define URING_BUF_SIZE 16384
+#define URING_BUF_MIN 64
+#define URING_BUF_MAX 32768 /* ring entries limit */
+#define URING_BUF_DEFAULT 4096 /* without a memory budget */
+#define URING_FILES_MAX 131072
+
+/* the op of an sqe is kept in the low bits of its object pointer */
+#define URING_OP_ACCEPT   1
+#define URING_OP_CONNECT  2
+#define URING_OP_SRV_RECV 3 /* client to remote */
+#define URING_OP_SRV_SEND 4
+#define URING_OP_RMT_RECV 5 /* remote to client */
+#define URING_OP_RMT_SEND 6
+#define URING_OP_CANCEL   7 /* of the accept */
+#define URING_OP_MASK 0x7
+
+typedef struct uring_ctx {
+	struct io_uring ring;
+	ev_io io; /* the ring fd, readable with completions */
+	ev_prepare prepare; /* submits the sqes queued in a loop iteration */
+	struct io_uring_buf_ring *br;
+	unsigned char *bufs;
+	unsigned int buf_num;
+	int files_num; /* fds below it are registered at the slot of their number */
+	uint64_t *retry; /* ops that found the sq full, issued again after the cq is reaped */
+	unsigned int retry_num;
+	unsigned int retry_size;
+} uring_ctx_t;
+#endif
+
+#ifdef NATCAP_CLIENT_MODE
+#define WARM_POOL_MAX 16 /* per worker and server */
+#define WARM_IDLE_TIMEOUT 20
+#define WARM_CHECK_INTERVAL 1
+
+/* pre-connected sockets kept for a configured upstream server */
+typedef struct warm_fd {
+	ev_io io;
+	int fd; /* -1 for a free slot */
+	int connected;
+	ev_tstamp stamp;
+	struct warm_dest *dest;
+} warm_fd_t;
+
+typedef struct warm_dest {
+	struct sockaddr_in addr;
+	int quota; /* share of -k taken by this worker */
+	int num;
+	warm_fd_t fds[WARM_POOL_MAX];
+} warm_dest_t;
+#endif
+
+typedef struct worker {
+	int id;
+	int cpu;
+	pthread_t tid;
+	struct ev_loop *loop;
+	ev_async stop_watcher;
+	ev_async drain_watcher;
+	int draining; /* listeners closed, serving the accepted connections only */
+	ev_prepare prepare_watcher;
+	ev_check check_watcher;
+	ev_tstamp wake_stamp; /* poll returned */
+	int listen_num;
+	struct listen_ctx *listen_ctx_list;
+	uint64_t mem_budget; /* share of the memory budget, 0 for unlimited */
+	int accept_paused;
+	struct conn *wait_list; /* connections with reads paused by the budget */
+#ifdef NATCAPD_IOURING
+	struct uring_ctx *uring; /* io_uring relay, NULL on the libev one */
+#endif
+#ifdef NATCAP_CLIENT_MODE
+	ev_timer warm_timer;
+	struct warm_dest *warm_dests; /* one per -r server */
+#endif
+	worker_stats_t stats;
+} __attribute__((aligned(64))) worker_t;
+
 typedef struct listen_ctx {
 	ev_io io;
 	int fd;
 	int timeout;
 	struct ev_loop *loop;
+	struct worker *worker;
 } listen_ctx_t;
 
 typedef struct server_ctx {
@@ -47,6 +176,9 @@ typedef struct remote_ctx {
 
 typedef struct remote {
 	int fd;
+	int tfo;
+	ev_tstamp connect_start;
+	ev_timer tfo_timer; /* a deferred connect without client data sends a plain SYN */
 
 	buffer_t *buf;
 
@@ -55,6 +187,39 @@ typedef struct remote {
 	struct server *server;
 } remote_t;
 
+/* both sides of a proxied connection live in one object */
+typedef struct conn {
+	server_t server;
+	remote_t remote;
+	server_ctx_t server_recv_ctx;
+	server_ctx_t server_send_ctx;
+	remote_ctx_t remote_recv_ctx;
+	remote_ctx_t remote_send_ctx;
+	buffer_t server_buf;
+	buffer_t remote_buf;
+	int refs;
+	int wait; /* CONN_WAIT_* */
+	struct conn *wait_prev;
+	struct conn *wait_next;
+#ifdef NATCAPD_IOURING
+	int inflight; /* sqes not completed yet */
+	int closing;
+	struct sockaddr_storage dest; /* read by the connect sqe */
+#endif
+} __attribute__((aligned(64))) conn_t;
+
+#define CONN_WAIT_SERVER 0x1 /* server recv paused */
+#define CONN_WAIT_REMOTE 0x2 /* remote recv paused */
+
+#define TFO_NONE  0 /* plain connect                      */
+#define TFO_DEFER 1 /* connect deferred to the first send */
+#define TFO_SENT  2 /* SYN sent with the first payload    */
+#define TFO_DONE  3 /* splice pipe set up after the SYN   */
+/* the client of a server-speaks-first protocol (ssh, smtp, ...) sends nothing, so a
+ * deferred connect gives up waiting for the first payload after this long
+ */
+#define TFO_DEFER_TIMEOUT 0.2
+
 #define STAGE_ERROR     -1  /* Error detected                   */
 #define STAGE_INIT       0  /* Initial stage                    */
 #define STAGE_HANDSHAKE  1  /* Handshake with client            */
@@ -72,6 +237,12 @@ typedef struct remote {
 
 #define MAX_REQUEST_TIMEOUT 30
 #define MAX_REMOTE_NUM 10
+#define MAX_WORKER_NUM 64
+#define PIPE_SIZE 65536
+#define CONN_POOL_MAX 4096
+#define BUF_POOL_MAX 1024
+#define MEM_BUDGET 256 /* MB */
+#define DRAIN_TIMEOUT 300
 
 void
 FATAL(const char *msg)
@@ -5,7 +5,47 @@ cd "$vmroot"
 vmroot=`pwd`
 cd -
 
-test -c /dev/natcap_ctl && echo natcap_redirect_port=1080 >/dev/natcap_ctl
+port=1080
+
+# the pid listens on the port
+natcapd_listening()
+{
+	if command -v ss >/dev/null 2>&1; then
+		ss -ltnp 2>/dev/null | grep ":$port " | grep -q "pid=$1,"
+	else
+		netstat -ltnp 2>/dev/null | grep ":$port " | grep -q " $1/"
+	fi
+}
+
+if [ "x$1" = "xreload" ]; then
+	# start the new server next to the running one, which then drains and exits
+	old=`pidof natcapd-server`
+	sh "$vmroot/natcapd.server.load.sh" &
+	new=
+	for i in 1 2 3 4 5 6 7 8 9 10; do
+		sleep 1
+		for pid in `pidof natcapd-server`; do
+			echo " $old " | grep -q " $pid " || new=$pid
+		done
+		test -n "$new" && kill -0 $new 2>/dev/null && natcapd_listening $new && break
+		new=
+	done
+	# hand the port over only to a live, listening server
+	if [ -z "$new" ]; then
+		echo "natcapd-server reload failed, keep running $old"
+		for pid in `pidof natcapd-server`; do
+			echo " $old " | grep -q " $pid " || kill $pid
+		done
+		exit 1
+	fi
+	test -n "$old" && kill -USR2 $old
+	exit 0
+fi
+
+test -c /dev/natcap_ctl && echo natcap_redirect_port=$port >/dev/natcap_ctl
 ulimit -n 100000
-$vmroot/natcapd-server -t 900
+$vmroot/natcapd-server -t 900 -l $port
+# a reloaded server may still be running on the port
+pidof natcapd-server >/dev/null || {
 test -c /dev/natcap_ctl && echo natcap_redirect_port=0 >/dev/natcap_ctl
+}
@@ -22,9 +22,12 @@ debug=3
 disabled=0
 EOF
 
-# reload natcapd-server
-killall natcapd-server 2>/dev/null
-sh ./natcapd/natcapd.server.load.sh &
+# reload natcapd-server, the running one drains its connections
+if pidof natcapd-server >/dev/null; then
+	sh ./natcapd/natcapd.server.load.sh reload
+else
+	sh ./natcapd/natcapd.server.load.sh &
+fi
 
 }
 